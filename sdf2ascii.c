@@ -21,6 +21,7 @@
 #include <string.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include "sdf.h"
 #include "commit_info.h"
 
@@ -32,6 +33,14 @@
 
 #define VERSION "2.6.7"
 
+/* Maximum number of array elements read and printed at a time */
+#define CHUNK_ELEMENTS (1024 * 1024)
+
+/* Number of elements per line when no count is given */
+#define DEFAULT_COUNT 10
+
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
+
 #define DBG_FLUSH() do { \
         if (h && h->dbg_buf) { \
             h->dbg = h->dbg_buf; *h->dbg = '\0'; \
@@ -44,8 +53,14 @@
         } \
     } while (0)
 
+#define DBG_FPRINT_FLUSH(fd) do { \
+        if (h && h->dbg_buf) { \
+            fputs(h->dbg_buf, fd); h->dbg = h->dbg_buf; *h->dbg = '\0'; \
+        } \
+    } while (0)
+
 int metadata, contents, debug, single, use_mmap, ignore_summary;
-int element_count, ignore_nblocks;
+int element_count, ignore_nblocks, nthreads;
 struct id_list {
     char *id;
     struct id_list *next;
@@ -57,6 +72,8 @@ struct range_type {
     int start, end;
 } *range_list;
 
+int sdf_free_block_data(sdf_file_t *h, sdf_block_t *b);
+
 
 void usage(int err)
 {
@@ -72,6 +89,9 @@ void usage(int err)
   -b --no-nblocks      Ignore the header value for nblocks\n\
   -C --count=n         When printing array contents, write 'n' elements per\n\
                        line.\n\
+  -t --threads=n       Print the contents of different blocks on 'n' threads,\n\
+                       each reading the file through its own handle.\n\
+                       The output is the same as for a single thread.\n\
   -V --version         Print version information and exit\n\
 ");
 /*
@@ -106,6 +126,7 @@ char *parse_args(int *argc, char ***argv)
         { "mmap",          no_argument,       NULL, 'm' },
         { "no-metadata",   no_argument,       NULL, 'n' },
         { "single",        no_argument,       NULL, 's' },
+        { "threads",       required_argument, NULL, 't' },
         { "variable",      required_argument, NULL, 'v' },
         { "version",       no_argument,       NULL, 'V' },
         { NULL,            0,                 NULL,  0  }
@@ -117,10 +138,11 @@ char *parse_args(int *argc, char ***argv)
     variable_ids = NULL;
     last_id = NULL;
     nbuf = nrange = element_count = 0;
+    nthreads = 1;
     sz = sizeof(struct range_type);
 
     while ((c = getopt_long(*argc, *argv,
-            "bcC:himnsv:V", longopts, NULL)) != -1) {
+            "bcC:himnst:v:V", longopts, NULL)) != -1) {
         switch (c) {
         case 'b':
             ignore_nblocks = 1;
@@ -147,6 +169,10 @@ char *parse_args(int *argc, char ***argv)
         case 's':
             single = 1;
             break;
+        case 't':
+            nthreads = strtol(optarg, NULL, 10);
+            if (nthreads < 1) nthreads = 1;
+            break;
         case 'V':
             printf("sdf2ascii version %s\n", VERSION);
             printf("commit info: %s, %s\n", SDF_COMMIT_ID, SDF_COMMIT_DATE);
@@ -248,12 +274,394 @@ char *parse_args(int *argc, char ***argv)
 }
 
 
+/* Check whether a block is selected by the -v option */
+static int block_selected(sdf_block_t *b, int idx, int *range_start)
+{
+    struct id_list *var;
+    int n;
+
+    if (!variable_ids && !nrange)
+        return 1;
+
+    for (n = *range_start; n < nrange; n++) {
+        if (idx < range_list[n].start)
+            break;
+        if (idx <= range_list[n].end)
+            return 1;
+        (*range_start)++;
+    }
+
+    for (var = variable_ids; var; var = var->next) {
+        if (!memcmp(b->id, var->id, strlen(var->id)+1))
+            return 1;
+    }
+
+    return 0;
+}
+
+
+struct selected_block {
+    sdf_block_t *b;
+    int idx, pos;
+};
+
+
+static int offset_sort(const void *v1, const void *v2)
+{
+    const struct selected_block *s1 = v1, *s2 = v2;
+
+    if (s1->b->data_location != s2->b->data_location)
+        return (s1->b->data_location < s2->b->data_location) ? -1 : 1;
+
+    return s1->idx - s2->idx;
+}
+
+
+/* Plain and point variables are formatted here rather than by the library */
+static int streamed_block(sdf_block_t *b)
+{
+    if (b->blocktype != SDF_BLOCKTYPE_PLAIN_VARIABLE
+            && b->blocktype != SDF_BLOCKTYPE_POINT_VARIABLE)
+        return 0;
+
+    switch (b->datatype_out) {
+    case SDF_DATATYPE_INTEGER4:
+    case SDF_DATATYPE_INTEGER8:
+    case SDF_DATATYPE_REAL4:
+    case SDF_DATATYPE_REAL8:
+    case SDF_DATATYPE_CHARACTER:
+    case SDF_DATATYPE_LOGICAL:
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Print the n values of a section starting at element 'first' of the whole
+ * array. Lines are broken at multiples of 'count' elements of the whole
+ * array and start with the global index of their first element, so the text
+ * does not depend on how the array was split into sections.
+ */
+static void print_values(sdf_block_t *b, int ndims, int64_t total,
+                         int64_t first, int64_t n, int count, FILE *fd)
+{
+    int64_t i, idx;
+    int d;
+
+    for (i = 0; i < n; i++, first++) {
+        if (first % count == 0) {
+            idx = first;
+            fputs("  (", fd);
+            for (d = 0; d < ndims; d++) {
+                fprintf(fd, d ? ",%" PRIi64 : "%" PRIi64, idx % b->dims[d]);
+                idx /= b->dims[d];
+            }
+            fputc(')', fd);
+        }
+
+        switch (b->datatype_out) {
+        case SDF_DATATYPE_INTEGER4:
+            fprintf(fd, " %i", ((int32_t *)b->data)[i]);
+            break;
+        case SDF_DATATYPE_INTEGER8:
+            fprintf(fd, " %" PRIi64, ((int64_t *)b->data)[i]);
+            break;
+        case SDF_DATATYPE_REAL4:
+            fprintf(fd, " %.9g", ((float *)b->data)[i]);
+            break;
+        case SDF_DATATYPE_REAL8:
+            fprintf(fd, " %.17g", ((double *)b->data)[i]);
+            break;
+        default:
+            fprintf(fd, " %i", ((char *)b->data)[i]);
+        }
+
+        if ((first + 1) % count == 0 || first + 1 == total)
+            fputc('\n', fd);
+    }
+}
+
+
+/*
+ * Print the contents of a block. Plain and point variables are read as a
+ * sequence of array sections along their outermost dimensions, each of
+ * which is printed, flushed and freed before the next one is read, so the
+ * memory used does not depend on the size of the block. Other blocks are
+ * small and are printed by the library as they are read.
+ */
+static void print_block_data(sdf_file_t *h, sdf_block_t *b, FILE *fd)
+{
+    int64_t starts[SDF_MAXDIMS], ends[SDF_MAXDIMS], strides[SDF_MAXDIMS];
+    int64_t len, chunk, total, first;
+    int i, d, ndims, print, count;
+
+    h->current_block = b;
+
+    if (!streamed_block(b)) {
+        sdf_read_data(h);
+        DBG_FPRINT_FLUSH(fd);
+        sdf_free_block_data(h, b);
+        return;
+    }
+
+    ndims = (b->blocktype == SDF_BLOCKTYPE_PLAIN_VARIABLE) ? b->ndims : 1;
+    if (ndims < 1 || ndims > SDF_MAXDIMS) return;
+
+    total = 1;
+    for (d = 0; d < ndims; d++)
+        total *= b->dims[d];
+
+    fprintf(fd, "\n  Data for block: %s, dims:", b->id);
+    for (d = 0; d < ndims; d++)
+        fprintf(fd, " %" PRIi64, b->dims[d]);
+    fputc('\n', fd);
+    if (total <= 0) return;
+
+    count = (h->array_count > 0) ? h->array_count : DEFAULT_COUNT;
+
+    /*
+     * Dimensions below d are read in full, dimension d is split into chunks
+     * and dimensions above d are stepped through one index at a time. Each
+     * section is then a contiguous run of elements of the whole array.
+     */
+    len = 1;
+    for (d = 0; d < ndims - 1; d++) {
+        if (len * b->dims[d] > CHUNK_ELEMENTS)
+            break;
+        len *= b->dims[d];
+    }
+
+    chunk = CHUNK_ELEMENTS / len;
+    if (chunk < 1) chunk = 1;
+
+    for (i = 0; i < ndims; i++) {
+        starts[i] = 0;
+        ends[i] = (i < d) ? b->dims[i] : 1;
+        strides[i] = 1;
+    }
+
+    /* The values are formatted here, so the library must not print them */
+    print = h->print;
+    h->print = 0;
+    first = 0;
+
+    while (1) {
+        ends[d] = MIN(starts[d] + chunk, b->dims[d]);
+        sdf_block_set_array_section(b, ndims, starts, ends, strides);
+        sdf_read_data(h);
+        DBG_FLUSH();
+        if (!b->data) {
+            fprintf(stderr, "Error reading block %s\n", b->id);
+            break;
+        }
+        print_values(b, ndims, total, first, b->nelements_local, count, fd);
+        first += b->nelements_local;
+        sdf_free_block_data(h, b);
+
+        starts[d] = ends[d];
+        if (starts[d] < b->dims[d])
+            continue;
+        starts[d] = 0;
+
+        for (i = d + 1; i < ndims; i++) {
+            starts[i]++;
+            if (starts[i] < b->dims[i]) {
+                ends[i] = starts[i] + 1;
+                break;
+            }
+            starts[i] = 0;
+            ends[i] = 1;
+        }
+        if (i >= ndims)
+            break;
+    }
+
+    /* Leave the block set up to be read in full */
+    for (i = 0; i < ndims; i++) {
+        starts[i] = 0;
+        strides[i] = 1;
+    }
+    sdf_block_set_array_section(b, ndims, starts, b->dims, strides);
+    h->print = print;
+}
+
+
+/*
+ * Rendering of block contents on several threads.
+ *
+ * Each thread has its own handle on the file, so that the current block and
+ * debug buffer of a handle are only used by one thread. Blocks are handed
+ * out in the order in which their data is stored and the text for each one
+ * goes to a temporary file. The main thread copies these to stdout in block
+ * order as soon as they are complete.
+ */
+
+struct render_job {
+    struct selected_block *selected;
+    int nselected, next;
+    FILE **output;
+    int *done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct render_thread {
+    struct render_job *job;
+    sdf_file_t *h;
+    pthread_t thread;
+};
+
+
+static void set_handle_options(sdf_file_t *h)
+{
+    if (element_count > 0) h->array_count = element_count;
+
+    h->use_float = single;
+    h->print = debug;
+    if (ignore_summary) h->use_summary = 0;
+    if (ignore_nblocks) h->ignore_nblocks = 1;
+}
+
+
+static void *render_worker(void *arg)
+{
+    struct render_thread *t = arg;
+    struct render_job *job = t->job;
+    sdf_file_t *h = t->h;
+    sdf_block_t *b, **blocks;
+    FILE *fd;
+    int i, k;
+
+    blocks = malloc((h->nblocks > 0 ? h->nblocks : 1) * sizeof(*blocks));
+    b = h->blocklist;
+    for (i = 0; b && i < h->nblocks; i++, b = b->next)
+        blocks[i] = b;
+
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        k = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (k >= job->nselected)
+            break;
+
+        fd = tmpfile();
+        if (fd && job->selected[k].idx < i)
+            print_block_data(h, blocks[job->selected[k].idx], fd);
+        else if (!fd)
+            fprintf(stderr, "Error creating temporary file\n");
+
+        pthread_mutex_lock(&job->lock);
+        job->output[job->selected[k].pos] = fd;
+        job->done[job->selected[k].pos] = 1;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    free(blocks);
+
+    return NULL;
+}
+
+
+static int render_blocks(char *file, comm_t comm,
+                         struct selected_block *selected, int nselected)
+{
+    struct render_job job;
+    struct render_thread *threads;
+    sdf_file_t *h;
+    char buf[4096];
+    size_t len;
+    int i, n, nthr, started;
+
+    nthr = nthreads < nselected ? nthreads : nselected;
+    threads = calloc(nthr, sizeof(*threads));
+    if (!threads) {
+        fprintf(stderr, "Unable to allocate threads\n");
+        return 1;
+    }
+
+    for (n = 0; n < nthr; n++) {
+        h = threads[n].h = sdf_open(file, comm, SDF_READ, use_mmap);
+        if (!h) {
+            fprintf(stderr, "Error opening file %s\n", file);
+            while (n-- > 0)
+                sdf_close(threads[n].h);
+            free(threads);
+            return 1;
+        }
+        set_handle_options(h);
+        sdf_read_header(h);
+        sdf_read_blocklist(h);
+        DBG_FLUSH();
+        h->print = 1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.selected = selected;
+    job.nselected = nselected;
+    job.output = calloc(nselected, sizeof(*job.output));
+    job.done = calloc(nselected, sizeof(*job.done));
+    if (!job.output || !job.done) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        for (n = 0; n < nthr; n++)
+            sdf_close(threads[n].h);
+        free(job.output);
+        free(job.done);
+        free(threads);
+        return 1;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    for (started = 0; started < nthr; started++) {
+        threads[started].job = &job;
+        if (pthread_create(&threads[started].thread, NULL, render_worker,
+                           &threads[started]))
+            break;
+    }
+
+    /* If a thread could not be started then do its share here instead */
+    if (started < nthr)
+        render_worker(&threads[started]);
+
+    for (i = 0; i < nselected; i++) {
+        pthread_mutex_lock(&job.lock);
+        while (!job.done[i])
+            pthread_cond_wait(&job.cond, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+
+        if (!job.output[i]) continue;
+
+        rewind(job.output[i]);
+        while ((len = fread(buf, 1, sizeof(buf), job.output[i])) > 0)
+            fwrite(buf, 1, len, stdout);
+        fclose(job.output[i]);
+    }
+
+    for (n = 0; n < started; n++)
+        pthread_join(threads[n].thread, NULL);
+    for (n = 0; n < nthr; n++)
+        sdf_close(threads[n].h);
+
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+    free(job.output);
+    free(job.done);
+    free(threads);
+
+    return 0;
+}
+
+
 int main(int argc, char **argv)
 {
     char *file = NULL;
-    int i, n, block, err, found, print_block, range_start;
+    int i, block, err, found, print_block, range_start, nselected, in_order;
     sdf_file_t *h;
     sdf_block_t *b;
+    struct selected_block *selected;
     comm_t comm;
 
     if (sdf_has_debug_info() == 0) {
@@ -278,12 +686,7 @@ int main(int argc, char **argv)
         fprintf(stderr, "Error opening file %s\n", file);
         return 1;
     }
-    if (element_count > 0) h->array_count = element_count;
-
-    h->use_float = single;
-    h->print = debug;
-    if (ignore_summary) h->use_summary = 0;
-    if (ignore_nblocks) h->ignore_nblocks = 1;
+    set_handle_options(h);
 
     sdf_read_header(h);
     h->current_block = NULL;
@@ -318,31 +721,8 @@ int main(int argc, char **argv)
         if (print_block) printf("\n  Block number: %i\n", i+1);
         sdf_read_block_info(h);
 
-        if (print_block) {
-            found = 0;
-
-            for (n = range_start; n < nrange; n++) {
-                if ((i+1) < range_list[n].start)
-                    break;
-                if ((i+1) <= range_list[n].end) {
-                    found = 1;
-                    break;
-                }
-                range_start++;
-            }
-
-            if (!found && variable_ids) {
-                last_id = variable_ids;
-                while (last_id) {
-                    if (!memcmp(h->current_block->id, last_id->id,
-                            strlen(last_id->id)+1)) {
-                        found = 1;
-                        break;
-                    }
-                    last_id = last_id->next;
-                }
-            }
-        }
+        if (print_block)
+            found = block_selected(h->current_block, i+1, &range_start);
 
         if (found)
             DBG_PRINT_FLUSH();
@@ -364,54 +744,48 @@ int main(int argc, char **argv)
 
     if (!contents) return 0;
 
-    found = 1;
+    /*
+     * Only the data of the selected blocks is read, in the order in which it
+     * is stored in the file.
+     */
+    selected = malloc((h->nblocks > 0 ? h->nblocks : 1) * sizeof(*selected));
+    nselected = 0;
     range_start = 0;
-    if (variable_ids || nrange) print_block = 1;
-
-    b = h->current_block = h->blocklist;
-
-    for (i=0; i<h->nblocks; i++) {
-        b = h->current_block;
-        if (print_block) {
-            found = 0;
+    b = h->blocklist;
+    for (i = 0; b && i < h->nblocks; i++, b = b->next) {
+        if (!block_selected(b, i+1, &range_start))
+            continue;
+        selected[nselected].b = b;
+        selected[nselected].idx = i;
+        selected[nselected].pos = nselected;
+        nselected++;
+    }
 
-            for (n = range_start; n < nrange; n++) {
-                if ((i+1) < range_list[n].start)
-                    break;
-                if ((i+1) <= range_list[n].end) {
-                    found = 1;
-                    break;
-                }
-                range_start++;
-            }
+    qsort(selected, nselected, sizeof(*selected), offset_sort);
 
-            if (!found && variable_ids) {
-                last_id = variable_ids;
-                while (last_id) {
-                    if (!memcmp(h->current_block->id, last_id->id,
-                            strlen(last_id->id)+1)) {
-                        found = 1;
-                        break;
-                    }
-                    last_id = last_id->next;
-                }
-            }
+    /* Output stays in block order, even where the data is stored otherwise */
+    in_order = 1;
+    for (i = 0; i < nselected; i++)
+        if (selected[i].pos != i) in_order = 0;
 
-            if (found) {
-                h->print = 1;
-                sdf_read_data(h);
-#ifdef SDF_DEBUG
-                DBG_PRINT_FLUSH();
+#ifdef PARALLEL
+    /* Reads are collective so blocks must be read one at a time */
+    nthreads = 1;
 #endif
-                h->print = 0;
-            }
-        } else
-            sdf_read_data(h);
-
-        h->current_block = b->next;
 
-        if (found) DBG_PRINT_FLUSH();
+    if ((nthreads > 1 || !in_order) && nselected > 1) {
+        fflush(stdout);
+        if (render_blocks(file, comm, selected, nselected))
+            return 1;
+    } else {
+        h->print = 1;
+        for (i = 0; i < nselected; i++)
+            print_block_data(h, selected[i].b, stdout);
+        h->print = 0;
     }
+
+    free(selected);
+
 #ifdef SDF_DEBUG_ALL
 #ifdef SDF_DEBUG
     if (debug) DBG_PRINT_FLUSH();
@@ -1,5 +1,6 @@
 import os
 import re
+import multiprocessing
 try:
     import numpy as np
     import matplotlib.pyplot as plt
@@ -318,27 +319,131 @@ def get_job_id(file_list=None, base=None, block=None):
             base = block.Header['filename']
 
     if base is not None:
-        try:
-            data = sdf.read(base, mmap=0)
-            if len(data.__dict__) > 1:
-                return data.Header['jobid1']
-        except:
-            pass
+        header = scan_files([base])[0]
+        if header is not None and header['nblocks'] > 0:
+            return header['jobid1']
 
     # Find the job id
     if file_list is not None:
-        for f in file_list:
-            try:
-                data = sdf.read(f, mmap=0)
-                if len(data.__dict__) < 2:
-                    continue
-                return data.Header['jobid1']
-            except:
-                pass
+        for header in scan_files(file_list):
+            if header is not None and header['nblocks'] > 0:
+                return header['jobid1']
 
     return None
 
 
+def scan_files(file_list):
+    """Read the headers of a list of SDF files
+
+       When several files are requested from one directory, their headers
+       are taken from the index of that directory, which sdf.index updates
+       for any files that have changed. Other files, such as a single file
+       being looked up, are scanned using a pool of threads.
+
+       Parameters
+       ----------
+       file_list : str list
+           A list of filenames to scan
+
+       Returns
+       -------
+       headers : dict list
+           The header of each file, as returned by sdf.scan, or None if the
+           file could not be read
+    """
+
+    try:
+        threads = min(multiprocessing.cpu_count(), 16)
+    except:
+        threads = 1
+
+    paths = [os.path.abspath(f) for f in file_list]
+    counts = {}
+    for f in paths:
+        if f.endswith('.sdf'):
+            wkd = os.path.dirname(f)
+            counts[wkd] = counts.get(wkd, 0) + 1
+
+    indexed = {}
+    done = set()
+    for wkd, count in counts.items():
+        if count < 2:
+            continue
+        try:
+            for header in sdf.index(wkd, threads=threads):
+                indexed[header['filename']] = header
+            done.add(wkd)
+        except:
+            pass
+
+    # Files left out of an index could not be read. Scan all the others.
+    headers = [indexed.get(f) for f in paths]
+    missing = [i for i, f in enumerate(paths) if headers[i] is None
+               and (not f.endswith('.sdf') or os.path.dirname(f) not in done)]
+    if len(missing) > 0:
+        scanned = sdf.scan([file_list[i] for i in missing], threads=threads)
+        for i, header in zip(missing, scanned):
+            headers[i] = header
+
+    return headers
+
+
+def search_headers(file_list, job_id, key, value=0, first=False, last=False,
+                   fast=True):
+    """Find the file whose header entry is closest to a given value
+
+       Parameters
+       ----------
+       file_list : str list
+           A list of filenames to search, oldest first
+       job_id : int
+           Only files with this job ID are considered
+       key : str
+           The header entry to search, 'time' or 'step'
+       value : float
+           The value to search for
+       first : bool
+           If set to True then return the file with the smallest value
+       last : bool
+           If set to True then return the file with the largest value
+       fast : bool
+           If set to True then first and last return the oldest or newest
+           file with the job ID
+
+       Returns
+       -------
+       filename : str
+           The matching filename, or None if no file matches
+    """
+    import bisect
+
+    found = [(header[key], f)
+             for f, header in zip(file_list, scan_files(file_list))
+             if header is not None and header['nblocks'] > 0
+             and header['jobid1'] == job_id]
+
+    if len(found) == 0:
+        return None
+
+    if fast and last:
+        return found[-1][1]
+    if fast and first:
+        return found[0][1]
+
+    # The sort is stable, so ties keep their modification time ordering
+    found.sort(key=lambda x: x[0])
+    if last:
+        return found[-1][1]
+    if first:
+        return found[0][1]
+
+    keys = [x[0] for x in found]
+    i = bisect.bisect_left(keys, value)
+    if i == len(keys) or (i > 0 and value - keys[i-1] <= keys[i] - value):
+        i -= 1
+    return found[i][1]
+
+
 def get_files(wkd=None, base=None, block=None, varname=None, fast=True):
     """Get a list of SDF filenames belonging to the same run
 
@@ -388,21 +493,22 @@ def get_files(wkd=None, base=None, block=None, varname=None, fast=True):
 
     # Add all files matching the job id
     file_list = []
-    for f in reversed(flist):
-        try:
-            data = sdf.read(f, mmap=0, dict=True)
-            if len(data) < 2:
-                continue
-            file_job_id = data['Header']['jobid1']
-            if file_job_id == job_id:
-                if varname is None:
-                    file_list.append(f)
-                elif varname in data:
-                    file_list.append(f)
-            elif len(file_list) > 0:
-                break
-        except:
-            pass
+    for f, header in zip(reversed(flist), reversed(scan_files(flist))):
+        if header is None or header['nblocks'] < 1:
+            continue
+        if header['jobid1'] == job_id:
+            if varname is None:
+                file_list.append(f)
+            else:
+                # Only the block list can say which variables are present
+                try:
+                    data = sdf.read(f, mmap=0, dict=True)
+                    if varname in data:
+                        file_list.append(f)
+                except:
+                    pass
+        elif len(file_list) > 0:
+            break
 
     return list(reversed(file_list))
 
@@ -450,44 +556,8 @@ def get_time(time=0, first=False, last=False, wkd=None, base=None, block=None,
     if time is None and not first:
         last = True
 
-    t = None
-    fname = None
-    if last:
-        flist = list(reversed(flist))
-        t_old = -1e90
-    else:
-        t_old = 1e90
-
-    for f in flist:
-        dat_tmp = sdf.read(f)
-        if len(dat_tmp.__dict__) < 2:
-            continue
-        if job_id != dat_tmp.Header['jobid1']:
-            continue
-
-        t = dat_tmp.Header['time']
-        if last:
-            if fast:
-                fname = f
-                break
-            if t > t_old:
-                fname = f
-                t_old = t
-        elif first:
-            if fast:
-                fname = f
-                break
-            if t < t_old:
-                fname = f
-                t_old = t
-        else:
-            td = abs(t - time)
-            if td < t_old:
-                t_old = td
-                fname = f
-                if td < 1e-30:
-                    # Exact match found. No need to search further
-                    break
+    fname = search_headers(flist, job_id, 'time', time, first=first, last=last,
+                           fast=fast)
 
     if fname is None:
         raise Exception("No valid file found in directory: " + wkdir)
@@ -539,44 +609,8 @@ def get_step(step=0, first=False, last=False, wkd=None, base=None, block=None,
     if step is None and not first:
         last = True
 
-    t = None
-    fname = None
-    if last:
-        flist = list(reversed(flist))
-        t_old = -1e90
-    else:
-        t_old = 1e90
-
-    for f in flist:
-        dat_tmp = sdf.read(f)
-        if len(dat_tmp.__dict__) < 2:
-            continue
-        if job_id != dat_tmp.Header['jobid1']:
-            continue
-
-        t = dat_tmp.Header['step']
-        if last:
-            if fast:
-                fname = f
-                break
-            if t > t_old:
-                fname = f
-                t_old = t
-        elif first:
-            if fast:
-                fname = f
-                break
-            if t < t_old:
-                fname = f
-                t_old = t
-        else:
-            td = abs(t - step)
-            if td < t_old:
-                t_old = td
-                fname = f
-                if td == 0:
-                    # Exact match found. No need to search further
-                    break
+    fname = search_headers(flist, job_id, 'step', step, first=first, last=last,
+                           fast=fast)
 
     if fname is None:
         raise Exception("No valid file found in directory: " + wkdir)
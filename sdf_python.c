@@ -34,11 +34,22 @@
 
 #define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 
+/* preadv() is outside the X/Open level that the module is compiled for */
+#define _DEFAULT_SOURCE 1
+#define _DARWIN_C_SOURCE 1
+
 #include <float.h>
 #include <Python.h>
 #include <numpy/arrayobject.h>
 #include <structmember.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "sdf.h"
 #include "sdf_extension.h"
 #include "sdf_helper.h"
@@ -92,8 +103,6 @@ PyObject *PyASCII_FromString(char *str)
         ob = Py_InitModule3(name, methods, doc);
 #endif
 
-#define IJ(i,j) ((i) + (j) * (block->adims[0] + 1))
-
 int sdf_free_block_data(sdf_file_t *h, sdf_block_t *b);
 
 static const int typemap[] = {
@@ -113,13 +122,32 @@ static const int typemap[] = {
 };
 
 
+typedef struct Block_struct Block;
+
 typedef struct {
     PyObject_HEAD
     sdf_file_t *h;
     PyObject *blocklist;
+    PyThread_type_lock lock;
+    int fd;
+    /* Blocks holding data that can be released, most recently used first */
+    Block *cache_head, *cache_tail;
+    int64_t cache_size, cache_budget;
+    Py_ssize_t cache_hits, cache_misses;
+    /* NumPy types to convert blocks to as they are read, keyed by id */
+    PyObject *dtypes;
 } SDFObject;
 
 
+/*
+ * The SDF library keeps read state in the file handle, so any library call on
+ * a handle must hold its lock. A thread never waits for the lock whilst
+ * holding the GIL, but may reacquire the GIL whilst holding the lock.
+ */
+#define SDF_LOCK(sdf) PyThread_acquire_lock((sdf)->lock, WAIT_LOCK)
+#define SDF_UNLOCK(sdf) PyThread_release_lock((sdf)->lock)
+
+
 typedef struct {
     PyObject_HEAD
     SDFObject *sdf;
@@ -129,8 +157,6 @@ typedef struct {
 } ArrayObject;
 
 
-typedef struct Block_struct Block;
-
 struct Block_struct {
     PyObject_HEAD
     PyObject *id;
@@ -154,10 +180,14 @@ struct Block_struct {
     Block *grid;
     Block *grid_mid;
     Block *parent;
+    Block *cache_prev, *cache_next;
     SDFObject *sdf;
     sdf_block_t *b;
     int dim, ndims;
     int sdfref;
+    int cached;
+    int convert_type;
+    int64_t cache_bytes;
     npy_intp adims[4];
 };
 
@@ -165,6 +195,13 @@ struct Block_struct {
 typedef struct {
     PyObject_HEAD
     PyObject *dict;
+    PyObject *dict_id;
+    PyObject *names;
+    PyObject *ids;
+    SDFObject *sdf;
+    sdf_block_t **blocks;
+    char *done;
+    Py_ssize_t nblocks;
 } BlockList;
 
 
@@ -216,15 +253,13 @@ static PyTypeObject SDFType = {
 };
 
 
+/* The string belongs to ob and remains valid for as long as ob does */
 static inline char *PyBytes_As_C(PyObject *ob)
 {
 #if PY_MAJOR_VERSION < 3
     return PyString_AsString(ob);
 #else
-    PyObject *ascii = PyUnicode_AsASCIIString(ob);
-    char *str = PyBytes_AsString(ascii);
-    Py_DECREF(ascii);
-    return str;
+    return (char*)PyUnicode_AsUTF8(ob);
 #endif
 }
 
@@ -264,8 +299,7 @@ Array_dealloc(PyObject *self)
             free(ob->mem[n]);
         free(ob->mem);
         ob->memlen = 0;
-    } else
-        sdf_free_block_data(ob->sdf->h, ob->b);
+    }
 
     Py_XDECREF(ob->sdf);
     self->ob_type->tp_free(self);
@@ -276,9 +310,30 @@ Array_dealloc(PyObject *self)
  * BlockList type methods
  ******************************************************************************/
 
-static PyMemberDef BlockList_members[] = {
-    {"__dict__", T_OBJECT, offsetof(BlockList, dict), READONLY},
-    {0}
+static PyObject *BlockList_getdict(BlockList *blocklist, void *closure);
+static PyObject *BlockList_dir(BlockList *blocklist, PyObject *unused);
+
+static PyGetSetDef BlockList_getset[] = {
+    {"__dict__", (getter)BlockList_getdict, NULL, NULL, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *BlockList_cache_info(BlockList *blocklist, PyObject *unused);
+static PyObject *BlockList_set_cache(BlockList *blocklist, PyObject *args);
+
+static PyMethodDef BlockList_methods[] = {
+    {"__dir__", (PyCFunction)BlockList_dir, METH_NOARGS, NULL},
+    {"cache_info", (PyCFunction)BlockList_cache_info, METH_NOARGS,
+     "cache_info()\n"
+     "\nReturns a dictionary describing the block data held in memory, with\n"
+     "the entries 'hits', 'misses', 'blocks', 'size' and 'budget'.\n"
+    },
+    {"set_cache", (PyCFunction)BlockList_set_cache, METH_VARARGS,
+     "set_cache(budget)\n"
+     "\nSets the budget in bytes for block data held in memory and releases\n"
+     "any unreferenced data over it. A budget of 0 keeps all data.\n"
+    },
+    {NULL}  /* Sentinel */
 };
 
 
@@ -287,11 +342,133 @@ BlockList_dealloc(PyObject *self)
 {
     BlockList *ob = (BlockList*)self;
 
+    /* Blocks hold a reference to the SDF object, so release them first */
     Py_XDECREF(ob->dict);
+    Py_XDECREF(ob->dict_id);
+    Py_XDECREF(ob->names);
+    Py_XDECREF(ob->ids);
+    Py_XDECREF(ob->sdf);
+    free(ob->blocks);
+    free(ob->done);
     self->ob_type->tp_free(self);
 }
 
 
+/*
+ * Block data cache
+ *
+ * Data read from the file is kept on the block so that block.data returns
+ * the same array each time. Each SDF object keeps its blocks holding such
+ * data in a least recently used list. Once the data exceeds the cache
+ * budget, the oldest data that nothing outside the block refers to is
+ * released, and is read again if it is asked for. A budget of zero keeps
+ * everything. The list is only changed whilst holding the GIL.
+ ******************************************************************************/
+
+static int64_t cache_data_bytes(PyObject *data)
+{
+    int64_t bytes = 0;
+    Py_ssize_t i;
+
+    if (PyArray_Check(data))
+        return PyArray_NBYTES((PyArrayObject*)data);
+
+    if (PyTuple_Check(data)) {
+        for (i = 0; i < PyTuple_GET_SIZE(data); i++)
+            bytes += cache_data_bytes(PyTuple_GET_ITEM(data, i));
+    }
+
+    return bytes;
+}
+
+
+/* Data can be released if only the block refers to it */
+static int cache_data_unreferenced(PyObject *data)
+{
+    Py_ssize_t i;
+
+    if (Py_REFCNT(data) != 1)
+        return 0;
+
+    if (PyTuple_Check(data)) {
+        for (i = 0; i < PyTuple_GET_SIZE(data); i++)
+            if (Py_REFCNT(PyTuple_GET_ITEM(data, i)) != 1)
+                return 0;
+    }
+
+    return 1;
+}
+
+
+static void cache_unlink(Block *block)
+{
+    SDFObject *sdf = block->sdf;
+
+    if (!block->cached) return;
+
+    if (block->cache_prev)
+        block->cache_prev->cache_next = block->cache_next;
+    else
+        sdf->cache_head = block->cache_next;
+
+    if (block->cache_next)
+        block->cache_next->cache_prev = block->cache_prev;
+    else
+        sdf->cache_tail = block->cache_prev;
+
+    sdf->cache_size -= block->cache_bytes;
+    block->cache_prev = block->cache_next = NULL;
+    block->cache_bytes = 0;
+    block->cached = 0;
+}
+
+
+/* Add a block which has just been given data, or mark it as recently used */
+static void cache_touch(Block *block)
+{
+    SDFObject *sdf = block->sdf;
+    int64_t bytes;
+
+    if (!block->sdfref || !block->data) return;
+
+    bytes = block->cached ? block->cache_bytes : cache_data_bytes(block->data);
+    cache_unlink(block);
+
+    block->cache_next = sdf->cache_head;
+    if (sdf->cache_head)
+        sdf->cache_head->cache_prev = block;
+    else
+        sdf->cache_tail = block;
+    sdf->cache_head = block;
+
+    block->cache_bytes = bytes;
+    sdf->cache_size += bytes;
+    block->cached = 1;
+}
+
+
+/*
+ * Release data, oldest first, until the cache is within its budget. Freeing
+ * data can switch threads, so the search restarts after each release.
+ */
+static void cache_evict(SDFObject *sdf)
+{
+    PyObject *old;
+    Block *block;
+
+    while (sdf->cache_budget > 0 && sdf->cache_size > sdf->cache_budget) {
+        for (block = sdf->cache_tail; block; block = block->cache_prev)
+            if (cache_data_unreferenced(block->data)) break;
+        if (!block) break;
+
+        cache_unlink(block);
+        old = block->data;
+        block->data = NULL;
+        Py_DECREF(old);
+    }
+}
+
+
 /*
  * Block type methods
  ******************************************************************************/
@@ -376,6 +553,7 @@ static PyObject *
 Block_alloc(SDFObject *sdf, sdf_block_t *b)
 {
     Block *ob;
+    PyObject *sub;
     PyTypeObject *type;
     Py_ssize_t i;
 
@@ -454,7 +632,15 @@ Block_alloc(SDFObject *sdf, sdf_block_t *b)
     ob->data_length = PyLong_FromLongLong(b->data_length);
     if (!ob->data_length) goto error;
 
-    ob->datatype = PyArray_TypeObjectFromType(typemap[b->datatype_out]);
+    if (b->id && sdf->dtypes) {
+        sub = PyDict_GetItemString(sdf->dtypes, b->id);
+        if (sub) ob->convert_type = PyLong_AsLong(sub);
+    }
+
+    if (ob->convert_type)
+        ob->datatype = PyArray_TypeObjectFromType(ob->convert_type);
+    else
+        ob->datatype = PyArray_TypeObjectFromType(typemap[b->datatype_out]);
     if (!ob->datatype) goto error;
 
     if (b->ndims) {
@@ -561,6 +747,12 @@ Block_dealloc(PyObject *self)
 {
     Block *ob = (Block*)self;
     if (!ob) return;
+
+    /* Leave the cache before anything is released, since releasing data can
+     * switch threads and another thread may walk the cache meanwhile */
+    if (ob->sdfref > 0)
+        cache_unlink(ob);
+
     Py_XDECREF(ob->id);
     Py_XDECREF(ob->name);
     Py_XDECREF(ob->data_length);
@@ -574,7 +766,7 @@ Block_dealloc(PyObject *self)
     Py_XDECREF(ob->labels);
     Py_XDECREF(ob->units);
     Py_XDECREF(ob->dict);
-    Py_XDECREF(ob->data);
+    Py_CLEAR(ob->data);
     Py_XDECREF(ob->parent);
     Py_XDECREF(ob->material_names);
     Py_XDECREF(ob->material_ids);
@@ -588,9 +780,10 @@ Block_dealloc(PyObject *self)
     self->ob_type->tp_free(self);
 }
 
-/* FIXME:
- * The functions Block_getdata, Block_setdata can give the following
- * weird behaviour:
+/*
+ * block.data is a cache of the data in the file rather than a copy of it.
+ * Deleting it, or calling block.release(), only drops the reference held by
+ * the block, so the next access reads the data again:
  *
  *  >>> print block.data
  *  array([0., 1., ..., 100.]
@@ -598,1220 +791,4159 @@ Block_dealloc(PyObject *self)
  *  >>> print block.data
  *  array([0., 1., ..., 100.]
  *
- *  where we would expect an error, because block.data shouldn't
- *  exist anymore.
- *
- *  Possible solutions:
- *     - add a flag 'data_deleted', that is checked by Block_getdata
- *       before it tries to reload
- *     - replace 'block.data' with the method 'block.get_data()'
- *       that returns a numpy array that can just be deleted, without
- *       any need for Block_setdata.
- *       Obviously this solution breaks backward compatibility.
- *
- *  AMW - 2015-07-16
+ * The memory is freed once nothing else refers to the old array.
  */
 
 
-static PyObject *Block_getdata(Block *block, void *closure)
+/* Sections are reset to the full block after use rather than removed */
+static int has_array_section(sdf_block_t *b)
 {
-    void *data;
-    SDFObject *sdf = block->sdf;
-    sdf_block_t *b = block->b;
-    PyObject *ob;
-    ArrayObject *array = NULL;
-    Py_ssize_t ndims, n;
-    volatile Py_ssize_t i, j;
-    npy_intp *dims;
-    npy_intp adims[1];
-    void *mem;
-    int float1d = 0, double1d = 0, float2d = 0, double2d = 0;
+    int i;
 
-    /* Already populated numpy array. Just return it. */
-    if (block->data) {
-        Py_INCREF(block->data);
-        return block->data;
-    }
+    if (!b->array_starts)
+        return 0;
 
-    if (block->parent) {
-        ob = Block_getdata(block->parent, closure);
-        Py_DECREF(ob);
+    for (i = 0; i < b->ndims; i++) {
+        if (b->array_starts[i] != 0 || b->array_strides[i] != 1
+                || b->array_ends[i] < b->dims[i])
+            return 1;
     }
 
-    if (!sdf || !sdf->h || !b)
-        return PyErr_Format(PyExc_Exception, "Unknown SDF file\n");
+    return 0;
+}
 
-    sdf->h->current_block = b;
-    sdf_helper_read_data(sdf->h, b);
 
-    if (b->grids && b->grids[0])
-        data = b->grids[0];
-    else
-        data = b->data;
+/*
+ * Blocks whose data is stored on disk in exactly the form that will be
+ * returned can bypass the library. Returns the length of the data in bytes,
+ * or zero if it needs converting, and points data[] at each of the arrays it
+ * contains, given that the data starts at ptr.
+ */
+static int64_t raw_block_layout(sdf_file_t *h, sdf_block_t *b, char *ptr,
+                                void **data)
+{
+    int64_t nelements = 1, total = 0, offset = 0;
+    int i;
 
-    if (!data)
-        return PyErr_Format(PyExc_Exception, "Unable to read SDF block\n");
+    if (h->swap || has_array_section(b))
+        return 0;
+
+    if (b->datatype_out != b->datatype)
+        return 0;
+
+    for (i = 0; i < b->ndims; i++)
+        nelements *= b->dims[i];
+
+    switch (b->blocktype) {
+    case SDF_BLOCKTYPE_PLAIN_MESH:
+        for (i = 0; i < b->ndims; i++)
+            total += b->dims[i];
+        break;
+    case SDF_BLOCKTYPE_POINT_MESH:
+        total = b->ndims * b->dims[0];
+        break;
+    case SDF_BLOCKTYPE_LAGRANGIAN_MESH:
+        total = b->ndims * nelements;
+        break;
+    case SDF_BLOCKTYPE_PLAIN_VARIABLE:
+    case SDF_BLOCKTYPE_POINT_VARIABLE:
+    case SDF_BLOCKTYPE_ARRAY:
+        total = nelements;
+        break;
+    default:
+        return 0;
+    }
 
-    dims = block->adims;
-    ndims = b->ndims;
+    if (!total || b->data_length != total * SDF_TYPE_SIZES[b->datatype])
+        return 0;
 
-    if (b->grids && b->grids[0]) {
-        block->data = PyTuple_New(b->ndims);
-        if (!block->data) goto free_mem;
+    switch (b->blocktype) {
+    case SDF_BLOCKTYPE_PLAIN_MESH:
+        for (i = 0; i < b->ndims; i++) {
+            data[i] = ptr + offset * SDF_TYPE_SIZES[b->datatype];
+            offset += b->dims[i];
+        }
+        break;
+    case SDF_BLOCKTYPE_POINT_MESH:
+        for (i = 0; i < b->ndims; i++)
+            data[i] = ptr + i * b->dims[0] * SDF_TYPE_SIZES[b->datatype];
+        break;
+    case SDF_BLOCKTYPE_LAGRANGIAN_MESH:
+        for (i = 0; i < b->ndims; i++)
+            data[i] = ptr + i * nelements * SDF_TYPE_SIZES[b->datatype];
+        break;
+    default:
+        data[0] = ptr;
+    }
 
-        array = (ArrayObject*)Array_new(&ArrayType, sdf, b);
-        if (!array) goto free_mem;
+    return b->data_length;
+}
 
-        if (block->parent) {
-            array->memlen = b->ndims;
-            array->mem = malloc(array->memlen * sizeof(*array->mem));
-        }
 
-        if (b->blocktype == SDF_BLOCKTYPE_PLAIN_MESH
-                || b->blocktype == SDF_BLOCKTYPE_POINT_MESH) {
-            ndims = 1;
-            dims = adims;
-            if (block->parent) {
-                if (b->datatype_out == SDF_DATATYPE_REAL4)
-                    float1d = 1;
-                else
-                    double1d = 1;
-            }
-        } else {
-            if (block->parent) {
-                if (b->datatype_out == SDF_DATATYPE_REAL4)
-                    float2d = 1;
-                else
-                    double2d = 1;
-            }
-        }
+/*
+ * When the file has been mmap'ed, raw data can be returned as a view of the
+ * mapping. Nothing is then read until the pages are touched.
+ */
+static int map_block_data(sdf_file_t *h, sdf_block_t *b, void **data)
+{
+    if (!h->mmap)
+        return 0;
 
-        for (n = 0; n < b->ndims; n++) {
-            data = b->grids[n];
-            mem = NULL;
-
-            if (float1d) {
-                float v1, v2, *ptr_in, *ptr_out;
-                Py_ssize_t ntot = block->adims[n];
-                ptr_in = data;
-                ptr_out = data = mem = malloc(ntot * sizeof(*ptr_out));
-                if (!mem) goto free_mem;
-                for (i = 0; i < ntot; i++) {
-                    v1 = *ptr_in;
-                    v2 = *(ptr_in+1);
-                    *ptr_out++ = 0.5 * (v1 + v2);
-                    ptr_in++;
-                }
-            } else if (double1d) {
-                double v1, v2, *ptr_in, *ptr_out;
-                Py_ssize_t ntot = block->adims[n];
-                ptr_in = data;
-                ptr_out = data = mem = malloc(ntot * sizeof(*ptr_out));
-                if (!mem) goto free_mem;
-                for (i = 0; i < ntot; i++) {
-                    v1 = *ptr_in;
-                    v2 = *(ptr_in+1);
-                    *ptr_out++ = 0.5 * (v1 + v2);
-                    ptr_in++;
-                }
-            } else if (float2d) {
-                float *ptr_in, *ptr_out;
-                Py_ssize_t ntot = block->adims[0] * block->adims[1];
-                ptr_in = data;
-                ptr_out = data = mem = malloc(ntot * sizeof(*ptr_out));
-                if (!mem) goto free_mem;
-                if (block->adims[0] == 1) {
-                    for (j = 0; j < block->adims[1]; j++) {
-                        *ptr_out++ = 0.5 * (ptr_in[IJ(0,j)]
-                                + ptr_in[IJ(0,j+1)]);
-                    }
-                } else if (block->adims[1] == 1) {
-                    for (i = 0; i < block->adims[0]; i++) {
-                        *ptr_out++ = 0.5 * (ptr_in[IJ(i,0)]
-                                + ptr_in[IJ(i+1,0)]);
-                    }
-                } else {
-                    for (j = 0; j < block->adims[1]; j++) {
-                    for (i = 0; i < block->adims[0]; i++) {
-                        *ptr_out++ = 0.25 * (ptr_in[IJ(i,j)] + ptr_in[IJ(i+1,j)]
-                                + ptr_in[IJ(i,j+1)] + ptr_in[IJ(i+1,j+1)]);
-                    }}
-                }
-            } else if (double2d) {
-                double *ptr_in, *ptr_out;
-                Py_ssize_t ntot = block->adims[0] * block->adims[1];
-                ptr_in = data;
-                ptr_out = data = mem = malloc(ntot * sizeof(*ptr_out));
-                if (!mem) goto free_mem;
-                if (block->adims[0] == 1) {
-                    for (j = 0; j < block->adims[1]; j++) {
-                        *ptr_out++ = 0.5 * (ptr_in[IJ(0,j)]
-                                + ptr_in[IJ(0,j+1)]);
-                    }
-                } else if (block->adims[1] == 1) {
-                    for (i = 0; i < block->adims[0]; i++) {
-                        *ptr_out++ = 0.5 * (ptr_in[IJ(i,0)]
-                                + ptr_in[IJ(i+1,0)]);
-                    }
-                } else {
-                    for (j = 0; j < block->adims[1]; j++) {
-                    for (i = 0; i < block->adims[0]; i++) {
-                        *ptr_out++ = 0.25 * (ptr_in[IJ(i,j)] + ptr_in[IJ(i+1,j)]
-                                + ptr_in[IJ(i,j+1)] + ptr_in[IJ(i+1,j+1)]);
-                    }}
-                }
-            }
+    return raw_block_layout(h, b, h->mmap + b->data_location, data) != 0;
+}
 
-            if (mem)
-                array->mem[n] = mem;
 
-            if (b->blocktype == SDF_BLOCKTYPE_PLAIN_MESH
-                    || b->blocktype == SDF_BLOCKTYPE_POINT_MESH)
-                dims[0] = block->adims[n];
+/* Descriptor used for reads that bypass the library. Called with the GIL */
+static int sdf_fd(SDFObject *sdf)
+{
+    if (sdf->fd < 0)
+        sdf->fd = open(sdf->h->filename, O_RDONLY);
 
-            ob = PyArray_NewFromDescr(&PyArray_Type,
-                PyArray_DescrFromType(typemap[b->datatype_out]), ndims,
-                dims, NULL, data, NPY_ARRAY_F_CONTIGUOUS, NULL);
-            if (!ob) goto free_mem;
+    return sdf->fd;
+}
 
-            PyTuple_SetItem(block->data, n, ob);
 
-            PyArray_SetBaseObject((PyArrayObject*)ob, (PyObject*)array);
-            Py_INCREF(array);
-        }
-        Py_DECREF(array);
-    } else {
-        block->data = PyArray_NewFromDescr(&PyArray_Type,
-            PyArray_DescrFromType(typemap[b->datatype_out]), ndims,
-            dims, NULL, data, NPY_ARRAY_F_CONTIGUOUS, NULL);
-        if (!block->data) goto free_mem;
+/*
+ * Otherwise raw data is read with pread(), which keeps no state in the SDF
+ * handle and so runs without the GIL or the handle lock. Returns a buffer
+ * that the caller must free, or NULL if the library must be used instead.
+ */
+static void *read_block_direct(SDFObject *sdf, sdf_block_t *b, void **data)
+{
+    int64_t len, offset = 0;
+    ssize_t count;
+    char *buffer;
 
-        array = (ArrayObject*)Array_new(&ArrayType, sdf, b);
-        if (!array) goto free_mem;
+    len = raw_block_layout(sdf->h, b, NULL, data);
+    if (!len) return NULL;
+
+    if (sdf_fd(sdf) < 0) return NULL;
 
-        PyArray_SetBaseObject((PyArrayObject*)block->data, (PyObject*)array);
+    buffer = malloc(len);
+    if (!buffer) return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    while (offset < len) {
+        count = pread(sdf->fd, buffer + offset, len - offset,
+                      b->data_location + offset);
+        if (count <= 0) break;
+        offset += count;
     }
+    Py_END_ALLOW_THREADS
 
-    Py_INCREF(block->data);
-    return block->data;
+    if (offset < len) {
+        free(buffer);
+        return NULL;
+    }
 
-free_mem:
-    if (block->data) Py_DECREF(block->data);
-    if (array) Py_DECREF(array);
-    sdf_free_block_data(sdf->h, b);
-    return PyErr_Format(PyExc_Exception, "Error whilst reading SDF block\n");
+    raw_block_layout(sdf->h, b, buffer, data);
+
+    return buffer;
 }
 
 
-static int
-Block_setdata(Block *block, PyObject *value, void *closure)
+/*
+ * Anything else goes through the library. The data is copied into a buffer
+ * for the caller before the handle lock is released, so that no Python
+ * objects are ever created with the lock held and no two arrays share the
+ * library data. Data that another reader already holds is left in place.
+ * Returns the buffer, with data[] pointing at each of its arrays, or NULL.
+ */
+static void *read_block_library(SDFObject *sdf, Block *block, void **data,
+                                int *is_mesh)
 {
-    Py_XDECREF(block->data);
-    if ( value != NULL )
-        Py_INCREF(value);
-    block->data = value;
+    sdf_block_t *b = block->b;
+    int64_t len[SDF_MAXDIMS], total = 0, offset = 0;
+    char *buffer = NULL;
+    void *src[SDF_MAXDIMS] = { NULL };
+    int held, n, mesh, ngrids = 1;
 
-    return 0;
+    for (n = 0; n < b->ndims && n < SDF_MAXDIMS; n++) {
+        if (b->blocktype == SDF_BLOCKTYPE_PLAIN_MESH
+                || b->blocktype == SDF_BLOCKTYPE_POINT_MESH)
+            len[n] = block->adims[n];
+        else
+            len[n] = PyArray_MultiplyList(block->adims, b->ndims);
+        len[n] *= SDF_TYPE_SIZES[b->datatype_out];
+    }
+    if (b->ndims < 1)
+        len[0] = SDF_TYPE_SIZES[b->datatype_out];
+
+    Py_BEGIN_ALLOW_THREADS
+    SDF_LOCK(sdf);
+    held = b->done_data;
+    if (!held) {
+        sdf->h->current_block = b;
+        sdf_helper_read_data(sdf->h, b);
+    }
+
+    mesh = (b->grids && b->grids[0]);
+    if (mesh) {
+        ngrids = b->ndims;
+        for (n = 0; n < ngrids; n++)
+            src[n] = b->grids[n];
+    } else
+        src[0] = b->data;
+
+    for (n = 0; n < ngrids; n++) {
+        if (!src[n]) break;
+        total += len[n];
+    }
+
+    if (n == ngrids)
+        buffer = malloc(total ? total : 1);
+
+    if (buffer) {
+        for (n = 0; n < ngrids; n++) {
+            memcpy(buffer + offset, src[n], len[n]);
+            data[n] = buffer + offset;
+            offset += len[n];
+        }
+    }
+
+    if (!held) sdf_free_block_data(sdf->h, b);
+    SDF_UNLOCK(sdf);
+    Py_END_ALLOW_THREADS
+
+    *is_mesh = mesh;
+    if (!buffer) data[0] = NULL;
+
+    return buffer;
 }
 
 
 /*
- * SDF type methods
+ * Precision conversion
+ *
+ * Blocks can be given a narrower type than the one they are stored with, in
+ * which case the data is converted as it is read into a buffer of the
+ * narrower type. Raw data is read through a small bounce buffer, or straight
+ * from the mapping, rather than as a full-size copy.
  ******************************************************************************/
 
-static void
-SDF_dealloc(PyObject* self)
-{
-    sdf_file_t *h = ((SDFObject*)self)->h;
-    if (h) {
-        sdf_stack_destroy(h);
-        sdf_close(h);
-    }
-    self->ob_type->tp_free(self);
+#define CONVERT_CHUNK (1<<20)
+
+#define CONVERT_KERNEL(from,to) \
+static void convert_##from##_##to(const from *restrict in, to *restrict out, \
+                                  npy_intp n) \
+{ \
+    npy_intp i; \
+\
+    for (i = 0; i < n; i++) \
+        out[i] = in[i]; \
 }
 
+CONVERT_KERNEL(double, float)
 
-static void
-setup_mesh(SDFObject *sdf, PyObject *dict, sdf_block_t *b, PyObject *dict_id)
-{
-    char *block_name = NULL;
-    char *mesh_id = NULL;
-    PyObject *ob = NULL;
-    Block *parent, *block = NULL;
-    Py_ssize_t n, len_name, len_id;
 
-    if (!sdf->h || !b) return;
+/* Only double precision data from the file can be converted */
+static int convert_supported(sdf_block_t *b, int type)
+{
+    if (type != NPY_FLOAT || b->datatype_out != SDF_DATATYPE_REAL8)
+        return 0;
+
+    switch (b->blocktype) {
+    case SDF_BLOCKTYPE_PLAIN_MESH:
+    case SDF_BLOCKTYPE_POINT_MESH:
+    case SDF_BLOCKTYPE_LAGRANGIAN_MESH:
+    case SDF_BLOCKTYPE_PLAIN_VARIABLE:
+    case SDF_BLOCKTYPE_POINT_VARIABLE:
+    case SDF_BLOCKTYPE_ARRAY:
+        return 1;
+    }
 
-    len_name = strlen(b->name);
-    block_name = malloc(len_name + 5);
-    if (!block_name) goto free_mem;
+    return 0;
+}
 
-    memcpy(block_name, b->name, len_name);
-    block_name[len_name] = '\0';
 
-    block = (Block*)Block_alloc(sdf, b);
-    if (!block) goto free_mem;
+/*
+ * Read a block converted to single precision. Returns a buffer that the
+ * caller must free, with data[] pointing at each of its arrays, or NULL.
+ */
+static void *read_block_converted(SDFObject *sdf, Block *block, void **data)
+{
+    sdf_file_t *h = sdf->h;
+    sdf_block_t *b = block->b;
+    void *raw[SDF_MAXDIMS] = { NULL };
+    npy_intp len[SDF_MAXDIMS], total = 0, nread = 0, count;
+    float *out;
+    char *chunk = NULL;
+    int n, held, ngrids = 1, ok = 1;
+
+    if (b->blocktype == SDF_BLOCKTYPE_PLAIN_MESH
+            || b->blocktype == SDF_BLOCKTYPE_POINT_MESH
+            || b->blocktype == SDF_BLOCKTYPE_LAGRANGIAN_MESH)
+        ngrids = b->ndims;
+
+    for (n = 0; n < ngrids; n++) {
+        if (b->blocktype == SDF_BLOCKTYPE_PLAIN_MESH
+                || b->blocktype == SDF_BLOCKTYPE_POINT_MESH)
+            len[n] = block->adims[n];
+        else
+            len[n] = PyArray_MultiplyList(block->adims, b->ndims);
+        total += len[n];
+    }
 
-    block->labels = PyTuple_New(b->ndims);
-    if (!block->labels) goto free_mem;
+    out = malloc(total * sizeof(*out));
+    if (!out) return NULL;
+
+    /* Raw arrays are stored one after another, so convert them as a stream */
+    if (raw_block_layout(h, b, NULL, raw) == total * (npy_intp)sizeof(double)
+            && (h->mmap || sdf_fd(sdf) >= 0)
+            && (h->mmap || (chunk = malloc(CONVERT_CHUNK)))) {
+        Py_BEGIN_ALLOW_THREADS
+        if (h->mmap)
+            convert_double_float((double*)(h->mmap + b->data_location), out,
+                                 total);
+        else {
+            while (ok && nread < total) {
+                count = total - nread;
+                if (count > CONVERT_CHUNK / (npy_intp)sizeof(double))
+                    count = CONVERT_CHUNK / sizeof(double);
+                count *= sizeof(double);
+                if (pread(sdf->fd, chunk, count, b->data_location
+                          + nread * sizeof(double)) != count)
+                    ok = 0;
+                count /= sizeof(double);
+                convert_double_float((double*)chunk, out + nread, count);
+                nread += count;
+            }
+        }
+        Py_END_ALLOW_THREADS
 
-    block->units = PyTuple_New(b->ndims);
-    if (!block->units) goto free_mem;
+        free(chunk);
+        for (n = 0; n < ngrids; n++)
+            data[n] = out + (intptr_t)raw[n] / sizeof(double);
+    } else {
+        /* Data that another array holds in full is left in place */
+        Py_BEGIN_ALLOW_THREADS
+        SDF_LOCK(sdf);
+        held = b->done_data;
+        if (!held) {
+            h->current_block = b;
+            sdf_helper_read_data(h, b);
+        }
 
-    for (n = 0; n < b->ndims; n++) {
-        ob = PyASCII_FromString(b->dim_labels[n]);
-        if (!ob) goto free_mem;
-        PyTuple_SetItem(block->labels, n, ob);
+        for (n = 0, total = 0; n < ngrids; n++) {
+            raw[n] = b->grids ? b->grids[n] : b->data;
+            if (!raw[n]) {
+                ok = 0;
+                break;
+            }
+            convert_double_float(raw[n], out + total, len[n]);
+            data[n] = out + total;
+            total += len[n];
+        }
 
-        ob = PyASCII_FromString(b->dim_units[n]);
-        if (!ob) goto free_mem;
-        PyTuple_SetItem(block->units, n, ob);
+        if (!held) sdf_free_block_data(h, b);
+        SDF_UNLOCK(sdf);
+        Py_END_ALLOW_THREADS
     }
 
-    PyDict_SetItemString(dict_id, b->id, (PyObject*)block);
-    PyDict_SetItemString(dict, block_name, (PyObject*)block);
-    Py_DECREF(block);
-
-    if (b->blocktype == SDF_BLOCKTYPE_POINT_MESH) {
-        free(block_name);
-        return;
+    if (!ok) {
+        free(out);
+        data[0] = NULL;
+        return NULL;
     }
 
-    /* Add median mesh block */
+    return out;
+}
 
-    parent = block;
-    memcpy(block_name+len_name, "_mid", 5);
 
-    block = (Block*)Block_alloc(sdf, b);
-    if (!block) goto free_mem;
+/*
+ * Median mesh kernels
+ *
+ * The cell centres of a mesh with the given number of nodes along each of
+ * three axes are the averages of the corners of each cell, taken over the
+ * axes that have more than one node. The innermost loop is unit stride with
+ * no aliasing so that the compiler can vectorise it.
+ ******************************************************************************/
 
-    /* This block needs a reference to the parent and also needs the parent to
-       exist as long as we do. */
-    block->parent = parent;
-    Py_INCREF(block->parent);
+#define MID_KERNEL(type) \
+static void mid_##type(const type *restrict in, type *restrict out, \
+                       const npy_intp *nodes) \
+{ \
+    npy_intp i, j, k, m[3], off[3] = { 0 }, stride = 1; \
+    const type *p; \
+    int n, nd = 0; \
+\
+    for (n = 0; n < 3; n++) { \
+        m[n] = nodes[n] > 1 ? nodes[n] - 1 : 1; \
+        if (nodes[n] > 1) off[nd++] = stride; \
+        stride *= nodes[n]; \
+    } \
+\
+    for (k = 0; k < m[2]; k++) { \
+    for (j = 0; j < m[1]; j++) { \
+        p = in + j * nodes[0] + k * nodes[0] * nodes[1]; \
+        switch (nd) { \
+        case 0: \
+            for (i = 0; i < m[0]; i++) \
+                out[i] = p[i]; \
+            break; \
+        case 1: \
+            for (i = 0; i < m[0]; i++) \
+                out[i] = 0.5 * (p[i] + p[i+off[0]]); \
+            break; \
+        case 2: \
+            for (i = 0; i < m[0]; i++) \
+                out[i] = 0.25 * (p[i] + p[i+off[0]] + p[i+off[1]] \
+                        + p[i+off[0]+off[1]]); \
+            break; \
+        default: \
+            for (i = 0; i < m[0]; i++) \
+                out[i] = 0.125 * (p[i] + p[i+off[0]] + p[i+off[1]] \
+                        + p[i+off[0]+off[1]] + p[i+off[2]] \
+                        + p[i+off[0]+off[2]] + p[i+off[1]+off[2]] \
+                        + p[i+off[0]+off[1]+off[2]]); \
+        } \
+        out += m[0]; \
+    }} \
+}
 
-    block->labels = PyTuple_New(b->ndims);
-    if (!block->labels) goto free_mem;
+MID_KERNEL(float)
+MID_KERNEL(double)
 
-    block->units = PyTuple_New(b->ndims);
-    if (!block->units) goto free_mem;
+
+/*
+ * Compute the arrays of a median mesh from those of its parent, storing them
+ * in mem[]. Each axis of a plain mesh is averaged on its own, whereas the
+ * nodes of a Lagrangian mesh are averaged over the corners of each cell.
+ */
+static int mid_grid_data(Block *block, int type, void **grids, void **mem)
+{
+    sdf_block_t *b = block->b;
+    npy_intp nodes[SDF_MAXDIMS][3], len;
+    int n, k, single = (type == NPY_FLOAT);
+    int plain = (b->blocktype == SDF_BLOCKTYPE_PLAIN_MESH);
+
+    if (b->ndims > 3) return 1;
 
     for (n = 0; n < b->ndims; n++) {
-        if (block->adims[n] > 1)
-            block->adims[n]--;
-        PyTuple_SetItem(block->dims, n, PyLong_FromLong(block->adims[n]));
+        for (k = 0; k < 3; k++) {
+            if (plain)
+                nodes[n][k] = k ? 1 : block->parent->adims[n];
+            else
+                nodes[n][k] = k < b->ndims ? block->parent->adims[k] : 1;
+        }
 
-        ob = PyASCII_FromString(b->dim_labels[n]);
-        if (!ob) goto free_mem;
-        PyTuple_SetItem(block->labels, n, ob);
+        len = plain ? block->adims[n]
+                    : PyArray_MultiplyList(block->adims, b->ndims);
+        mem[n] = malloc(len * (single ? sizeof(float) : sizeof(double)));
+        if (!mem[n]) return 1;
+    }
 
-        ob = PyASCII_FromString(b->dim_units[n]);
-        if (!ob) goto free_mem;
-        PyTuple_SetItem(block->units, n, ob);
+    Py_BEGIN_ALLOW_THREADS
+    for (n = 0; n < b->ndims; n++) {
+        if (single)
+            mid_float(grids[n], mem[n], nodes[n]);
+        else
+            mid_double(grids[n], mem[n], nodes[n]);
+        grids[n] = mem[n];
     }
+    Py_END_ALLOW_THREADS
 
-    len_id = strlen(b->id);
-    mesh_id = malloc(len_id + 5);
-    if (!mesh_id) goto free_mem;
+    return 0;
+}
 
-    memcpy(mesh_id, b->id, len_id);
-    memcpy(mesh_id+len_id, "_mid", 5);
 
-    Py_DECREF(block->id);
-    block->id = PyASCII_FromString(mesh_id);
-    if (!block->id) goto free_mem;
+/*
+ * Read the data for a block, converted to the given NumPy type if non-zero,
+ * and optionally store it on the block.
+ */
+static PyObject *read_block_data(Block *block, int convert_type, int publish)
+{
+    void *data, *grids[SDF_MAXDIMS] = { NULL }, *buffer = NULL;
+    SDFObject *sdf = block->sdf;
+    sdf_block_t *b = block->b;
+    PyObject *ob, *result = NULL, *parent = NULL;
+    ArrayObject *array = NULL;
+    Py_ssize_t ndims, n;
+    npy_intp *dims;
+    npy_intp adims[1];
+    int is_mesh, type;
 
-    Py_DECREF(block->name);
-    block->name = PyASCII_FromString(block_name);
-    if (!block->name) goto free_mem;
+    type = convert_type ? convert_type : typemap[b->datatype_out];
 
-    PyDict_SetItemString(dict_id, mesh_id, (PyObject*)block);
-    PyDict_SetItemString(dict, block_name, (PyObject*)block);
-    Py_DECREF(block);
+    is_mesh = (b->blocktype == SDF_BLOCKTYPE_PLAIN_MESH
+            || b->blocktype == SDF_BLOCKTYPE_POINT_MESH
+            || b->blocktype == SDF_BLOCKTYPE_LAGRANGIAN_MESH);
 
-    free(mesh_id);
-    free(block_name);
+    if (block->parent) {
+        /* Median meshes are computed from parent mesh arrays of the same type */
+        if (type == (block->parent->convert_type ? block->parent->convert_type
+                                                 : typemap[b->datatype_out]))
+            parent = Block_getdata(block->parent, NULL);
+        else
+            parent = read_block_data(block->parent, convert_type, 0);
+        if (!parent) return NULL;
+        for (n = 0; n < b->ndims; n++)
+            grids[n] = PyArray_DATA(
+                    (PyArrayObject*)PyTuple_GET_ITEM(parent, n));
+    } else if (convert_type) {
+        buffer = read_block_converted(sdf, block, grids);
+    } else if (!map_block_data(sdf->h, b, grids)
+            && !(buffer = read_block_direct(sdf, b, grids))) {
+        buffer = read_block_library(sdf, block, grids, &is_mesh);
+    }
 
-    return;
+    data = grids[0];
+    if (!data) {
+        Py_XDECREF(parent);
+        return PyErr_Format(PyExc_Exception, "Unable to read SDF block\n");
+    }
 
-free_mem:
-    if (block_name) free(block_name);
-    if (mesh_id) free(mesh_id);
-    if (block) Py_DECREF(block);
-    if (ob) Py_DECREF(ob);
-}
+    /* Another thread may have populated the block whilst we were reading */
+    if (publish && block->data) {
+        ob = block->data;
+        Py_INCREF(ob);
+        free(buffer);
+        Py_XDECREF(parent);
+        return ob;
+    }
 
+    dims = block->adims;
+    ndims = b->ndims;
 
-static void extract_station_time_histories(sdf_file_t *h, PyObject *stations,
-        PyObject *variables, double t0, double t1, PyObject *dict)
-{
-    Py_ssize_t nvars, i, nstat;
-    PyObject *sub;
-    char **var_names, *timehis, *v, *key;
-    long *stat, ii;
-    int *size, *offset, nrows, row_size;
-    sdf_block_t *b;
-    npy_intp dims[1];
+    /* Arrays are read-only, since mapped data must not be modified */
+    if (is_mesh) {
+        result = PyTuple_New(b->ndims);
+        if (!result) goto free_mem;
 
-    if ( !stations ) {
-        nstat = 1;
-        stat = (long *)malloc(sizeof(long));
-        stat[0] = 0;
+        array = (ArrayObject*)Array_new(&ArrayType, sdf, b);
+        if (!array) goto free_mem;
+
+        if (block->parent) {
+            array->memlen = b->ndims;
+            array->mem = calloc(array->memlen, sizeof(*array->mem));
+        } else if (buffer) {
+            array->memlen = 1;
+            array->mem = malloc(sizeof(*array->mem));
+            if (array->mem) array->mem[0] = buffer;
+            buffer = NULL;
+        }
+        if (array->memlen && !array->mem) {
+            array->memlen = 0;
+            goto free_mem;
+        }
+
+        if (block->parent && mid_grid_data(block, type, grids, array->mem))
+            goto free_mem;
+
+        if (b->blocktype == SDF_BLOCKTYPE_PLAIN_MESH
+                || b->blocktype == SDF_BLOCKTYPE_POINT_MESH) {
+            ndims = 1;
+            dims = adims;
+        }
+
+        for (n = 0; n < b->ndims; n++) {
+            if (b->blocktype == SDF_BLOCKTYPE_PLAIN_MESH
+                    || b->blocktype == SDF_BLOCKTYPE_POINT_MESH)
+                dims[0] = block->adims[n];
+
+            ob = PyArray_NewFromDescr(&PyArray_Type,
+                PyArray_DescrFromType(type), ndims,
+                dims, NULL, grids[n], NPY_ARRAY_F_CONTIGUOUS, NULL);
+            if (!ob) goto free_mem;
+
+            PyTuple_SetItem(result, n, ob);
+
+            PyArray_SetBaseObject((PyArrayObject*)ob, (PyObject*)array);
+            Py_INCREF(array);
+        }
+        Py_DECREF(array);
     } else {
-        /* Force 'stat' to be valid input for sdf_read_station_timehis */
-        nstat = PyList_Size(stations);
-        stat = (long *)calloc(nstat, sizeof(long));
-        nstat = 0;
-        for ( ii=0; ii<h->current_block->nstations; ii++ ) {
-            sub = PyLong_FromLong(ii+1);
-            if ( PySequence_Contains(stations, sub) ) {
-                stat[nstat] = ii;
-                nstat++;
+        result = PyArray_NewFromDescr(&PyArray_Type,
+            PyArray_DescrFromType(type), ndims,
+            dims, NULL, data, NPY_ARRAY_F_CONTIGUOUS, NULL);
+        if (!result) goto free_mem;
+
+        array = (ArrayObject*)Array_new(&ArrayType, sdf, b);
+        if (!array) goto free_mem;
+
+        if (buffer) {
+            array->memlen = 1;
+            array->mem = malloc(sizeof(*array->mem));
+            if (!array->mem) {
+                array->memlen = 0;
+                goto free_mem;
             }
-            Py_DECREF(sub);
+            array->mem[0] = buffer;
+            buffer = NULL;
         }
-    }
 
-    if ( !nstat ) {
-        free(stat);
-        return;
+        PyArray_SetBaseObject((PyArrayObject*)result, (PyObject*)array);
     }
 
-    if ( !variables ) {
-        free(stat);
-        return;
-    }
+    Py_XDECREF(parent);
 
-    nvars = PyList_Size(variables);
-    if ( !nvars ) {
-        free(stat);
-        return;
+    if (!publish)
+        return result;
+
+    /* Only publish complete data, and only if no other thread has */
+    if (block->data) {
+        ob = block->data;
+        Py_INCREF(ob);
+        Py_DECREF(result);
+        return ob;
     }
+    block->data = result;
+    Py_INCREF(result);
+    cache_touch(block);
+    cache_evict(sdf);
+    return result;
 
-    var_names = (char **)malloc(nvars*sizeof(char *));
-    for ( i=0; i<nvars; i++ ) {
-        sub = PyList_GetItem(variables, i);
-        var_names[i] = PyBytes_As_C(sub);
-        if ( !var_names[i] ) {
-            free(var_names);
-            free(stat);
-            PyErr_SetString(PyExc_TypeError,
-                    "'variables' keyword must be a string or list of strings");
-            return;
+free_mem:
+    Py_XDECREF(result);
+    Py_XDECREF(array);
+    free(buffer);
+    Py_XDECREF(parent);
+    return PyErr_Format(PyExc_Exception, "Error whilst reading SDF block\n");
+}
+
+
+static PyObject *Block_getdata(Block *block, void *closure)
+{
+    /* Already populated numpy array. Just return it. */
+    if (block->data) {
+        if (block->cached) {
+            block->sdf->cache_hits++;
+            cache_touch(block);
         }
+        Py_INCREF(block->data);
+        return block->data;
     }
 
-    offset = (int *)calloc(nstat*nvars+1, sizeof(int));
-    size = (int *)calloc(nstat*nvars+1, sizeof(int));
-    if ( sdf_read_station_timehis(h, stat, nstat, var_names, nvars, t0, t1,
-            &timehis, size, offset, &nrows, &row_size) ) {
-        free(var_names);
-        free(size);
-        free(offset);
-        free(stat);
-        return;
-    }
+    if (!block->sdf || !block->sdf->h || !block->b)
+        return PyErr_Format(PyExc_Exception, "Unknown SDF file\n");
 
-    b = h->current_block;
-    key = malloc(3*h->string_length+3);
-    dims[0] = nrows;
+    if (block->sdfref) block->sdf->cache_misses++;
 
-    /* Handle 'Time' as a special case */
-    sub = PyArray_SimpleNewFromData(1, dims, typemap[b->variable_types[0]],
-            timehis);
+    return read_block_data(block, block->convert_type, 1);
+}
 
-    sprintf(key, "%s/Time", b->name);
 
-    PyDict_SetItemString(dict, key, sub);
-    Py_DECREF(sub);
+static int
+Block_setdata(Block *block, PyObject *value, void *closure)
+{
+    PyObject *old = block->data;
 
-    v = timehis + nrows * size[0];
-    for ( i=1; i<=nstat*nvars; i++ ) {
-        if ( !size[i] )
-            continue;
+    /* Data set from Python belongs to the caller, not the cache */
+    if (block->sdfref)
+        cache_unlink(block);
 
-        sub = PyArray_SimpleNewFromData(
-                1, dims, typemap[b->variable_types[i]], v);
+    /* Releasing the old data can switch threads, so replace it first */
+    if ( value != NULL )
+        Py_INCREF(value);
+    block->data = value;
+    Py_XDECREF(old);
 
-        sprintf(key, "%s/%s/%s", b->name,
-                b->station_names[stat[(int)(i-1)/nvars]],
-                var_names[(i-1)%nvars]);
+    return 0;
+}
 
-        PyDict_SetItemString(dict, key, sub);
-        Py_DECREF(sub);
 
-        v += nrows * size[i];
-    }
+/*
+ * Array sections
+ *
+ * block[...] and block.read(section) accept integers, slices (with steps) and
+ * Ellipsis along each dimension and return the same shape as the equivalent
+ * NumPy indexing of block.data. If the data is not already in memory then
+ * only the requested section is read from the file.
+ ******************************************************************************/
 
-    free(var_names);
-    free(size);
-    free(key);
-    free(stat);
-    free(offset);
-}
+typedef struct {
+    int ndims;
+    npy_intp dims[SDF_MAXDIMS], lens[SDF_MAXDIMS];
+    int64_t starts[SDF_MAXDIMS], ends[SDF_MAXDIMS], strides[SDF_MAXDIMS];
+    PyObject *items[SDF_MAXDIMS];
+    /* Indexing applied to the section once read: flips and dropped axes */
+    PyObject *post[SDF_MAXDIMS];
+    int trivial_post;
+} section_t;
 
 
-#define SET_BENTRY(type, value, dict) do { \
-        sub = Py_BuildValue(#type, b->value); \
-        PyDict_SetItemString(dict, #value, sub); \
-        Py_DECREF(sub); \
-    } while (0)
+static void free_section(section_t *s)
+{
+    int i;
 
-#define SET_IENTRY(i, type, value, dict) do { \
-        sub = Py_BuildValue(#type, b->value[i]); \
-        PyDict_SetItemString(dict, #value, sub); \
-        Py_DECREF(sub); \
-    } while (0)
+    for (i = 0; i < SDF_MAXDIMS; i++) {
+        Py_CLEAR(s->items[i]);
+        Py_CLEAR(s->post[i]);
+    }
+}
 
-#define SET_IBOOL(i, value, dict) \
-    if (b->value[i]) PyDict_SetItemString(dict, #value, Py_True); \
-    else PyDict_SetItemString(dict, #value, Py_False)
 
-int append_station_metadata(sdf_block_t *b, PyObject *dict)
+static PyObject *section_tuple(PyObject **items, int n)
 {
-    PyObject *block, *station, *variable, *statdict, *sdict, *sub;
+    PyObject *tuple;
     int i;
-    Py_ssize_t j;
 
-    /* Sanity check */
-    if ( !PyDict_Check(dict) )
-        return -1;
+    tuple = PyTuple_New(n);
+    if (!tuple) return NULL;
 
-    block = PyDict_New();
-    statdict = PyDict_New();
-    PyDict_SetItemString(dict, b->name, block);
-    PyDict_SetItemString(block, "stations", statdict);
+    for (i = 0; i < n; i++) {
+        Py_INCREF(items[i]);
+        PyTuple_SET_ITEM(tuple, i, items[i]);
+    }
 
-    SET_BENTRY(i, step, block);
-    SET_BENTRY(i, step_increment, block);
-    SET_BENTRY(d, time, block);
-    SET_BENTRY(d, time_increment, block);
+    return tuple;
+}
 
-    for ( i=0; i<b->nstations; i++ ) {
-        sdict = PyDict_New();
-        PyDict_SetItemString(statdict, b->station_names[i], sdict);
 
-        station = PyList_New(b->station_nvars[i]);
+/* Parse an index into a section of an array with the given dimensions */
+static int parse_section_dims(PyObject *key, int ndims, const npy_intp *dims,
+                              section_t *s)
+{
+    PyObject *tuple, *item;
+    Py_ssize_t nkey, nindex, i, j, k, start, stop, step, len;
+    int ellipsis = 0;
 
-        for ( j=0; j<b->station_nvars[i]; j++ ) {
-            variable = PyASCII_FromString(b->material_names[i+j+1]);
-            PyList_SET_ITEM(station, j, variable);
-        }
-        PyDict_SetItemString(sdict, "variables", station);
+    memset(s, 0, sizeof(*s));
 
-        SET_IBOOL(i, station_move, sdict);
+    s->ndims = ndims;
+    for (i = 0; i < ndims; i++)
+        s->dims[i] = dims[i];
 
-        if (b->ndims > 0)
-            SET_IENTRY(i, d, station_x, sdict);
-        if (b->ndims > 1)
-            SET_IENTRY(i, d, station_y, sdict);
-        if (b->ndims > 2)
-            SET_IENTRY(i, d, station_z, sdict);
+    if (PyTuple_Check(key)) {
+        tuple = key;
+        Py_INCREF(tuple);
+    } else {
+        tuple = PyTuple_Pack(1, key);
+        if (!tuple) return -1;
+    }
 
-        Py_DECREF(sdict);
-        Py_DECREF(station);
+    nkey = PyTuple_GET_SIZE(tuple);
+    for (i = 0; i < nkey; i++) {
+        if (PyTuple_GET_ITEM(tuple, i) == Py_Ellipsis)
+            ellipsis++;
     }
 
-    Py_DECREF(statdict);
-    Py_DECREF(block);
+    nindex = nkey - ellipsis;
+    if (ellipsis > 1) {
+        PyErr_SetString(PyExc_IndexError,
+                        "an index can only have a single ellipsis ('...')");
+        goto error;
+    }
+    if (nindex > s->ndims) {
+        PyErr_Format(PyExc_IndexError, "too many indices for block: block is "
+                     "%i-dimensional, but %zd were indexed", s->ndims, nindex);
+        goto error;
+    }
 
-    return 0;
-}
+    for (i = 0, j = 0; i < nkey; i++) {
+        item = PyTuple_GET_ITEM(tuple, i);
+        if (item == Py_Ellipsis) {
+            for (k = 0; k < s->ndims - nindex; k++)
+                s->items[j++] = PySlice_New(NULL, NULL, NULL);
+        } else {
+            Py_INCREF(item);
+            s->items[j++] = item;
+        }
+    }
+    while (j < s->ndims)
+        s->items[j++] = PySlice_New(NULL, NULL, NULL);
+
+    s->trivial_post = 1;
+    for (j = 0; j < s->ndims; j++) {
+        item = s->items[j];
+        if (!item) goto error;
+
+        if (PySlice_Check(item)) {
+            if (PySlice_Unpack(item, &start, &stop, &step) < 0)
+                goto error;
+            len = PySlice_AdjustIndices(s->dims[j], &start, &stop, step);
+            if (step < 0) {
+                /* Read forwards and reverse the result */
+                if (len) start += (len - 1) * step;
+                step = -step;
+                item = PyLong_FromLong(-1);
+                if (!item) goto error;
+                s->post[j] = PySlice_New(NULL, NULL, item);
+                Py_DECREF(item);
+                item = s->post[j];
+                s->trivial_post = 0;
+            } else
+                item = PySlice_New(NULL, NULL, NULL);
+        } else if (PyIndex_Check(item)) {
+            start = PyNumber_AsSsize_t(item, PyExc_IndexError);
+            if (start == -1 && PyErr_Occurred())
+                goto error;
+            if (start < 0)
+                start += s->dims[j];
+            if (start < 0 || start >= s->dims[j]) {
+                PyErr_Format(PyExc_IndexError, "index %zd is out of bounds "
+                             "for axis %zd with size %zd",
+                             start, j, (Py_ssize_t)s->dims[j]);
+                goto error;
+            }
+            len = step = 1;
+            item = PyLong_FromLong(0);
+            s->trivial_post = 0;
+        } else {
+            PyErr_SetString(PyExc_IndexError, "only integers, slices (`:`) "
+                            "and ellipsis (`...`) are valid indices");
+            goto error;
+        }
 
+        s->post[j] = item;
+        if (!item) goto error;
 
-#define SET_ENTRY(type,value) do { \
-        PyObject *sub; \
-        sub = Py_BuildValue(#type, h->value); \
-        PyDict_SetItemString(dict, #value, sub); \
-        Py_DECREF(sub); \
-    } while (0)
-
-#define SET_BOOL(value) \
-    if (h->value) PyDict_SetItemString(dict, #value, Py_True); \
-    else PyDict_SetItemString(dict, #value, Py_False)
+        s->starts[j] = start;
+        s->strides[j] = step;
+        s->lens[j] = len;
+        s->ends[j] = len ? start + (len - 1) * step + 1 : start;
+    }
 
-static PyObject *fill_header(sdf_file_t *h)
-{
-    PyObject *dict;
-    PyObject *fname;
-    char fullpath[PATH_MAX];
+    Py_DECREF(tuple);
+    return 0;
 
-    dict = PyDict_New();
+error:
+    Py_DECREF(tuple);
+    free_section(s);
+    return -1;
+}
 
-    fname = Py_BuildValue("s", realpath(h->filename, fullpath));
-    PyDict_SetItemString(dict, "filename", fname);
-    Py_DECREF(fname);
 
-    SET_ENTRY(i, file_version);
-    SET_ENTRY(i, file_revision);
-    SET_ENTRY(s, code_name);
-    SET_ENTRY(i, step);
-    SET_ENTRY(d, time);
-    SET_ENTRY(i, jobid1);
-    SET_ENTRY(i, jobid2);
-    SET_ENTRY(i, code_io_version);
-    SET_BOOL(restart_flag);
-    SET_BOOL(other_domains);
-    SET_BOOL(station_file);
+static int parse_section(Block *block, PyObject *key, section_t *s)
+{
+    /* Point meshes are indexed by particle, not by spatial dimension */
+    if (block->b->blocktype == SDF_BLOCKTYPE_POINT_MESH)
+        return parse_section_dims(key, 1, block->adims, s);
 
-    return dict;
+    return parse_section_dims(key, block->ndims, block->adims, s);
 }
 
 
-static void
-setup_materials(SDFObject *sdf, PyObject *dict, sdf_block_t *b,
-                PyObject *dict_id)
+/* Apply the section to data that is already in memory */
+static PyObject *slice_data(Block *block, PyObject *data, section_t *s)
 {
-    char *block_name = NULL;
-    Block *block = NULL;
-    PyObject *name = NULL;
-    Py_ssize_t i;
+    PyObject *ob, *index, *sub;
+    Py_ssize_t i, n;
 
-    if (!sdf->h || !b) return;
+    index = section_tuple(s->items, s->ndims);
+    if (!index) return NULL;
 
-    block_name = b->name;
+    if (!PyTuple_Check(data)) {
+        ob = PyObject_GetItem(data, index);
+        Py_DECREF(index);
+        return ob;
+    }
 
-    block = (Block*)Block_alloc(sdf, b);
-    if (!block) goto free_mem;
+    /* Mesh data is a tuple of arrays. Plain mesh axes are indexed separately */
+    n = PyTuple_GET_SIZE(data);
+    ob = PyTuple_New(n);
+    for (i = 0; ob && i < n; i++) {
+        if (block->b->blocktype == SDF_BLOCKTYPE_PLAIN_MESH)
+            sub = PyObject_GetItem(PyTuple_GET_ITEM(data, i), s->items[i]);
+        else
+            sub = PyObject_GetItem(PyTuple_GET_ITEM(data, i), index);
+        if (!sub) Py_CLEAR(ob);
+        else PyTuple_SET_ITEM(ob, i, sub);
+    }
 
-    if (b->material_names) {
-        block->material_names = PyList_New(b->ndims);
-        if (!block->material_names) goto free_mem;
+    Py_DECREF(index);
+    return ob;
+}
 
-        for (i=0; i < b->ndims; i++) {
-            name = PyASCII_FromString(b->material_names[i]);
-            PyList_SET_ITEM(block->material_names, i, name);
-        }
+
+/*
+ * Wrap a section copied out of the library in a NumPy array which owns it.
+ * If the library returned the full array then the section is applied here
+ * instead.
+ */
+static PyObject *wrap_section(SDFObject *sdf, sdf_block_t *b, void *buffer,
+                              int type, int nd, npy_intp *dims,
+                              npy_intp *lens, PyObject **items,
+                              PyObject **post, int trivial_post)
+{
+    PyObject *tmp, *ob, *index;
+    ArrayObject *array;
+    int i, full = 0;
+
+    if (!buffer)
+        return PyArray_ZEROS(nd, lens, type, 1);
+
+    for (i = 0; i < nd; i++) {
+        if (dims[i] != lens[i])
+            full = 1;
     }
 
-    if (b->variable_ids) {
-        block->material_ids = PyList_New(b->ndims);
-        if (!block->material_ids) goto free_mem;
+    ob = PyArray_NewFromDescr(&PyArray_Type, PyArray_DescrFromType(type),
+        nd, dims, NULL, buffer, NPY_ARRAY_F_CONTIGUOUS | NPY_ARRAY_WRITEABLE,
+        NULL);
+    if (!ob) {
+        free(buffer);
+        return NULL;
+    }
 
-        for (i=0; i < b->ndims; i++) {
-            name = PyASCII_FromString(b->variable_ids[i]);
-            PyList_SET_ITEM(block->material_ids, i, name);
-        }
+    array = (ArrayObject*)Array_new(&ArrayType, sdf, b);
+    if (array) array->mem = malloc(sizeof(*array->mem));
+    if (!array || !array->mem) {
+        Py_XDECREF(array);
+        Py_DECREF(ob);
+        free(buffer);
+        return PyErr_NoMemory();
     }
+    array->mem[0] = buffer;
+    array->memlen = 1;
+    PyArray_SetBaseObject((PyArrayObject*)ob, (PyObject*)array);
 
-    PyDict_SetItemString(dict_id, b->id, (PyObject*)block);
-    PyDict_SetItemString(dict, block_name, (PyObject*)block);
-    Py_DECREF(block);
+    if (!full && trivial_post) return ob;
 
-    return;
+    index = section_tuple(full ? items : post, nd);
+    if (!index) {
+        Py_DECREF(ob);
+        return NULL;
+    }
 
-free_mem:
-    if (block) Py_DECREF(block);
-    return;
-}
+    tmp = PyObject_GetItem(ob, index);
+    Py_DECREF(index);
+    Py_DECREF(ob);
 
+    return tmp;
+}
 
-static PyObject *dict_find_id(PyObject *dict, char *id);
 
-static void
-setup_stitched(SDFObject *sdf, PyObject *dict, sdf_block_t *b,
-               PyObject *dict_id)
+/* Return the library to reading the whole block */
+static void reset_array_section(sdf_block_t *b)
 {
+    int64_t starts[SDF_MAXDIMS], strides[SDF_MAXDIMS];
     int i;
-    char *block_name = NULL;
-    Block *block = NULL;
-    PyObject *val;
 
-    if (!sdf->h || !b) return;
+    for (i = 0; i < SDF_MAXDIMS; i++) {
+        starts[i] = 0;
+        strides[i] = 1;
+    }
 
-    block_name = b->name;
+    sdf_block_set_array_section(b, b->ndims, starts, b->dims, strides);
+}
 
-    block = (Block*)Block_alloc(sdf, b);
-    if (!block) goto free_mem;
 
-    for (i=0; i < b->ndims; i++) {
-        val = dict_find_id(dict_id, b->variable_ids[i]);
-        if (!val) continue;
-        PyTuple_SetItem(block->data, i, val);
-        Py_INCREF(val);
-    }
+static PyObject *read_section(Block *block, section_t *s)
+{
+    SDFObject *sdf = block->sdf;
+    sdf_block_t *b = block->b;
+    PyObject *ob = NULL, *sub;
+    npy_intp dims[SDF_MAXDIMS];
+    void *src, *buffers[SDF_MAXDIMS] = { NULL };
+    int type = typemap[b->datatype_out];
+    int i, n, narrays = 1, held, ok = 1;
+    int64_t size;
+
+    if (b->blocktype == SDF_BLOCKTYPE_POINT_MESH
+            || b->blocktype == SDF_BLOCKTYPE_LAGRANGIAN_MESH)
+        narrays = b->ndims;
+
+    for (i = 0; i < s->ndims; i++)
+        dims[i] = s->lens[i];
+
+    /* The section is copied out so that the library data can be released */
+    if (PyArray_MultiplyList(s->lens, s->ndims) != 0) {
+        Py_BEGIN_ALLOW_THREADS
+        SDF_LOCK(sdf);
+
+        /* Data that another array holds in full is left in place */
+        held = b->done_data;
+        if (!held) {
+            sdf_block_set_array_section(b, s->ndims, s->starts, s->ends,
+                                        s->strides);
+            sdf->h->current_block = b;
+            sdf_helper_read_data(sdf->h, b);
+        }
 
-    PyDict_SetItemString(dict_id, b->id, (PyObject*)block);
-    PyDict_SetItemString(dict, block_name, (PyObject*)block);
-    Py_DECREF(block);
+        if (b->done_data) {
+            size = SDF_TYPE_SIZES[b->datatype_out];
+            for (i = 0; i < s->ndims; i++) {
+                dims[i] = b->local_dims[i];
+                size *= dims[i];
+            }
+            for (n = 0; n < narrays; n++) {
+                src = b->grids ? b->grids[n] : b->data;
+                buffers[n] = malloc(size);
+                if (src && buffers[n])
+                    memcpy(buffers[n], src, size);
+                else
+                    ok = 0;
+            }
+        } else
+            ok = 0;
 
-    return;
+        if (!held) {
+            sdf_free_block_data(sdf->h, b);
+            reset_array_section(b);
+        }
 
-free_mem:
-    if (block) Py_DECREF(block);
-    return;
-}
+        SDF_UNLOCK(sdf);
+        Py_END_ALLOW_THREADS
 
+        if (!ok) {
+            for (n = 0; n < narrays; n++)
+                free(buffers[n]);
+            return PyErr_Format(PyExc_Exception, "Unable to read SDF block\n");
+        }
+    }
 
-#define SET_ENTRY2(value) do { \
-        PyObject *sub; \
-        sub = Py_BuildValue("s", str); \
-        PyDict_SetItemString(dict, #value, sub); \
-        Py_DECREF(sub); \
-    } while (0)
+    if (narrays == 1)
+        return wrap_section(sdf, b, buffers[0], type, s->ndims, dims, s->lens,
+                            s->items, s->post, s->trivial_post);
 
-#define SET_ENTRY3(value) do { \
-        PyObject *sub; \
-        sub = Py_BuildValue("s", run->value); \
-        PyDict_SetItemString(dict, #value, sub); \
-        Py_DECREF(sub); \
-    } while (0)
+    ob = PyTuple_New(narrays);
+    for (n = 0; n < narrays; n++) {
+        if (!ob) {
+            free(buffers[n]);
+            continue;
+        }
+        sub = wrap_section(sdf, b, buffers[n], type, s->ndims, dims, s->lens,
+                           s->items, s->post, s->trivial_post);
+        if (!sub) Py_CLEAR(ob);
+        else PyTuple_SET_ITEM(ob, n, sub);
+    }
 
-static PyObject *fill_runinfo(sdf_block_t *b)
-{
-    PyObject *dict;
-    struct run_info *run = b->data;
-    time_t time;
-    char *str;
-    char cstring[32];
+    return ob;
+}
 
-    dict = PyDict_New();
 
-    str = cstring;
-    snprintf(str, 32, "%i.%i.%i",
-             run->version, run->revision, run->minor_rev);
-    SET_ENTRY2(version);
+/* Convert data already in memory to another type. Steals the reference */
+static PyObject *cast_data(PyObject *data, int type)
+{
+    PyObject *ob, *sub;
+    Py_ssize_t n;
 
-    SET_ENTRY3(commit_id);
-    SET_ENTRY3(sha1sum);
-    SET_ENTRY3(compile_machine);
-    SET_ENTRY3(compile_flags);
+    if (!data) return NULL;
 
-    str = cstring;
-    snprintf(str, 32, "%" PRIi64, run->defines);
-    SET_ENTRY2(defines);
+    if (!PyTuple_Check(data)) {
+        ob = PyArray_CastToType((PyArrayObject*)data,
+                                PyArray_DescrFromType(type), 1);
+        Py_DECREF(data);
+        return ob;
+    }
 
-    time = run->compile_date; str = ctime(&time); str[strlen(str)-1]='\0';
-    SET_ENTRY2(compile_date);
+    ob = PyTuple_New(PyTuple_GET_SIZE(data));
+    for (n = 0; ob && n < PyTuple_GET_SIZE(data); n++) {
+        sub = PyTuple_GET_ITEM(data, n);
+        Py_INCREF(sub);
+        sub = cast_data(sub, type);
+        if (!sub) Py_CLEAR(ob);
+        else PyTuple_SET_ITEM(ob, n, sub);
+    }
 
-    time = run->run_date; str = ctime(&time); str[strlen(str)-1] = '\0';
-    SET_ENTRY2(run_date);
+    Py_DECREF(data);
+    return ob;
+}
 
-    time = run->io_date; str = ctime(&time); str[strlen(str)-1] = '\0';
-    SET_ENTRY2(io_date);
 
-    return dict;
+/*
+ * Whether data held in memory as type 'from' can be cast to 'type' without
+ * losing precision. Wider types have to be read from the file instead.
+ */
+static int cast_exact(int from, int type)
+{
+    return from == type || PyArray_CanCastSafely(type, from);
 }
 
 
-static void
-setup_array(SDFObject *sdf, PyObject *dict, sdf_block_t *b, PyObject *dict_id)
+/* Read a section of a block as the given NumPy type */
+static PyObject *read_section_type(Block *block, PyObject *key, int type)
 {
-    char *block_name = NULL;
-    Block *block = NULL;
-
-    if (!sdf->h || !b) return;
+    SDFObject *sdf = block->sdf;
+    sdf_block_t *b = block->b;
+    PyObject *data, *ob = NULL;
+    void *grids[SDF_MAXDIMS];
+    section_t s;
+    int native, from;
 
-    block_name = b->name;
+    if (!sdf || !sdf->h || !b)
+        return PyErr_Format(PyExc_Exception, "Unknown SDF file\n");
 
-    block = (Block*)Block_alloc(sdf, b);
-    if (!block) goto free_mem;
+    if (parse_section(block, key, &s) < 0)
+        return NULL;
 
-    if (b->units) {
-        block->units = PyASCII_FromString(b->units);
-        if (!block->units) goto free_mem;
+    native = typemap[b->datatype_out];
+    from = block->convert_type ? block->convert_type : native;
+
+    /*
+     * Slice the full data if it is already available, cheap to map or has to
+     * be computed from the whole block. Plain meshes are small enough to
+     * always read in full. Otherwise read just the section.
+     */
+    switch (b->blocktype) {
+    case SDF_BLOCKTYPE_POINT_MESH:
+    case SDF_BLOCKTYPE_LAGRANGIAN_MESH:
+    case SDF_BLOCKTYPE_PLAIN_VARIABLE:
+    case SDF_BLOCKTYPE_POINT_VARIABLE:
+    case SDF_BLOCKTYPE_ARRAY:
+        if (!block->data && !block->parent && !b->done_data
+                && !map_block_data(sdf->h, b, grids)) {
+            ob = read_section(block, &s);
+            if (ob && type != native)
+                ob = cast_data(ob, type);
+            break;
+        }
+    default:
+        if (cast_exact(from, type)) {
+            data = Block_getdata(block, NULL);
+        } else {
+            data = read_block_data(block, 0, 0);
+            from = native;
+        }
+        if (data) {
+            ob = slice_data(block, data, &s);
+            Py_DECREF(data);
+        }
+        if (ob && type != from)
+            ob = cast_data(ob, type);
     }
 
-    PyDict_SetItemString(dict_id, b->id, (PyObject*)block);
-    PyDict_SetItemString(dict, block_name, (PyObject*)block);
-    Py_DECREF(block);
+    free_section(&s);
+    return ob;
+}
 
-    return;
 
-free_mem:
-    if (block) Py_DECREF(block);
-    return;
+static PyObject *Block_read_section(Block *block, PyObject *key)
+{
+    if (!block->b)
+        return PyErr_Format(PyExc_Exception, "Unknown SDF file\n");
+
+    return read_section_type(block, key, block->convert_type
+                             ? block->convert_type
+                             : typemap[block->b->datatype_out]);
 }
 
 
-static void
-setup_constant(SDFObject *sdf, PyObject *dict, sdf_block_t *b,
-               PyObject *dict_id)
+static PyObject *Block_read(Block *block, PyObject *args, PyObject *kw)
 {
-    Block *block = NULL;
-    double dd;
-    long il;
-    long long ll;
-    char cc;
+    static char *kwlist[] = {"section", "dtype", NULL};
+    PyObject *section = NULL;
+    PyArray_Descr *descr = NULL;
+    int type = -1, native, current;
 
-    block = (Block*)Block_alloc(sdf, b);
-    if (!block) return;
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "|OO&", kwlist, &section,
+            PyArray_DescrConverter2, &descr))
+        return NULL;
 
-    switch(b->datatype) {
-        case SDF_DATATYPE_REAL4:
-            dd = *((float*)b->const_value);
-            block->data = PyFloat_FromDouble(dd);
-            break;
-        case SDF_DATATYPE_REAL8:
-            dd = *((double*)b->const_value);
-            block->data = PyFloat_FromDouble(dd);
-            break;
-        case SDF_DATATYPE_INTEGER4:
-            il = *((int32_t*)b->const_value);
-            block->data = PyLong_FromLong(il);
-            break;
-        case SDF_DATATYPE_INTEGER8:
-            ll = *((int64_t*)b->const_value);
-            block->data = PyLong_FromLongLong(ll);
-            break;
-        case SDF_DATATYPE_LOGICAL:
-            cc = *((char*)b->const_value);
-            if (cc)
-                block->data = Py_True;
-            else
-                block->data = Py_False;
-            break;
+    if (section == Py_None)
+        section = NULL;
+
+    if (descr) {
+        type = descr->type_num;
+        Py_DECREF(descr);
     }
 
-    PyDict_SetItemString(dict_id, b->id, (PyObject*)block);
-    PyDict_SetItemString(dict, b->name, (PyObject*)block);
+    if (!block->sdf || !block->sdf->h || !block->b)
+        return PyErr_Format(PyExc_Exception, "Unknown SDF file\n");
 
-    Py_DECREF(block);
+    /* Read as for block.data unless another type is asked for */
+    native = typemap[block->b->datatype_out];
+    current = block->convert_type ? block->convert_type : native;
+    if (type < 0)
+        type = current;
 
-    return;
+    if (type != current && type != native
+            && !convert_supported(block->b, type))
+        return PyErr_Format(PyExc_TypeError, "Block '%s' cannot be read as "
+                            "this dtype\n", block->b->id);
+
+    if (section)
+        return read_section_type(block, section, type);
+
+    if (type == current)
+        return Block_getdata(block, NULL);
+
+    /* Data already in memory is converted with NumPy if nothing is lost */
+    if ((block->data || block->parent) && cast_exact(current, type))
+        return cast_data(Block_getdata(block, NULL), type);
+
+    return read_block_data(block, type == native ? 0 : type, 0);
 }
 
 
-static char*
+static PyObject *Block_release(Block *block, PyObject *unused)
+{
+    Block_setdata(block, NULL, NULL);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *Block_enter(Block *block, PyObject *unused)
+{
+    Py_INCREF(block);
+    return (PyObject*)block;
+}
+
+
+static PyObject *Block_exit(Block *block, PyObject *args)
+{
+    Block_setdata(block, NULL, NULL);
+    Py_RETURN_FALSE;
+}
+
+
+static PyMethodDef Block_methods[] = {
+    {"read", (PyCFunction)Block_read, METH_VARARGS | METH_KEYWORDS,
+     "read([section, dtype])\n"
+     "\nReads the block data, or a section of it.\n\n"
+     "Parameters\n"
+     "----------\n"
+     "section : index, optional\n"
+     "    Integers, slices and Ellipsis as used to index a NumPy array,\n"
+     "    for example block.read(np.s_[::2, 10]). Only the requested\n"
+     "    section is read from the file. block[...] is equivalent.\n"
+     "dtype : data-type, optional\n"
+     "    Read the data as this type, which may be np.float32 for double\n"
+     "    precision data. The whole block is then converted as it is read,\n"
+     "    into a new array that is not kept as block.data.\n"
+    },
+    {"release", (PyCFunction)Block_release, METH_NOARGS,
+     "release()\n"
+     "\nDrops the block's reference to its data, as for del block.data.\n"
+     "The memory is freed once no other arrays refer to it, and the data\n"
+     "is read again if block.data is next accessed.\n"
+     "Using the block in a with statement releases it at the end.\n"
+    },
+    {"__enter__", (PyCFunction)Block_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)Block_exit, METH_VARARGS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+
+static PyMappingMethods Block_as_mapping = {
+    NULL,                              /* mp_length        */
+    (binaryfunc)Block_read_section,    /* mp_subscript     */
+    NULL,                              /* mp_ass_subscript */
+};
+
+
+/*
+ * SDF type methods
+ ******************************************************************************/
+
+static void
+SDF_dealloc(PyObject* self)
+{
+    SDFObject *sdf = (SDFObject*)self;
+    sdf_file_t *h = sdf->h;
+    if (h) {
+        sdf_stack_destroy(h);
+        sdf_close(h);
+    }
+    if (sdf->fd >= 0) close(sdf->fd);
+    if (sdf->lock) PyThread_free_lock(sdf->lock);
+    Py_XDECREF(sdf->dtypes);
+    self->ob_type->tp_free(self);
+}
+
+
+static void
+setup_mesh(SDFObject *sdf, PyObject *dict, sdf_block_t *b, PyObject *dict_id)
+{
+    char *block_name = NULL;
+    char *mesh_id = NULL;
+    PyObject *ob = NULL;
+    Block *parent, *block = NULL;
+    Py_ssize_t n, len_name, len_id;
+
+    if (!sdf->h || !b) return;
+
+    len_name = strlen(b->name);
+    block_name = malloc(len_name + 5);
+    if (!block_name) goto free_mem;
+
+    memcpy(block_name, b->name, len_name);
+    block_name[len_name] = '\0';
+
+    block = (Block*)Block_alloc(sdf, b);
+    if (!block) goto free_mem;
+
+    block->labels = PyTuple_New(b->ndims);
+    if (!block->labels) goto free_mem;
+
+    block->units = PyTuple_New(b->ndims);
+    if (!block->units) goto free_mem;
+
+    for (n = 0; n < b->ndims; n++) {
+        ob = PyASCII_FromString(b->dim_labels[n]);
+        if (!ob) goto free_mem;
+        PyTuple_SetItem(block->labels, n, ob);
+
+        ob = PyASCII_FromString(b->dim_units[n]);
+        if (!ob) goto free_mem;
+        PyTuple_SetItem(block->units, n, ob);
+    }
+
+    PyDict_SetItemString(dict_id, b->id, (PyObject*)block);
+    PyDict_SetItemString(dict, block_name, (PyObject*)block);
+    Py_DECREF(block);
+
+    if (b->blocktype == SDF_BLOCKTYPE_POINT_MESH) {
+        free(block_name);
+        return;
+    }
+
+    /* Add median mesh block */
+
+    parent = block;
+    memcpy(block_name+len_name, "_mid", 5);
+
+    block = (Block*)Block_alloc(sdf, b);
+    if (!block) goto free_mem;
+
+    /* This block needs a reference to the parent and also needs the parent to
+       exist as long as we do. */
+    block->parent = parent;
+    Py_INCREF(block->parent);
+
+    block->labels = PyTuple_New(b->ndims);
+    if (!block->labels) goto free_mem;
+
+    block->units = PyTuple_New(b->ndims);
+    if (!block->units) goto free_mem;
+
+    for (n = 0; n < b->ndims; n++) {
+        if (block->adims[n] > 1)
+            block->adims[n]--;
+        PyTuple_SetItem(block->dims, n, PyLong_FromLong(block->adims[n]));
+
+        ob = PyASCII_FromString(b->dim_labels[n]);
+        if (!ob) goto free_mem;
+        PyTuple_SetItem(block->labels, n, ob);
+
+        ob = PyASCII_FromString(b->dim_units[n]);
+        if (!ob) goto free_mem;
+        PyTuple_SetItem(block->units, n, ob);
+    }
+
+    len_id = strlen(b->id);
+    mesh_id = malloc(len_id + 5);
+    if (!mesh_id) goto free_mem;
+
+    memcpy(mesh_id, b->id, len_id);
+    memcpy(mesh_id+len_id, "_mid", 5);
+
+    Py_DECREF(block->id);
+    block->id = PyASCII_FromString(mesh_id);
+    if (!block->id) goto free_mem;
+
+    Py_DECREF(block->name);
+    block->name = PyASCII_FromString(block_name);
+    if (!block->name) goto free_mem;
+
+    PyDict_SetItemString(dict_id, mesh_id, (PyObject*)block);
+    PyDict_SetItemString(dict, block_name, (PyObject*)block);
+    Py_DECREF(block);
+
+    free(mesh_id);
+    free(block_name);
+
+    return;
+
+free_mem:
+    if (block_name) free(block_name);
+    if (mesh_id) free(mesh_id);
+    if (block) Py_DECREF(block);
+    if (ob) Py_DECREF(ob);
+}
+
+
+/*
+ * Station time histories are returned as one array per column. The columns
+ * are copied out of the buffer filled by the library, which is then freed,
+ * so that each array owns its own memory.
+ */
+static void extract_station_time_histories(sdf_file_t *h, PyObject *stations,
+        PyObject *variables, double t0, double t1, PyObject *dict)
+{
+    Py_ssize_t nvars, i, nstat;
+    PyObject *sub;
+    char **var_names, *timehis = NULL, *v, *key, *mask;
+    long *stat, ii;
+    int *size, *offset, nrows, row_size;
+    sdf_block_t *b = h->current_block;
+    npy_intp dims[1];
+
+    if ( !variables )
+        return;
+
+    if ( !stations ) {
+        nstat = 1;
+        stat = (long *)malloc(sizeof(long));
+        stat[0] = 0;
+    } else {
+        /* Mark the requested stations, numbered from one, in a single pass */
+        mask = (char *)calloc(b->nstations + 1, 1);
+        stat = (long *)calloc(b->nstations + 1, sizeof(long));
+        if ( !mask || !stat ) {
+            free(mask);
+            free(stat);
+            return;
+        }
+        for ( i=0; i<PyList_Size(stations); i++ ) {
+            ii = PyLong_AsLong(PyList_GET_ITEM(stations, i));
+            if ( ii >= 1 && ii <= b->nstations )
+                mask[ii-1] = 1;
+        }
+        PyErr_Clear();
+
+        /* Force 'stat' to be valid input for sdf_read_station_timehis */
+        nstat = 0;
+        for ( ii=0; ii<b->nstations; ii++ ) {
+            if ( mask[ii] )
+                stat[nstat++] = ii;
+        }
+        free(mask);
+    }
+
+    nvars = PyList_Size(variables);
+    if ( !nstat || !nvars ) {
+        free(stat);
+        return;
+    }
+
+    var_names = (char **)calloc(nvars, sizeof(char *));
+    for ( i=0; i<nvars; i++ ) {
+        sub = PyList_GetItem(variables, i);
+        v = PyBytes_As_C(sub);
+        if ( v ) var_names[i] = strdup(v);
+        if ( !var_names[i] ) {
+            while ( i-- ) free(var_names[i]);
+            free(var_names);
+            free(stat);
+            PyErr_SetString(PyExc_TypeError,
+                    "'variables' keyword must be a string or list of strings");
+            return;
+        }
+    }
+
+    offset = (int *)calloc(nstat*nvars+1, sizeof(int));
+    size = (int *)calloc(nstat*nvars+1, sizeof(int));
+    key = malloc(3*h->string_length+3);
+    if ( !offset || !size || !key )
+        goto free_mem;
+
+    if ( sdf_read_station_timehis(h, stat, nstat, var_names, nvars, t0, t1,
+            &timehis, size, offset, &nrows, &row_size) ) {
+        timehis = NULL;
+        goto free_mem;
+    }
+
+    b = h->current_block;
+    dims[0] = nrows;
+
+    /* 'Time' is the first column, followed by each station variable */
+    v = timehis;
+    for ( i=0; i<=nstat*nvars; i++ ) {
+        if ( !size[i] )
+            continue;
+
+        sub = PyArray_SimpleNew(1, dims, typemap[b->variable_types[i]]);
+        if ( !sub )
+            break;
+        memcpy(PyArray_DATA((PyArrayObject*)sub), v, nrows * size[i]);
+
+        if ( i == 0 )
+            sprintf(key, "%s/Time", b->name);
+        else
+            sprintf(key, "%s/%s/%s", b->name,
+                    b->station_names[stat[(int)(i-1)/nvars]],
+                    var_names[(i-1)%nvars]);
+
+        PyDict_SetItemString(dict, key, sub);
+        Py_DECREF(sub);
+
+        v += nrows * size[i];
+    }
+
+free_mem:
+    for ( i=0; i<nvars; i++ )
+        free(var_names[i]);
+    free(var_names);
+    free(timehis);
+    free(size);
+    free(key);
+    free(stat);
+    free(offset);
+}
+
+
+#define SET_BENTRY(type, value, dict) do { \
+        sub = Py_BuildValue(#type, b->value); \
+        PyDict_SetItemString(dict, #value, sub); \
+        Py_DECREF(sub); \
+    } while (0)
+
+#define SET_IENTRY(i, type, value, dict) do { \
+        sub = Py_BuildValue(#type, b->value[i]); \
+        PyDict_SetItemString(dict, #value, sub); \
+        Py_DECREF(sub); \
+    } while (0)
+
+#define SET_IBOOL(i, value, dict) \
+    if (b->value[i]) PyDict_SetItemString(dict, #value, Py_True); \
+    else PyDict_SetItemString(dict, #value, Py_False)
+
+int append_station_metadata(sdf_block_t *b, PyObject *dict)
+{
+    PyObject *block, *station, *variable, *statdict, *sdict, *sub;
+    int i;
+    Py_ssize_t j;
+
+    /* Sanity check */
+    if ( !PyDict_Check(dict) )
+        return -1;
+
+    block = PyDict_New();
+    statdict = PyDict_New();
+    PyDict_SetItemString(dict, b->name, block);
+    PyDict_SetItemString(block, "stations", statdict);
+
+    SET_BENTRY(i, step, block);
+    SET_BENTRY(i, step_increment, block);
+    SET_BENTRY(d, time, block);
+    SET_BENTRY(d, time_increment, block);
+
+    for ( i=0; i<b->nstations; i++ ) {
+        sdict = PyDict_New();
+        PyDict_SetItemString(statdict, b->station_names[i], sdict);
+
+        station = PyList_New(b->station_nvars[i]);
+
+        for ( j=0; j<b->station_nvars[i]; j++ ) {
+            variable = PyASCII_FromString(b->material_names[i+j+1]);
+            PyList_SET_ITEM(station, j, variable);
+        }
+        PyDict_SetItemString(sdict, "variables", station);
+
+        SET_IBOOL(i, station_move, sdict);
+
+        if (b->ndims > 0)
+            SET_IENTRY(i, d, station_x, sdict);
+        if (b->ndims > 1)
+            SET_IENTRY(i, d, station_y, sdict);
+        if (b->ndims > 2)
+            SET_IENTRY(i, d, station_z, sdict);
+
+        Py_DECREF(sdict);
+        Py_DECREF(station);
+    }
+
+    Py_DECREF(statdict);
+    Py_DECREF(block);
+
+    return 0;
+}
+
+
+#define SET_ENTRY(type,value) do { \
+        PyObject *sub; \
+        sub = Py_BuildValue(#type, h->value); \
+        PyDict_SetItemString(dict, #value, sub); \
+        Py_DECREF(sub); \
+    } while (0)
+
+#define SET_BOOL(value) \
+    if (h->value) PyDict_SetItemString(dict, #value, Py_True); \
+    else PyDict_SetItemString(dict, #value, Py_False)
+
+static PyObject *fill_header(sdf_file_t *h)
+{
+    PyObject *dict;
+    PyObject *fname;
+    char fullpath[PATH_MAX];
+
+    dict = PyDict_New();
+
+    fname = Py_BuildValue("s", realpath(h->filename, fullpath));
+    PyDict_SetItemString(dict, "filename", fname);
+    Py_DECREF(fname);
+
+    SET_ENTRY(i, file_version);
+    SET_ENTRY(i, file_revision);
+    SET_ENTRY(s, code_name);
+    SET_ENTRY(i, step);
+    SET_ENTRY(d, time);
+    SET_ENTRY(i, jobid1);
+    SET_ENTRY(i, jobid2);
+    SET_ENTRY(i, code_io_version);
+    SET_BOOL(restart_flag);
+    SET_BOOL(other_domains);
+    SET_BOOL(station_file);
+
+    return dict;
+}
+
+
+static void
+setup_materials(SDFObject *sdf, PyObject *dict, sdf_block_t *b,
+                PyObject *dict_id)
+{
+    char *block_name = NULL;
+    Block *block = NULL;
+    PyObject *name = NULL;
+    Py_ssize_t i;
+
+    if (!sdf->h || !b) return;
+
+    block_name = b->name;
+
+    block = (Block*)Block_alloc(sdf, b);
+    if (!block) goto free_mem;
+
+    if (b->material_names) {
+        block->material_names = PyList_New(b->ndims);
+        if (!block->material_names) goto free_mem;
+
+        for (i=0; i < b->ndims; i++) {
+            name = PyASCII_FromString(b->material_names[i]);
+            PyList_SET_ITEM(block->material_names, i, name);
+        }
+    }
+
+    if (b->variable_ids) {
+        block->material_ids = PyList_New(b->ndims);
+        if (!block->material_ids) goto free_mem;
+
+        for (i=0; i < b->ndims; i++) {
+            name = PyASCII_FromString(b->variable_ids[i]);
+            PyList_SET_ITEM(block->material_ids, i, name);
+        }
+    }
+
+    PyDict_SetItemString(dict_id, b->id, (PyObject*)block);
+    PyDict_SetItemString(dict, block_name, (PyObject*)block);
+    Py_DECREF(block);
+
+    return;
+
+free_mem:
+    if (block) Py_DECREF(block);
+    return;
+}
+
+
+static PyObject *dict_find_id(PyObject *dict, char *id);
+
+static void
+setup_stitched(SDFObject *sdf, PyObject *dict, sdf_block_t *b,
+               PyObject *dict_id)
+{
+    int i;
+    char *block_name = NULL;
+    Block *block = NULL;
+    PyObject *val;
+
+    if (!sdf->h || !b) return;
+
+    block_name = b->name;
+
+    block = (Block*)Block_alloc(sdf, b);
+    if (!block) goto free_mem;
+
+    for (i=0; i < b->ndims; i++) {
+        val = dict_find_id(dict_id, b->variable_ids[i]);
+        if (!val) continue;
+        PyTuple_SetItem(block->data, i, val);
+        Py_INCREF(val);
+    }
+
+    PyDict_SetItemString(dict_id, b->id, (PyObject*)block);
+    PyDict_SetItemString(dict, block_name, (PyObject*)block);
+    Py_DECREF(block);
+
+    return;
+
+free_mem:
+    if (block) Py_DECREF(block);
+    return;
+}
+
+
+#define SET_ENTRY2(value) do { \
+        PyObject *sub; \
+        sub = Py_BuildValue("s", str); \
+        PyDict_SetItemString(dict, #value, sub); \
+        Py_DECREF(sub); \
+    } while (0)
+
+#define SET_ENTRY3(value) do { \
+        PyObject *sub; \
+        sub = Py_BuildValue("s", run->value); \
+        PyDict_SetItemString(dict, #value, sub); \
+        Py_DECREF(sub); \
+    } while (0)
+
+static PyObject *fill_runinfo(sdf_block_t *b)
+{
+    PyObject *dict;
+    struct run_info *run = b->data;
+    time_t time;
+    char *str;
+    char cstring[32];
+
+    dict = PyDict_New();
+
+    str = cstring;
+    snprintf(str, 32, "%i.%i.%i",
+             run->version, run->revision, run->minor_rev);
+    SET_ENTRY2(version);
+
+    SET_ENTRY3(commit_id);
+    SET_ENTRY3(sha1sum);
+    SET_ENTRY3(compile_machine);
+    SET_ENTRY3(compile_flags);
+
+    str = cstring;
+    snprintf(str, 32, "%" PRIi64, run->defines);
+    SET_ENTRY2(defines);
+
+    time = run->compile_date; str = ctime(&time); str[strlen(str)-1]='\0';
+    SET_ENTRY2(compile_date);
+
+    time = run->run_date; str = ctime(&time); str[strlen(str)-1] = '\0';
+    SET_ENTRY2(run_date);
+
+    time = run->io_date; str = ctime(&time); str[strlen(str)-1] = '\0';
+    SET_ENTRY2(io_date);
+
+    return dict;
+}
+
+
+static void
+setup_array(SDFObject *sdf, PyObject *dict, sdf_block_t *b, PyObject *dict_id)
+{
+    char *block_name = NULL;
+    Block *block = NULL;
+
+    if (!sdf->h || !b) return;
+
+    block_name = b->name;
+
+    block = (Block*)Block_alloc(sdf, b);
+    if (!block) goto free_mem;
+
+    if (b->units) {
+        block->units = PyASCII_FromString(b->units);
+        if (!block->units) goto free_mem;
+    }
+
+    PyDict_SetItemString(dict_id, b->id, (PyObject*)block);
+    PyDict_SetItemString(dict, block_name, (PyObject*)block);
+    Py_DECREF(block);
+
+    return;
+
+free_mem:
+    if (block) Py_DECREF(block);
+    return;
+}
+
+
+static void
+setup_constant(SDFObject *sdf, PyObject *dict, sdf_block_t *b,
+               PyObject *dict_id)
+{
+    Block *block = NULL;
+    double dd;
+    long il;
+    long long ll;
+    char cc;
+
+    block = (Block*)Block_alloc(sdf, b);
+    if (!block) return;
+
+    switch(b->datatype) {
+        case SDF_DATATYPE_REAL4:
+            dd = *((float*)b->const_value);
+            block->data = PyFloat_FromDouble(dd);
+            break;
+        case SDF_DATATYPE_REAL8:
+            dd = *((double*)b->const_value);
+            block->data = PyFloat_FromDouble(dd);
+            break;
+        case SDF_DATATYPE_INTEGER4:
+            il = *((int32_t*)b->const_value);
+            block->data = PyLong_FromLong(il);
+            break;
+        case SDF_DATATYPE_INTEGER8:
+            ll = *((int64_t*)b->const_value);
+            block->data = PyLong_FromLongLong(ll);
+            break;
+        case SDF_DATATYPE_LOGICAL:
+            cc = *((char*)b->const_value);
+            if (cc)
+                block->data = Py_True;
+            else
+                block->data = Py_False;
+            break;
+    }
+
+    PyDict_SetItemString(dict_id, b->id, (PyObject*)block);
+    PyDict_SetItemString(dict, b->name, (PyObject*)block);
+
+    Py_DECREF(block);
+
+    return;
+}
+
+
+static char*
 get_unique_attr(Block *block, char *attr_in)
 {
-    int len;
-    char *attr = attr_in;
+    int len;
+    char *attr = attr_in;
+
+    if (!block)
+        return attr;
+
+    if (PyObject_HasAttrString((PyObject*)block, attr_in)) {
+        len = strlen(attr_in);
+        attr = calloc(len + 2, sizeof(char));
+        memcpy(attr, attr_in, len);
+        attr[len] = '_';
+    }
+
+    return attr;
+}
+
+
+static void
+setup_namevalue(SDFObject *sdf, PyObject *dict, sdf_block_t *b,
+                PyObject *dict_id)
+{
+    Block *block = NULL;
+    PyObject *sub, *dict2 = NULL;
+    float *ff;
+    double *dd;
+    int32_t *il;
+    int64_t *ll;
+    char *cc, **cp, *attr;
+    Py_ssize_t i;
+
+    block = (Block*)Block_alloc(sdf, b);
+    if (!block) return;
+
+    block->dict = PyDict_New();
+    if (!block->dict) goto free_mem;
+
+    dict2 = PyDict_New();
+    if (!dict2) goto free_mem;
+
+    switch(b->datatype) {
+        case SDF_DATATYPE_REAL4:
+            ff = (float*)b->data;
+            for (i=0; i < b->ndims; i++) {
+                sub = PyFloat_FromDouble(*ff);
+                PyDict_SetItemString(dict2, b->material_names[i], sub);
+                attr = get_unique_attr(block, b->material_names[i]);
+                PyDict_SetItemString(block->dict, attr, sub);
+                Py_DECREF(sub);
+                ff++;
+            }
+            break;
+        case SDF_DATATYPE_REAL8:
+            dd = (double*)b->data;
+            for (i=0; i < b->ndims; i++) {
+                sub = PyFloat_FromDouble(*dd);
+                PyDict_SetItemString(dict2, b->material_names[i], sub);
+                attr = get_unique_attr(block, b->material_names[i]);
+                PyDict_SetItemString(block->dict, attr, sub);
+                Py_DECREF(sub);
+                dd++;
+            }
+            break;
+        case SDF_DATATYPE_INTEGER4:
+            il = (int32_t*)b->data;
+            for (i=0; i < b->ndims; i++) {
+                sub = PyLong_FromLong(*il);
+                PyDict_SetItemString(dict2, b->material_names[i], sub);
+                attr = get_unique_attr(block, b->material_names[i]);
+                PyDict_SetItemString(block->dict, attr, sub);
+                Py_DECREF(sub);
+                il++;
+            }
+            break;
+        case SDF_DATATYPE_INTEGER8:
+            ll = (int64_t*)b->data;
+            for (i=0; i < b->ndims; i++) {
+                sub = PyLong_FromLongLong(*ll);
+                PyDict_SetItemString(dict2, b->material_names[i], sub);
+                attr = get_unique_attr(block, b->material_names[i]);
+                PyDict_SetItemString(block->dict, attr, sub);
+                Py_DECREF(sub);
+                ll++;
+            }
+            break;
+        case SDF_DATATYPE_LOGICAL:
+            cc = (char*)b->data;
+            for (i=0; i < b->ndims; i++) {
+                if (*cc)
+                    sub = Py_True;
+                else
+                    sub = Py_False;
+                PyDict_SetItemString(dict2, b->material_names[i], sub);
+                attr = get_unique_attr(block, b->material_names[i]);
+                PyDict_SetItemString(block->dict, attr, sub);
+                cc++;
+            }
+            break;
+        case SDF_DATATYPE_CHARACTER:
+            cp = (char**)b->data;
+            for (i=0; i < b->ndims; i++) {
+                sub = PyASCII_FromString(*cp);
+                PyDict_SetItemString(dict2, b->material_names[i], sub);
+                attr = get_unique_attr(block, b->material_names[i]);
+                PyDict_SetItemString(block->dict, attr, sub);
+                Py_DECREF(sub);
+                cp++;
+            }
+            break;
+    }
+
+    block->data = dict2;
+    PyDict_SetItemString(dict_id, b->id, (PyObject*)block);
+    PyDict_SetItemString(dict, b->name, (PyObject*)block);
+
+    Py_DECREF(block);
+
+    return;
+
+free_mem:
+    if (dict2) Py_DECREF(dict2);
+    if (block) Py_DECREF(block);
+    return;
+}
+
+
+static Block *dict_find_mesh_id(PyObject *dict, char *id)
+{
+    PyObject *value;
+    Block *block;
+
+    value = PyDict_GetItemString(dict, id);
+    if ( !value )
+        return NULL;
+
+    if ( !PyObject_TypeCheck(value, &BlockType) )
+        return NULL;
+
+    block = (Block*)value;
+
+    switch(block->b->blocktype) {
+        case SDF_BLOCKTYPE_PLAIN_MESH:
+        case SDF_BLOCKTYPE_POINT_MESH:
+        case SDF_BLOCKTYPE_LAGRANGIAN_MESH:
+            return block;
+    }
+
+    return NULL;
+}
+
+
+static PyObject *dict_find_id(PyObject *dict, char *id)
+{
+    PyObject *value;
+
+    value = PyDict_GetItemString(dict, id);
+    if ( !value )
+        return NULL;
+
+    if ( !PyObject_TypeCheck(value, &BlockType) )
+        return NULL;
+
+    return value;
+}
+
+
+static void dict_find_variable_ids(PyObject *dict, Block *station)
+{
+    PyObject *key, *value;
+    Block *block;
+    char *block_id;
+    Py_ssize_t pos = 0, len, i, *find, nfind, found;
+    sdf_block_t *b;
+
+    b = station->b;
+    if (!station->b)
+        return;
+
+    nfind = b->ndims;
+    find = malloc(nfind * sizeof(Py_ssize_t));
+    for (i=0; i < nfind; i++)
+        find[i] = i;
+
+    while (PyDict_Next(dict, &pos, &key, &value)) {
+        if (!PyObject_TypeCheck(value, &BlockType))
+            continue;
+        block = (Block*)value;
+        if (!block->b)
+            continue;
+        block_id = PyBytes_As_C(block->id);
+        if (!block_id)
+            continue;
+        len = strlen(block_id) + 1;
+
+        // Loop over remaining variable_ids and check for a match
+        found = -1;
+        for (i=0; i < nfind; i++) {
+            found = find[i];
+            if (memcmp(block_id, b->variable_ids[found], len) == 0)
+                break;
+            found = -1;
+        }
+
+        if (found < 0) continue;
+
+        if (!station->data) {
+            station->data = PyList_New(b->ndims);
+            if (!station->data) goto free_mem;
+        }
+
+        // Found one of our variable_ids. Insert it into the station list and
+        // remove it from the find list.
+        PyList_SET_ITEM(station->data, found, (PyObject*)block);
+        Py_INCREF(block);
+
+        nfind--;
+        // Stop searching if we've found them all
+        if (nfind <= 0) break;
+
+        for (i=found; i < nfind; i++)
+            find[i] = find[i+1];
+    }
+
+free_mem:
+    free(find);
+
+    return;
+}
+
+
+static int mangle_name(char *name)
+{
+    char *ptr;
+    int mangled = 0;
+
+    for (ptr = name; *ptr != '\0'; ptr++) {
+        if (*ptr >= '0' && *ptr <= '9')
+            continue;
+        if (*ptr >= 'A' && *ptr <= 'Z')
+            continue;
+        if (*ptr >= 'a' && *ptr <= 'z')
+            continue;
+        *ptr = '_';
+        mangled = 1;
+    }
+
+    return mangled;
+}
+
+
+/* Returns non-zero if setup_block() would create a Block for this block */
+static int block_has_object(sdf_block_t *b)
+{
+    switch(b->blocktype) {
+        case SDF_BLOCKTYPE_STITCHED:
+            return 1;
+        case SDF_BLOCKTYPE_PLAIN_MESH:
+        case SDF_BLOCKTYPE_POINT_MESH:
+        case SDF_BLOCKTYPE_LAGRANGIAN_MESH:
+        case SDF_BLOCKTYPE_PLAIN_VARIABLE:
+        case SDF_BLOCKTYPE_PLAIN_DERIVED:
+        case SDF_BLOCKTYPE_POINT_VARIABLE:
+        case SDF_BLOCKTYPE_POINT_DERIVED:
+        case SDF_BLOCKTYPE_ARRAY:
+        case SDF_BLOCKTYPE_CONSTANT:
+        case SDF_BLOCKTYPE_NAMEVALUE:
+        case SDF_BLOCKTYPE_STITCHED_MATERIAL:
+        case SDF_BLOCKTYPE_CONTIGUOUS_MATERIAL:
+            return b->datatype_out != 0;
+    }
+
+    return 0;
+}
+
+
+static void
+setup_block(SDFObject *sdf, PyObject *dict, sdf_block_t *b, PyObject *dict_id)
+{
+    switch(b->blocktype) {
+        case SDF_BLOCKTYPE_PLAIN_MESH:
+        case SDF_BLOCKTYPE_POINT_MESH:
+        case SDF_BLOCKTYPE_LAGRANGIAN_MESH:
+            setup_mesh(sdf, dict, b, dict_id);
+            break;
+        case SDF_BLOCKTYPE_PLAIN_VARIABLE:
+        case SDF_BLOCKTYPE_PLAIN_DERIVED:
+        case SDF_BLOCKTYPE_POINT_VARIABLE:
+        case SDF_BLOCKTYPE_POINT_DERIVED:
+        case SDF_BLOCKTYPE_ARRAY:
+            setup_array(sdf, dict, b, dict_id);
+            break;
+        case SDF_BLOCKTYPE_CONSTANT:
+            setup_constant(sdf, dict, b, dict_id);
+            break;
+        case SDF_BLOCKTYPE_NAMEVALUE:
+            setup_namevalue(sdf, dict, b, dict_id);
+            break;
+        case SDF_BLOCKTYPE_STITCHED_MATERIAL:
+        case SDF_BLOCKTYPE_CONTIGUOUS_MATERIAL:
+            setup_materials(sdf, dict, b, dict_id);
+            break;
+        case SDF_BLOCKTYPE_STITCHED:
+            setup_stitched(sdf, dict, b, dict_id);
+            break;
+    }
+}
+
+
+/* Connect a variable to its grid and grid_mid blocks */
+static void setup_links(Block *block, PyObject *dict_id, PyObject *dict)
+{
+    sdf_block_t *b = block->b;
+    char *mesh_id;
+    size_t len_id;
+
+    if (!b || !b->mesh_id) return;
+
+    if (b->blocktype == SDF_BLOCKTYPE_PLAIN_VARIABLE
+            || b->blocktype == SDF_BLOCKTYPE_PLAIN_DERIVED
+            || b->blocktype == SDF_BLOCKTYPE_STITCHED_MATERIAL
+            || b->blocktype == SDF_BLOCKTYPE_CONTIGUOUS_MATERIAL) {
+        block->grid = dict_find_mesh_id(dict_id, b->mesh_id);
+        len_id = strlen(b->mesh_id);
+        mesh_id = malloc(len_id + 5);
+        if (!mesh_id) return;
+        memcpy(mesh_id, b->mesh_id, len_id);
+        memcpy(mesh_id+len_id, "_mid", 5);
+        block->grid_mid = dict_find_mesh_id(dict_id, mesh_id);
+        free(mesh_id);
+        if (b->blocktype == SDF_BLOCKTYPE_STITCHED_MATERIAL
+                || b->blocktype == SDF_BLOCKTYPE_CONTIGUOUS_MATERIAL)
+            dict_find_variable_ids(dict, block);
+    } else if (b->blocktype == SDF_BLOCKTYPE_POINT_VARIABLE
+            || b->blocktype == SDF_BLOCKTYPE_POINT_DERIVED) {
+        block->grid = dict_find_mesh_id(dict_id, b->mesh_id);
+    }
+}
+
+
+/*
+ * Lazy BlockList construction
+ *
+ * Creating a Block object for every block in the file is expensive for files
+ * containing many thousands of blocks. Instead, the BlockList returned by
+ * sdf.read only records the attribute name and id of each block. The Block
+ * objects are created, and their grid links resolved, the first time that
+ * one of their names is looked up.
+ ******************************************************************************/
+
+static int BlockList_materialise(BlockList *blocklist, Py_ssize_t i);
+
+static int BlockList_materialise_id(BlockList *blocklist, char *id)
+{
+    PyObject *value;
+
+    if (!id) return 0;
+
+    value = PyDict_GetItemString(blocklist->ids, id);
+    if (!value) return 0;
+
+    return BlockList_materialise(blocklist, PyLong_AsSsize_t(value));
+}
+
+
+/* Returns zero on success or -1 with an exception set */
+static int BlockList_materialise(BlockList *blocklist, Py_ssize_t i)
+{
+    sdf_block_t *b = blocklist->blocks[i];
+    PyObject *dict = NULL, *key, *value, *entry;
+    Block *block;
+    Py_ssize_t pos = 0, n;
+    char *name;
+
+    if (blocklist->done[i]) return 0;
+    blocklist->done[i] = 1;
+
+    /* Blocks which refer to others by id need those to exist first */
+    switch(b->blocktype) {
+        case SDF_BLOCKTYPE_STITCHED:
+        case SDF_BLOCKTYPE_STITCHED_MATERIAL:
+        case SDF_BLOCKTYPE_CONTIGUOUS_MATERIAL:
+            if (b->variable_ids) {
+                for (n = 0; n < b->ndims; n++)
+                    if (BlockList_materialise_id(blocklist,
+                                                 b->variable_ids[n]))
+                        goto fail;
+            }
+            if (b->blocktype == SDF_BLOCKTYPE_STITCHED)
+                break;
+        case SDF_BLOCKTYPE_PLAIN_VARIABLE:
+        case SDF_BLOCKTYPE_PLAIN_DERIVED:
+        case SDF_BLOCKTYPE_POINT_VARIABLE:
+        case SDF_BLOCKTYPE_POINT_DERIVED:
+            if (BlockList_materialise_id(blocklist, b->mesh_id))
+                goto fail;
+            break;
+    }
+
+    dict = PyDict_New();
+    if (!dict) goto fail;
+
+    setup_block(blocklist->sdf, dict, b, blocklist->dict_id);
+    if (PyErr_Occurred()) goto fail;
+
+    while (PyDict_Next(dict, &pos, &key, &value)) {
+        block = (Block*)value;
+        setup_links(block, blocklist->dict_id, blocklist->dict_id);
+
+        name = strdup(PyBytes_As_C(key));
+        if (!name) {
+            PyErr_NoMemory();
+            goto fail;
+        }
+        mangle_name(name);
+
+        /* Only publish the block if no later block has claimed its name */
+        entry = PyDict_GetItemString(blocklist->names, name);
+        if (entry && PyLong_AsSsize_t(entry) == 2 * i + (block->parent != 0)
+                && PyDict_SetItemString(blocklist->dict, name, value)) {
+            free(name);
+            goto fail;
+        }
+
+        free(name);
+    }
+
+    Py_DECREF(dict);
+    return 0;
+
+fail:
+    /* Allow another attempt on the next lookup */
+    blocklist->done[i] = 0;
+    Py_XDECREF(dict);
+    return -1;
+}
+
+
+static void BlockList_add(BlockList *blocklist, sdf_block_t *b, Py_ssize_t i)
+{
+    PyObject *sub;
+    char *name;
+    size_t len;
+
+    blocklist->blocks[i] = b;
+    if (!block_has_object(b)) {
+        blocklist->done[i] = 1;
+        return;
+    }
+
+    len = strlen(b->name);
+    name = malloc(len + 5);
+    if (!name) return;
+    memcpy(name, b->name, len + 1);
+    mangle_name(name);
+
+    sub = PyLong_FromSsize_t(2 * i);
+    PyDict_SetItemString(blocklist->names, name, sub);
+    Py_DECREF(sub);
+
+    /* Meshes also provide a median mesh block */
+    if (b->blocktype == SDF_BLOCKTYPE_PLAIN_MESH
+            || b->blocktype == SDF_BLOCKTYPE_LAGRANGIAN_MESH) {
+        memcpy(name+len, "_mid", 5);
+        sub = PyLong_FromSsize_t(2 * i + 1);
+        PyDict_SetItemString(blocklist->names, name, sub);
+        Py_DECREF(sub);
+    }
+
+    free(name);
+
+    if (b->id) {
+        sub = PyLong_FromSsize_t(i);
+        PyDict_SetItemString(blocklist->ids, b->id, sub);
+        Py_DECREF(sub);
+    }
+}
+
+
+static PyObject *
+BlockList_getattro(PyObject *self, PyObject *name)
+{
+    BlockList *blocklist = (BlockList*)self;
+    PyObject *ob, *type, *value, *traceback;
+
+    ob = PyObject_GenericGetAttr(self, name);
+    if (ob || !blocklist->names
+            || !PyErr_ExceptionMatches(PyExc_AttributeError))
+        return ob;
+
+    PyErr_Fetch(&type, &value, &traceback);
+    ob = PyDict_GetItem(blocklist->names, name);
+    if (!ob) {
+        PyErr_Restore(type, value, traceback);
+        return NULL;
+    }
+
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(traceback);
+
+    if (BlockList_materialise(blocklist, PyLong_AsSsize_t(ob) / 2))
+        return NULL;
+
+    return PyObject_GenericGetAttr(self, name);
+}
+
+
+static PyObject *BlockList_getdict(BlockList *blocklist, void *closure)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < blocklist->nblocks; i++)
+        if (BlockList_materialise(blocklist, i))
+            return NULL;
+
+    Py_INCREF(blocklist->dict);
+    return blocklist->dict;
+}
+
+
+/* List block names without creating the blocks */
+static PyObject *BlockList_dir(BlockList *blocklist, PyObject *unused)
+{
+    PyObject *names, *ob;
+
+    ob = PyObject_Dir((PyObject*)Py_TYPE(blocklist));
+    if (!ob) return NULL;
+
+    names = PySet_New(ob);
+    Py_DECREF(ob);
+    if (!names) return NULL;
+
+    ob = PyObject_CallMethod(names, "update", "OO", blocklist->dict,
+                             blocklist->names);
+    if (!ob) {
+        Py_DECREF(names);
+        return NULL;
+    }
+    Py_DECREF(ob);
+
+    ob = PySequence_List(names);
+    Py_DECREF(names);
+    if (ob && PyList_Sort(ob) < 0) {
+        Py_DECREF(ob);
+        return NULL;
+    }
+
+    return ob;
+}
+
+
+static PyObject *BlockList_cache_info(BlockList *blocklist, PyObject *unused)
+{
+    SDFObject *sdf = blocklist->sdf;
+    Block *block;
+    Py_ssize_t n = 0;
+
+    for (block = sdf->cache_head; block; block = block->cache_next)
+        n++;
+
+    return Py_BuildValue("{s:n,s:n,s:n,s:L,s:L}", "hits", sdf->cache_hits,
+                         "misses", sdf->cache_misses, "blocks", n,
+                         "size", (long long)sdf->cache_size,
+                         "budget", (long long)sdf->cache_budget);
+}
+
+
+static PyObject *BlockList_set_cache(BlockList *blocklist, PyObject *args)
+{
+    long long budget;
+
+    if (!PyArg_ParseTuple(args, "L", &budget))
+        return NULL;
+
+    blocklist->sdf->cache_budget = budget;
+    cache_evict(blocklist->sdf);
+
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * Record the types that blocks are to be converted to, keyed by block id.
+ * Ids that are not in the file are ignored, so that one map can be used for
+ * many files.
+ */
+static int set_block_dtypes(SDFObject *sdf, PyObject *dtypes)
+{
+    PyArray_Descr *descr;
+    PyObject *key, *value, *ob;
+    Py_ssize_t pos = 0;
+    sdf_block_t *b;
+    const char *id;
+    int type;
+
+    sdf->dtypes = PyDict_New();
+    if (!sdf->dtypes) return -1;
+
+    while (PyDict_Next(dtypes, &pos, &key, &value)) {
+        id = PyBytes_As_C(key);
+        if (!id || !PyArray_DescrConverter(value, &descr))
+            return -1;
+        type = descr->type_num;
+        Py_DECREF(descr);
+
+        b = sdf_find_block_by_id(sdf->h, id);
+        if (!b || type == typemap[b->datatype_out])
+            continue;
+
+        if (!convert_supported(b, type)) {
+            PyErr_Format(PyExc_TypeError, "Block '%s' cannot be read as "
+                         "this dtype\n", id);
+            return -1;
+        }
+
+        ob = PyLong_FromLong(type);
+        if (!ob || PyDict_SetItemString(sdf->dtypes, id, ob) < 0) {
+            Py_XDECREF(ob);
+            return -1;
+        }
+        Py_DECREF(ob);
+    }
+
+    return 0;
+}
+
+
+static PyObject* SDF_read(PyObject *self, PyObject *args, PyObject *kw)
+{
+    SDFObject *sdf;
+    PyTypeObject *type = &SDFType;
+    sdf_file_t *h;
+    sdf_block_t *b;
+    PyObject *dict, *dict_id, *sub, *key, *value;
+    PyObject *items_list;
+    Block *block;
+    Py_ssize_t pos = 0;
+    int i, convert, use_mmap, use_dict, use_derived, mode;
+    comm_t comm;
+    const char *file;
+    static char *kwlist[] = {"file", "convert", "mmap", "dict", "derived",
+        "stations", "variables", "t0", "t1", "cache", "dtypes", NULL};
+    PyObject *stations = NULL, *variables = NULL, *dtypes = NULL;
+    double t0 = -DBL_MAX, t1 = DBL_MAX;
+    long long cache = 0;
+    BlockList *blocklist = NULL;
+
+    convert = 0; use_mmap = 0; use_dict = 0; use_derived = 1;
+    mode = SDF_READ; comm = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "s|iiiiO!O!ddLO!", kwlist,
+            &file, &convert, &use_mmap, &use_dict, &use_derived, &PyList_Type,
+            &stations, &PyList_Type, &variables, &t0, &t1, &cache,
+            &PyDict_Type, &dtypes))
+        return NULL;
+
+    sdf = (SDFObject*)type->tp_alloc(type, 0);
+    if (!sdf) {
+        PyErr_Format(PyExc_MemoryError, "Failed to allocate SDF object");
+        return NULL;
+    }
+
+    sdf->fd = -1;
+    sdf->cache_budget = cache;
+    sdf->lock = PyThread_allocate_lock();
+    if (!sdf->lock) {
+        Py_DECREF(sdf);
+        PyErr_Format(PyExc_MemoryError, "Failed to allocate SDF object");
+        return NULL;
+    }
+
+    h = sdf_open(file, comm, mode, use_mmap);
+    sdf->h = h;
+    if (!sdf->h) {
+        PyErr_Format(PyExc_IOError, "Failed to open file: '%s'", file);
+        Py_DECREF(sdf);
+        return NULL;
+    }
+
+    sdf_stack_init(h);
+
+    if (convert) h->use_float = 1;
+
+    if (use_derived)
+        sdf_read_blocklist_all(h);
+    else
+        sdf_read_blocklist(h);
+
+    if (dtypes && set_block_dtypes(sdf, dtypes) < 0) {
+        Py_DECREF(sdf);
+        return NULL;
+    }
+
+    dict = PyDict_New();
+    dict_id = PyDict_New();
+    sdf->blocklist = dict;
+
+    if (!use_dict) {
+        type = &BlockListType;
+        blocklist = (BlockList*)type->tp_alloc(type, 0);
+        if (!blocklist) {
+            Py_DECREF(dict_id);
+            PyErr_Format(PyExc_MemoryError, "Failed to allocate BlockList object");
+            return NULL;
+        }
+        blocklist->dict = dict;
+        blocklist->dict_id = dict_id;
+        blocklist->names = PyDict_New();
+        blocklist->ids = PyDict_New();
+        blocklist->sdf = sdf;
+        blocklist->nblocks = h->nblocks;
+        blocklist->blocks = calloc(h->nblocks + 1, sizeof(*blocklist->blocks));
+        blocklist->done = calloc(h->nblocks + 1, sizeof(*blocklist->done));
+        sdf->blocklist = (PyObject*)blocklist;
+        if (!blocklist->names || !blocklist->ids || !blocklist->blocks
+                || !blocklist->done) {
+            Py_DECREF(blocklist);
+            PyErr_Format(PyExc_MemoryError, "Failed to allocate BlockList object");
+            return NULL;
+        }
+    }
+
+    /* Add header */
+    sub = fill_header(h);
+    PyDict_SetItemString(dict, "Header", sub);
+    Py_DECREF(sub);
+
+    b = h->current_block = h->blocklist;
+    for (i = 0; i < h->nblocks; i++) {
+        switch(b->blocktype) {
+            case SDF_BLOCKTYPE_STATION:
+                sub = PyDict_GetItemString(dict, "StationBlocks");
+                if ( !sub ) {
+                    sub = PyDict_New();
+                    PyDict_SetItemString(dict, "StationBlocks", sub);
+                    Py_DECREF(sub);
+                }
+                append_station_metadata(b, sub);
+                extract_station_time_histories(h, stations, variables, t0, t1,
+                        dict);
+                break;
+            case SDF_BLOCKTYPE_RUN_INFO:
+                sub = fill_runinfo(b);
+                PyDict_SetItemString(dict, "Run_info", sub);
+                Py_DECREF(sub);
+                break;
+            case SDF_BLOCKTYPE_STITCHED:
+                break;
+            default:
+                if (use_dict)
+                    setup_block(sdf, dict, b, dict_id);
+                else
+                    BlockList_add(blocklist, b, i);
+        }
+        b = h->current_block = b->next;
+    }
+
+    /* Stitched blocks are added last so that they refer to existing blocks */
+    b = h->current_block = h->blocklist;
+    for (i = 0; i < h->nblocks; i++) {
+        switch(b->blocktype) {
+            case SDF_BLOCKTYPE_STITCHED:
+                if (use_dict)
+                    setup_block(sdf, dict, b, dict_id);
+                else
+                    BlockList_add(blocklist, b, i);
+                break;
+            default:
+                if (!use_dict)
+                    blocklist->blocks[i] = b;
+        }
+        b = h->current_block = b->next;
+    }
+
+    if (use_dict) {
+        while (PyDict_Next(dict, &pos, &key, &value)) {
+            if (!PyObject_TypeCheck(value, &BlockType))
+                continue;
+            block = (Block*)value;
+            setup_links(block, dict_id, dict);
+        }
+
+        Py_DECREF(dict_id);
+        Py_DECREF(sdf);
+        if (PyErr_Occurred()) {
+            Py_DECREF(dict);
+            return NULL;
+        }
+        return (PyObject*)dict;
+    }
+
+    if (PyErr_Occurred()) {
+        Py_DECREF(blocklist);
+        return NULL;
+    }
+
+    /* Mangle dictionary names. Block names were mangled by BlockList_add */
+    items_list = PyDict_Items(dict);
+    for (i = 0; i < PyList_GET_SIZE(items_list); i++) {
+        PyObject *item = PyList_GET_ITEM(items_list, i);
+        PyObject *key = PyTuple_GET_ITEM(item, 0);
+        PyObject *value = PyTuple_GET_ITEM(item, 1);
+        char *ckey;
+
+        ckey = strdup(PyBytes_As_C(key));
+
+        if (mangle_name(ckey)) {
+            PyDict_DelItem(dict, key);
+            PyDict_SetItemString(dict, ckey, value);
+        }
+
+        free(ckey);
+    }
+    Py_DECREF(items_list);
+
+    return (PyObject*)blocklist;
+}
+
+
+/*
+ * Worker pools
+ *
+ * run_pool calls fn(arg, k) for each k from 0 to n-1 on up to nthreads
+ * threads, with each thread taking the next index in turn. The calling
+ * thread is one of the workers, so all of the work still gets done if no
+ * other thread could be started. It is called without the GIL.
+ ******************************************************************************/
+
+struct pool_job {
+    void (*fn)(void *arg, int k);
+    void *arg;
+    int n, next;
+    pthread_mutex_t lock;
+};
+
+
+static void *pool_worker(void *ptr)
+{
+    struct pool_job *job = ptr;
+    int k;
+
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        k = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (k >= job->n)
+            break;
+
+        job->fn(job->arg, k);
+    }
+
+    return NULL;
+}
+
+
+static void run_pool(void (*fn)(void *arg, int k), void *arg, int n,
+                     int nthreads)
+{
+    struct pool_job job;
+    pthread_t *threads = NULL;
+    int i, nthr;
+
+    job.fn = fn;
+    job.arg = arg;
+    job.n = n;
+    job.next = 0;
+    pthread_mutex_init(&job.lock, NULL);
+
+    nthr = (nthreads < n ? nthreads : n) - 1;
+    if (nthr > 0)
+        threads = malloc(nthr * sizeof(*threads));
+
+    for (i = 0; threads && i < nthr; i++) {
+        if (pthread_create(&threads[i], NULL, pool_worker, &job))
+            break;
+    }
+
+    pool_worker(&job);
+
+    /* Only the threads that were started are joined */
+    while (i-- > 0)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+}
+
+
+/*
+ * Batched reads
+ *
+ * sdf.read_many fetches a set of blocks in the order in which they are
+ * stored. Blocks whose data needs no conversion are sorted by their offset
+ * in the file and neighbouring ones are merged into runs, bridging small
+ * gaps. The runs are read on a pool of threads, each run with one sequential
+ * preadv(). This scatters every block straight into a buffer of its own, so
+ * that its data can be released on its own by the cache, and the gaps into
+ * a scratch buffer. Any other blocks are read as usual afterwards.
+ ******************************************************************************/
+
+/* Largest gap between blocks in the same run */
+#define READ_MANY_GAP (1 << 20)
+/* Runs are not extended beyond this size */
+#define READ_MANY_RUN (64 << 20)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct read_many_item {
+    Block *block;
+    int64_t offset, length;
+    char *buffer;
+    void *grids[SDF_MAXDIMS];
+};
+
+struct read_many_run {
+    int64_t offset;
+    int first, count;
+};
+
+struct read_many_job {
+    sdf_file_t *h;
+    struct read_many_item *items;
+    struct read_many_run *runs;
+    int fd;
+};
+
+
+static int compare_read_many_items(const void *a, const void *b)
+{
+    const struct read_many_item *ia = a, *ib = b;
+
+    if (ia->offset < ib->offset) return -1;
+    if (ia->offset > ib->offset) return 1;
+    return 0;
+}
+
+
+/* Read a run of blocks, returning -1 if any part of it could not be read */
+static int read_many_preadv(struct read_many_job *job,
+                            struct read_many_run *run, struct iovec *iov)
+{
+    struct read_many_item *item;
+    char *scratch = NULL;
+    int64_t pos, gap, maxgap = 0, offset;
+    ssize_t count;
+    int n, niov = 0, err = 0;
+
+    /* One vector for each block and one for the gap before it */
+    pos = run->offset;
+    for (n = run->first; n < run->first + run->count; n++) {
+        item = &job->items[n];
+        if (!item->block) continue;
+
+        item->buffer = malloc(item->length);
+        if (!item->buffer) return -1;
+
+        gap = item->offset - pos;
+        if (gap > 0) {
+            iov[niov].iov_base = NULL;
+            iov[niov++].iov_len = gap;
+            if (gap > maxgap) maxgap = gap;
+        }
+        iov[niov].iov_base = item->buffer;
+        iov[niov++].iov_len = item->length;
+        pos = item->offset + item->length;
+    }
+
+    /* The gaps are not used, so they can all share the same memory */
+    if (maxgap) {
+        scratch = malloc(maxgap);
+        if (!scratch) return -1;
+        for (n = 0; n < niov; n++)
+            if (!iov[n].iov_base) iov[n].iov_base = scratch;
+    }
+
+    for (offset = run->offset; niov > 0; offset += count) {
+        count = preadv(job->fd, iov, niov < IOV_MAX ? niov : IOV_MAX, offset);
+        if (count <= 0) {
+            err = -1;
+            break;
+        }
+
+        /* Step over whatever has been read, which may end part way */
+        pos = count;
+        while (niov > 0 && pos >= (int64_t)iov->iov_len) {
+            pos -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0) {
+            iov->iov_base = (char*)iov->iov_base + pos;
+            iov->iov_len -= pos;
+        }
+    }
+
+    free(scratch);
+    return err;
+}
+
+
+static void read_many_run(void *arg, int k)
+{
+    struct read_many_job *job = arg;
+    struct read_many_run *run = &job->runs[k];
+    struct read_many_item *item;
+    struct iovec *iov;
+    int n, err;
+
+    iov = malloc(2 * run->count * sizeof(*iov));
+    err = iov ? read_many_preadv(job, run, iov) : -1;
+    free(iov);
+
+    for (n = run->first; n < run->first + run->count; n++) {
+        item = &job->items[n];
+        if (!item->block || !item->buffer) continue;
+
+        /* Blocks that failed are read again one at a time afterwards */
+        if (err) {
+            free(item->buffer);
+            item->buffer = NULL;
+            continue;
+        }
+
+        raw_block_layout(job->h, item->block->b, item->buffer, item->grids);
+    }
+}
+
+
+/*
+ * Wrap block data in read-only arrays whose memory belongs to array. Meshes
+ * are returned as a tuple with one array for each axis.
+ */
+static PyObject *wrap_block_data(Block *block, void **grids,
+                                 ArrayObject *array)
+{
+    sdf_block_t *b = block->b;
+    PyObject *ob, *sub;
+    PyArray_Descr *descr;
+    npy_intp dims[1];
+    int n;
+
+    if (b->blocktype != SDF_BLOCKTYPE_PLAIN_MESH
+            && b->blocktype != SDF_BLOCKTYPE_POINT_MESH
+            && b->blocktype != SDF_BLOCKTYPE_LAGRANGIAN_MESH) {
+        ob = PyArray_NewFromDescr(&PyArray_Type,
+            PyArray_DescrFromType(typemap[b->datatype_out]), b->ndims,
+            block->adims, NULL, grids[0], NPY_ARRAY_F_CONTIGUOUS, NULL);
+        if (!ob) return NULL;
+
+        Py_INCREF(array);
+        PyArray_SetBaseObject((PyArrayObject*)ob, (PyObject*)array);
+        return ob;
+    }
+
+    ob = PyTuple_New(b->ndims);
+    for (n = 0; ob && n < b->ndims; n++) {
+        descr = PyArray_DescrFromType(typemap[b->datatype_out]);
+        if (b->blocktype == SDF_BLOCKTYPE_LAGRANGIAN_MESH) {
+            sub = PyArray_NewFromDescr(&PyArray_Type, descr, b->ndims,
+                block->adims, NULL, grids[n], NPY_ARRAY_F_CONTIGUOUS, NULL);
+        } else {
+            dims[0] = block->adims[n];
+            sub = PyArray_NewFromDescr(&PyArray_Type, descr, 1, dims, NULL,
+                grids[n], NPY_ARRAY_F_CONTIGUOUS, NULL);
+        }
+        if (!sub) {
+            Py_CLEAR(ob);
+            break;
+        }
+
+        Py_INCREF(array);
+        PyArray_SetBaseObject((PyArrayObject*)sub, (PyObject*)array);
+        PyTuple_SET_ITEM(ob, n, sub);
+    }
+
+    return ob;
+}
+
+
+/* Find a block by id or, failing that, by attribute name */
+static Block *BlockList_find(BlockList *blocklist, PyObject *key)
+{
+    PyObject *ob;
+    char *id;
+    size_t len;
+
+    id = PyBytes_As_C(key);
+    if (!id || !(id = strdup(id))) {
+        PyErr_Clear();
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+
+    /* Median meshes are created along with their parent */
+    len = strlen(id);
+    if (BlockList_materialise_id(blocklist, id)) {
+        free(id);
+        return NULL;
+    }
+    if (len > 4 && !strcmp(id + len - 4, "_mid")) {
+        id[len-4] = '\0';
+        if (BlockList_materialise_id(blocklist, id)) {
+            free(id);
+            return NULL;
+        }
+        id[len-4] = '_';
+    }
+
+    ob = PyDict_GetItemString(blocklist->dict_id, id);
+    free(id);
+    if (ob && PyObject_TypeCheck(ob, &BlockType)) {
+        Py_INCREF(ob);
+        return (Block*)ob;
+    }
+
+    ob = PyObject_GetAttr((PyObject*)blocklist, key);
+    if (ob && PyObject_TypeCheck(ob, &BlockType))
+        return (Block*)ob;
+
+    Py_XDECREF(ob);
+    PyErr_Clear();
+    PyErr_SetObject(PyExc_KeyError, key);
+    return NULL;
+}
+
+
+static PyObject* SDF_read_many(PyObject *self, PyObject *args, PyObject *kw)
+{
+    static char *kwlist[] = {"file", "ids", "threads", NULL};
+    PyObject *source, *ids, *seq = NULL, *blocks = NULL, *result = NULL;
+    PyObject *key, *ob;
+    BlockList *blocklist = NULL;
+    SDFObject *sdf;
+    Block *block;
+    ArrayObject *array;
+    struct read_many_job job;
+    struct read_many_item *items = NULL, *item;
+    struct read_many_run *runs = NULL, *run;
+    Py_ssize_t i, nids;
+    int64_t len, end;
+    int n, nitems = 0, nruns = 0, nthreads = 1;
+    void *grids[SDF_MAXDIMS];
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "OO|i", kwlist, &source, &ids,
+            &nthreads))
+        return NULL;
+
+    if (nthreads < 1) nthreads = 1;
+
+    if (PyObject_TypeCheck(source, &BlockListType)) {
+        blocklist = (BlockList*)source;
+        Py_INCREF(blocklist);
+    } else if (PyUnicode_Check(source) || PyBytes_Check(source)) {
+        ob = PyTuple_Pack(1, source);
+        if (!ob) return NULL;
+        blocklist = (BlockList*)SDF_read(self, ob, NULL);
+        Py_DECREF(ob);
+        if (!blocklist) return NULL;
+    } else {
+        PyErr_Format(PyExc_TypeError,
+                     "file must be a file name or a list of blocks\n");
+        return NULL;
+    }
+
+    sdf = blocklist->sdf;
+
+    seq = PySequence_Fast(ids, "ids must be a sequence of block ids");
+    if (!seq) goto free_mem;
+    nids = PySequence_Fast_GET_SIZE(seq);
+
+    blocks = PyList_New(nids);
+    items = calloc(nids + 1, sizeof(*items));
+    runs = calloc(nids + 1, sizeof(*runs));
+    if (!blocks || !items || !runs) {
+        PyErr_NoMemory();
+        goto free_mem;
+    }
+
+    for (i = 0; i < nids; i++) {
+        block = BlockList_find(blocklist, PySequence_Fast_GET_ITEM(seq, i));
+        if (!block) goto free_mem;
+        PyList_SET_ITEM(blocks, i, (PyObject*)block);
+
+        /* Only raw data that is not already in memory is batched */
+        if (block->data || block->parent || block->convert_type
+                || sdf->h->mmap)
+            continue;
+        len = raw_block_layout(sdf->h, block->b, NULL, grids);
+        if (!len) continue;
+
+        item = &items[nitems++];
+        item->block = block;
+        item->offset = block->b->data_location;
+        item->length = len;
+    }
+
+    if (nitems && sdf_fd(sdf) >= 0) {
+        qsort(items, nitems, sizeof(*items), compare_read_many_items);
+
+        /* Merge neighbouring blocks into runs */
+        end = 0;
+        for (n = 0; n < nitems; n++) {
+            item = &items[n];
+
+            /* Blocks that were asked for more than once */
+            if (n && item->offset < end) {
+                item->block = NULL;
+                continue;
+            }
+
+            run = nruns ? &runs[nruns-1] : NULL;
+            if (!run || item->offset - end > READ_MANY_GAP
+                    || item->offset + item->length - run->offset
+                        > READ_MANY_RUN) {
+                run = &runs[nruns++];
+                run->offset = item->offset;
+                run->first = n;
+            }
+            run->count = n - run->first + 1;
+            end = item->offset + item->length;
+        }
+
+        job.h = sdf->h;
+        job.items = items;
+        job.runs = runs;
+        job.fd = sdf->fd;
+
+        Py_BEGIN_ALLOW_THREADS
+        run_pool(read_many_run, &job, nruns, nthreads);
+        Py_END_ALLOW_THREADS
+    }
+
+    /* Each block gets an array which owns its buffer */
+    for (n = 0; n < nitems; n++) {
+        item = &items[n];
+        block = item->block;
+        if (!block || !item->buffer || block->data) continue;
+
+        array = (ArrayObject*)Array_new(&ArrayType, sdf, NULL);
+        if (array) array->mem = malloc(sizeof(*array->mem));
+        if (!array || !array->mem) {
+            Py_XDECREF(array);
+            PyErr_NoMemory();
+            goto free_mem;
+        }
+        array->mem[0] = item->buffer;
+        array->memlen = 1;
+        item->buffer = NULL;
+
+        ob = wrap_block_data(block, item->grids, array);
+        Py_DECREF(array);
+        if (!ob) goto free_mem;
+        if (block->data)
+            Py_DECREF(ob);
+        else {
+            block->data = ob;
+            sdf->cache_misses++;
+            cache_touch(block);
+        }
+    }
+
+    /* Anything else, or anything that failed, is read one block at a time */
+    result = PyDict_New();
+    if (!result) goto free_mem;
+
+    for (i = 0; i < nids; i++) {
+        key = PySequence_Fast_GET_ITEM(seq, i);
+        ob = Block_getdata((Block*)PyList_GET_ITEM(blocks, i), NULL);
+        if (!ob || PyDict_SetItem(result, key, ob) < 0) {
+            Py_XDECREF(ob);
+            Py_CLEAR(result);
+            goto free_mem;
+        }
+        Py_DECREF(ob);
+    }
+
+    /* The blocks read together are only safe from eviction once returned */
+    cache_evict(sdf);
+
+free_mem:
+    for (n = 0; items && n < nitems; n++)
+        free(items[n].buffer);
+    free(runs);
+    free(items);
+    Py_XDECREF(blocks);
+    Py_XDECREF(seq);
+    Py_DECREF(blocklist);
+
+    return result;
+}
+
+
+/*
+ * Time series
+ *
+ * sdf.read_series reads the same blocks from each of a list of files into
+ * arrays with one row per file. Only the header and blocklist of each file
+ * are read, no Python objects are created for the blocks, and each file is
+ * handled by one of a pool of threads which writes straight into its row of
+ * the preallocated output.
+ ******************************************************************************/
+
+struct series_id {
+    char *id;
+    int blocktype, datatype, ndims;
+    int64_t dims[SDF_MAXDIMS];
+    /* Whole blocks can be read without the library */
+    int full;
+    section_t s;
+    char *out;
+    int64_t row;
+};
+
+struct series_job {
+    char **files;
+    struct series_id *ids;
+    int nfiles, nids;
+    double *times;
+    int *steps, *errors, *error_ids;
+};
+
+enum { SERIES_OK, SERIES_OPEN, SERIES_MISSING, SERIES_READ };
+
+
+/* Copy a section out of a whole Fortran-ordered array */
+static void gather_section(char *out, const char *src, int size, int ndims,
+                           const int64_t *dims, const section_t *s)
+{
+    int64_t n, total = 1, offset, stride, idx[SDF_MAXDIMS] = { 0 };
+    int i;
+
+    for (i = 0; i < ndims; i++)
+        total *= s->lens[i];
+
+    for (n = 0; n < total; n++) {
+        offset = 0;
+        stride = size;
+        for (i = 0; i < ndims; i++) {
+            offset += (s->starts[i] + idx[i] * s->strides[i]) * stride;
+            stride *= dims[i];
+        }
+        memcpy(out + n * size, src + offset, size);
+
+        for (i = 0; i < ndims && ++idx[i] == s->lens[i]; i++)
+            idx[i] = 0;
+    }
+}
+
+
+static int read_series_block(sdf_file_t *h, sdf_block_t *b, int *fd,
+                             struct series_id *item, char *out)
+{
+    void *grids[SDF_MAXDIMS];
+    int64_t offset, count, size;
+    int i;
 
-    if (!block)
-        return attr;
+    if (b->blocktype == SDF_BLOCKTYPE_CONSTANT) {
+        memcpy(out, b->const_value, item->row);
+        return SERIES_OK;
+    }
 
-    if (PyObject_HasAttrString((PyObject*)block, attr_in)) {
-        len = strlen(attr_in);
-        attr = calloc(len + 2, sizeof(char));
-        memcpy(attr, attr_in, len);
-        attr[len] = '_';
+    if (item->full && raw_block_layout(h, b, NULL, grids) == item->row) {
+        if (*fd < 0)
+            *fd = open(h->filename, O_RDONLY);
+        for (offset = 0; *fd >= 0 && offset < item->row; offset += count) {
+            count = pread(*fd, out + offset, item->row - offset,
+                          b->data_location + offset);
+            if (count <= 0) break;
+        }
+        if (*fd >= 0 && offset == item->row)
+            return SERIES_OK;
     }
 
-    return attr;
+    if (!item->full)
+        sdf_block_set_array_section(b, item->ndims, item->s.starts,
+                                    item->s.ends, item->s.strides);
+
+    h->current_block = b;
+    sdf_helper_read_data(h, b);
+
+    if (!b->done_data || !b->data)
+        return SERIES_READ;
+
+    size = SDF_TYPE_SIZES[b->datatype_out];
+    for (i = 0; i < item->ndims; i++) {
+        if (b->local_dims[i] != item->s.lens[i]) break;
+        size *= b->local_dims[i];
+    }
+
+    /* The library may have ignored the section and read the whole block */
+    if (i == item->ndims && size == item->row)
+        memcpy(out, b->data, item->row);
+    else if (!item->full && i < item->ndims
+            && memcmp(b->local_dims, b->dims, item->ndims * sizeof(*b->dims))
+                == 0)
+        gather_section(out, b->data, SDF_TYPE_SIZES[b->datatype_out],
+                       item->ndims, b->dims, &item->s);
+    else
+        return SERIES_READ;
+
+    sdf_free_block_data(h, b);
+
+    return SERIES_OK;
 }
 
 
-static void
-setup_namevalue(SDFObject *sdf, PyObject *dict, sdf_block_t *b,
-                PyObject *dict_id)
+static int read_series_file(struct series_job *job, int k)
 {
-    Block *block = NULL;
-    PyObject *sub, *dict2 = NULL;
-    float *ff;
-    double *dd;
-    int32_t *il;
-    int64_t *ll;
-    char *cc, **cp, *attr;
-    Py_ssize_t i;
+    struct series_id *item;
+    sdf_file_t *h;
+    sdf_block_t *b;
+    int i, n, fd = -1, err = SERIES_OK;
 
-    block = (Block*)Block_alloc(sdf, b);
-    if (!block) return;
+    h = sdf_open(job->files[k], 0, SDF_READ, 0);
+    if (!h) return SERIES_OPEN;
 
-    block->dict = PyDict_New();
-    if (!block->dict) goto free_mem;
+    sdf_stack_init(h);
+    sdf_read_blocklist(h);
 
-    dict2 = PyDict_New();
-    if (!dict2) goto free_mem;
+    job->times[k] = h->time;
+    job->steps[k] = h->step;
 
-    switch(b->datatype) {
-        case SDF_DATATYPE_REAL4:
-            ff = (float*)b->data;
-            for (i=0; i < b->ndims; i++) {
-                sub = PyFloat_FromDouble(*ff);
-                PyDict_SetItemString(dict2, b->material_names[i], sub);
-                attr = get_unique_attr(block, b->material_names[i]);
-                PyDict_SetItemString(block->dict, attr, sub);
-                Py_DECREF(sub);
-                ff++;
-            }
-            break;
-        case SDF_DATATYPE_REAL8:
-            dd = (double*)b->data;
-            for (i=0; i < b->ndims; i++) {
-                sub = PyFloat_FromDouble(*dd);
-                PyDict_SetItemString(dict2, b->material_names[i], sub);
-                attr = get_unique_attr(block, b->material_names[i]);
-                PyDict_SetItemString(block->dict, attr, sub);
-                Py_DECREF(sub);
-                dd++;
-            }
+    for (n = 0; n < job->nids; n++) {
+        item = &job->ids[n];
+        b = sdf_find_block_by_id(h, item->id);
+
+        /* Every file must hold the same kind of block */
+        err = SERIES_MISSING;
+        if (!b || b->blocktype != item->blocktype
+                || b->datatype_out != item->datatype)
             break;
-        case SDF_DATATYPE_INTEGER4:
-            il = (int32_t*)b->data;
-            for (i=0; i < b->ndims; i++) {
-                sub = PyLong_FromLong(*il);
-                PyDict_SetItemString(dict2, b->material_names[i], sub);
-                attr = get_unique_attr(block, b->material_names[i]);
-                PyDict_SetItemString(block->dict, attr, sub);
-                Py_DECREF(sub);
-                il++;
-            }
+        if (item->ndims && b->ndims != item->ndims)
             break;
-        case SDF_DATATYPE_INTEGER8:
-            ll = (int64_t*)b->data;
-            for (i=0; i < b->ndims; i++) {
-                sub = PyLong_FromLongLong(*ll);
-                PyDict_SetItemString(dict2, b->material_names[i], sub);
-                attr = get_unique_attr(block, b->material_names[i]);
-                PyDict_SetItemString(block->dict, attr, sub);
-                Py_DECREF(sub);
-                ll++;
-            }
+        for (i = 0; i < item->ndims; i++)
+            if (b->dims[i] != item->dims[i]) break;
+        if (i < item->ndims)
             break;
-        case SDF_DATATYPE_LOGICAL:
-            cc = (char*)b->data;
-            for (i=0; i < b->ndims; i++) {
-                if (*cc)
-                    sub = Py_True;
-                else
-                    sub = Py_False;
-                PyDict_SetItemString(dict2, b->material_names[i], sub);
-                attr = get_unique_attr(block, b->material_names[i]);
-                PyDict_SetItemString(block->dict, attr, sub);
-                cc++;
-            }
+
+        err = read_series_block(h, b, &fd, item, item->out + k * item->row);
+        if (err != SERIES_OK)
             break;
-        case SDF_DATATYPE_CHARACTER:
-            cp = (char**)b->data;
-            for (i=0; i < b->ndims; i++) {
-                sub = PyASCII_FromString(*cp);
-                PyDict_SetItemString(dict2, b->material_names[i], sub);
-                attr = get_unique_attr(block, b->material_names[i]);
-                PyDict_SetItemString(block->dict, attr, sub);
-                Py_DECREF(sub);
-                cp++;
-            }
+    }
+
+    if (err != SERIES_OK)
+        job->error_ids[k] = n;
+
+    if (fd >= 0) close(fd);
+    sdf_stack_destroy(h);
+    sdf_close(h);
+
+    return err;
+}
+
+
+static void read_series_one(void *arg, int k)
+{
+    struct series_job *job = arg;
+
+    job->errors[k] = read_series_file(job, k);
+}
+
+
+/* Describe a block from the first file and create its output array */
+static PyObject *setup_series_id(sdf_file_t *h, PyObject *key,
+                                 PyObject *section, int nfiles,
+                                 struct series_id *item)
+{
+    sdf_block_t *b;
+    PyObject *ob, *index, *sub, *post[SDF_MAXDIMS+1];
+    npy_intp dims[SDF_MAXDIMS+1], strides[SDF_MAXDIMS+1], bdims[SDF_MAXDIMS];
+    int i, size;
+
+    item->id = PyBytes_As_C(key);
+    if (!item->id) return NULL;
+
+    b = sdf_find_block_by_id(h, item->id);
+    if (!b) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+
+    switch (b->blocktype) {
+    case SDF_BLOCKTYPE_PLAIN_VARIABLE:
+    case SDF_BLOCKTYPE_POINT_VARIABLE:
+    case SDF_BLOCKTYPE_ARRAY:
+        item->ndims = b->ndims;
+        break;
+    case SDF_BLOCKTYPE_CONSTANT:
+        item->ndims = 0;
+        break;
+    default:
+        PyErr_Format(PyExc_TypeError, "Block '%s' is not a variable, array "
+                     "or constant\n", item->id);
+        return NULL;
+    }
+
+    item->blocktype = b->blocktype;
+    item->datatype = b->datatype_out;
+    for (i = 0; i < item->ndims; i++)
+        bdims[i] = item->dims[i] = b->dims[i];
+
+    /* Constants have no dimensions to take a section of */
+    if (section && section != Py_None && item->ndims) {
+        if (parse_section_dims(section, item->ndims, bdims, &item->s) < 0)
+            return NULL;
+    } else {
+        item->s.ndims = item->ndims;
+        item->s.trivial_post = 1;
+        for (i = 0; i < item->ndims; i++) {
+            item->s.lens[i] = item->s.ends[i] = bdims[i];
+            item->s.strides[i] = 1;
+        }
+    }
+
+    item->full = 1;
+    for (i = 0; i < item->ndims; i++) {
+        if (item->s.starts[i] != 0 || item->s.strides[i] != 1
+                || item->s.lens[i] != bdims[i])
+            item->full = 0;
+    }
+
+    /* Each row is stored in the same order as the data in the file */
+    size = SDF_TYPE_SIZES[item->datatype];
+    dims[0] = nfiles;
+    for (i = 0; i < item->ndims; i++) {
+        dims[i+1] = item->s.lens[i];
+        strides[i+1] = size;
+        size *= dims[i+1];
+    }
+    strides[0] = item->row = size;
+
+    ob = PyArray_NewFromDescr(&PyArray_Type,
+        PyArray_DescrFromType(typemap[item->datatype]), item->ndims + 1,
+        dims, strides, NULL, NPY_ARRAY_WRITEABLE, NULL);
+    if (!ob) return NULL;
+    item->out = PyArray_DATA((PyArrayObject*)ob);
+
+    if (item->s.trivial_post)
+        return ob;
+
+    /* Flips and integer indices are applied to each row as a view */
+    post[0] = PySlice_New(NULL, NULL, NULL);
+    for (i = 0; i < item->ndims; i++)
+        post[i+1] = item->s.post[i];
+    index = post[0] ? section_tuple(post, item->ndims + 1) : NULL;
+    Py_XDECREF(post[0]);
+    if (!index) {
+        Py_DECREF(ob);
+        return NULL;
+    }
+
+    sub = PyObject_GetItem(ob, index);
+    Py_DECREF(index);
+    Py_DECREF(ob);
+
+    return sub;
+}
+
+
+static PyObject* SDF_read_series(PyObject *self, PyObject *args, PyObject *kw)
+{
+    static char *kwlist[] = {"files", "ids", "section", "threads", NULL};
+    PyObject *files, *ids, *section = NULL, *fseq = NULL, *iseq = NULL;
+    PyObject *data = NULL, *times = NULL, *steps = NULL, *result = NULL;
+    PyObject *ob;
+    struct series_job job;
+    struct series_id *items = NULL;
+    sdf_file_t *h;
+    npy_intp dims[1];
+    Py_ssize_t i, nfiles, nids;
+    int nthreads = 1, single;
+
+    memset(&job, 0, sizeof(job));
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "OO|Oi", kwlist, &files, &ids,
+            &section, &nthreads))
+        return NULL;
+
+    if (nthreads < 1) nthreads = 1;
+
+    fseq = PySequence_Fast(files, "files must be a sequence of file names");
+    if (!fseq) return NULL;
+    nfiles = PySequence_Fast_GET_SIZE(fseq);
+
+    /* A single id gives a single array rather than a dictionary */
+    single = (PyUnicode_Check(ids) || PyBytes_Check(ids));
+    if (single)
+        iseq = PyTuple_Pack(1, ids);
+    else
+        iseq = PySequence_Fast(ids, "ids must be a sequence of block ids");
+    if (!iseq) goto free_mem;
+    nids = PySequence_Fast_GET_SIZE(iseq);
+
+    if (!nfiles) {
+        PyErr_Format(PyExc_ValueError, "No files given\n");
+        goto free_mem;
+    }
+
+    job.nfiles = nfiles;
+    job.nids = nids;
+    job.files = calloc(nfiles, sizeof(*job.files));
+    job.errors = calloc(nfiles, sizeof(*job.errors));
+    job.error_ids = calloc(nfiles, sizeof(*job.error_ids));
+    items = job.ids = calloc(nids + 1, sizeof(*job.ids));
+    if (!job.files || !job.errors || !job.error_ids || !items) {
+        PyErr_NoMemory();
+        goto free_mem;
+    }
+
+    for (i = 0; i < nfiles; i++) {
+        job.files[i] = PyBytes_As_C(PySequence_Fast_GET_ITEM(fseq, i));
+        if (!job.files[i]) goto free_mem;
+    }
+
+    dims[0] = nfiles;
+    times = PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+    steps = PyArray_SimpleNew(1, dims, NPY_INT);
+    data = PyDict_New();
+    if (!times || !steps || !data) goto free_mem;
+    job.times = PyArray_DATA((PyArrayObject*)times);
+    job.steps = PyArray_DATA((PyArrayObject*)steps);
+
+    /* The first file decides the shape and type of each block */
+    h = sdf_open(job.files[0], 0, SDF_READ, 0);
+    if (!h) {
+        PyErr_Format(PyExc_IOError, "Failed to open file: '%s'",
+                     job.files[0]);
+        goto free_mem;
+    }
+    sdf_stack_init(h);
+    sdf_read_blocklist(h);
+
+    for (i = 0; i < nids; i++) {
+        ob = setup_series_id(h, PySequence_Fast_GET_ITEM(iseq, i), section,
+                             nfiles, &items[i]);
+        if (!ob || PyDict_SetItem(data, PySequence_Fast_GET_ITEM(iseq, i),
+                                  ob) < 0) {
+            Py_XDECREF(ob);
             break;
+        }
+        Py_DECREF(ob);
     }
 
-    block->data = dict2;
-    PyDict_SetItemString(dict_id, b->id, (PyObject*)block);
-    PyDict_SetItemString(dict, b->name, (PyObject*)block);
+    sdf_stack_destroy(h);
+    sdf_close(h);
+    if (i < nids) goto free_mem;
+
+    Py_BEGIN_ALLOW_THREADS
+    run_pool(read_series_one, &job, nfiles, nthreads);
+    Py_END_ALLOW_THREADS
+
+    for (i = 0; i < nfiles; i++) {
+        switch (job.errors[i]) {
+        case SERIES_OPEN:
+            PyErr_Format(PyExc_IOError, "Failed to open file: '%s'",
+                         job.files[i]);
+            goto free_mem;
+        case SERIES_MISSING:
+            PyErr_Format(PyExc_Exception, "Block '%s' is missing or differs "
+                         "in file '%s'\n", items[job.error_ids[i]].id,
+                         job.files[i]);
+            goto free_mem;
+        case SERIES_READ:
+            PyErr_Format(PyExc_Exception, "Unable to read block '%s' from "
+                         "file '%s'\n", items[job.error_ids[i]].id,
+                         job.files[i]);
+            goto free_mem;
+        }
+    }
+
+    if (single) {
+        ob = PyDict_GetItem(data, PySequence_Fast_GET_ITEM(iseq, 0));
+        result = Py_BuildValue("OOO", ob, times, steps);
+    } else
+        result = Py_BuildValue("OOO", data, times, steps);
+
+free_mem:
+    for (i = 0; items && i < nids; i++)
+        free_section(&items[i].s);
+    free(items);
+    free(job.files);
+    free(job.errors);
+    free(job.error_ids);
+    Py_XDECREF(data);
+    Py_XDECREF(times);
+    Py_XDECREF(steps);
+    Py_XDECREF(iseq);
+    Py_XDECREF(fseq);
+
+    return result;
+}
+
+
+/*
+ * Header scan
+ *
+ * sdf.scan reads only the fixed-size header of each file, which is enough to
+ * identify the run and position of a dump without touching its block list.
+ ******************************************************************************/
+
+struct scan_header {
+    int ok, step, jobid1, jobid2, nblocks;
+    double time;
+};
+
+struct scan_job {
+    char **files;
+    struct scan_header *headers;
+    int nfiles;
+};
+
+
+static void scan_file(const char *file, struct scan_header *header)
+{
+    sdf_file_t *h;
+
+    /* Opening a file reads its header and nothing else */
+    h = sdf_open(file, 0, SDF_READ, 0);
+    if (!h) return;
+
+    header->ok = 1;
+    header->step = h->step;
+    header->time = h->time;
+    header->jobid1 = h->jobid1;
+    header->jobid2 = h->jobid2;
+    header->nblocks = h->nblocks;
+
+    sdf_close(h);
+}
+
+
+static void scan_one(void *arg, int k)
+{
+    struct scan_job *job = arg;
+
+    scan_file(job->files[k], &job->headers[k]);
+}
+
+
+static PyObject *scan_dict(const char *file, struct scan_header *header)
+{
+    return Py_BuildValue("{s:s,s:i,s:d,s:i,s:i,s:i}", "filename", file,
+                         "step", header->step, "time", header->time,
+                         "jobid1", header->jobid1, "jobid2", header->jobid2,
+                         "nblocks", header->nblocks);
+}
+
+
+static PyObject* SDF_scan(PyObject *self, PyObject *args, PyObject *kw)
+{
+    static char *kwlist[] = {"file", "threads", NULL};
+    PyObject *files, *fseq = NULL, *result = NULL, *ob;
+    struct scan_header header;
+    struct scan_job job;
+    Py_ssize_t i;
+    char *file;
+    int nthreads = 1;
+
+    memset(&job, 0, sizeof(job));
+    memset(&header, 0, sizeof(header));
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|i", kwlist, &files,
+            &nthreads))
+        return NULL;
+
+    if (nthreads < 1) nthreads = 1;
+
+    if (PyUnicode_Check(files) || PyBytes_Check(files)) {
+        file = PyBytes_As_C(files);
+        if (!file) return NULL;
+
+        Py_BEGIN_ALLOW_THREADS
+        scan_file(file, &header);
+        Py_END_ALLOW_THREADS
+
+        if (!header.ok) {
+            PyErr_Format(PyExc_IOError, "Failed to open file: '%s'", file);
+            return NULL;
+        }
+        return scan_dict(file, &header);
+    }
+
+    /* A list of files gives a list of headers, with None for failures */
+    fseq = PySequence_Fast(files, "file must be a file name or a sequence "
+                           "of file names");
+    if (!fseq) return NULL;
+
+    job.nfiles = PySequence_Fast_GET_SIZE(fseq);
+    job.files = calloc(job.nfiles + 1, sizeof(*job.files));
+    job.headers = calloc(job.nfiles + 1, sizeof(*job.headers));
+    if (!job.files || !job.headers) {
+        PyErr_NoMemory();
+        goto free_mem;
+    }
+
+    for (i = 0; i < job.nfiles; i++) {
+        job.files[i] = PyBytes_As_C(PySequence_Fast_GET_ITEM(fseq, i));
+        if (!job.files[i]) goto free_mem;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    run_pool(scan_one, &job, job.nfiles, nthreads);
+    Py_END_ALLOW_THREADS
+
+    result = PyList_New(job.nfiles);
+    for (i = 0; result && i < job.nfiles; i++) {
+        if (job.headers[i].ok)
+            ob = scan_dict(job.files[i], &job.headers[i]);
+        else {
+            ob = Py_None;
+            Py_INCREF(ob);
+        }
+        if (!ob) Py_CLEAR(result);
+        else PyList_SET_ITEM(result, i, ob);
+    }
+
+free_mem:
+    free(job.files);
+    free(job.headers);
+    Py_XDECREF(fseq);
+
+    return result;
+}
+
+
+/*
+ * Directory index
+ *
+ * sdf.index keeps a binary file, SDF_INDEX_NAME, in each directory it is
+ * asked about. This holds the header of every SDF file in the directory,
+ * keyed by file name, size and modification time in nanoseconds, so that
+ * only new or changed files need to be opened. Block tables are only read,
+ * and then kept, once they are asked for. The index is stored in native byte
+ * order; an index written on another machine is just rebuilt.
+ *
+ *   char[8]  SDF_INDEX_MAGIC
+ *   int32    SDF_INDEX_VERSION, number of files
+ *   for each file:
+ *     int32    length of name, followed by the name
+ *     int64    size, mtime
+ *     int32    ok, listed, step, jobid1, jobid2, nblocks
+ *     double   time
+ *     for each block, if listed:
+ *       int32    length of id, followed by the id
+ *       int32    blocktype, datatype, ndims
+ *       int64    dims[SDF_MAXDIMS], data_location, data_length
+ ******************************************************************************/
+
+#define SDF_INDEX_NAME ".sdf_index"
+#define SDF_INDEX_MAGIC "SDFINDEX"
+#define SDF_INDEX_VERSION 2
+
+/* Nanoseconds of the modification time, where struct stat provides them */
+#if defined(__APPLE__) && defined(st_mtime)
+#define STAT_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#elif defined(st_mtime)
+#define STAT_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#elif defined(_STATBUF_ST_NSEC) || defined(__APPLE__)
+#define STAT_MTIME_NSEC(st) ((st).st_mtimensec)
+#else
+#define STAT_MTIME_NSEC(st) 0
+#endif
+
+struct index_block {
+    char *id;
+    int32_t blocktype, datatype, ndims;
+    int64_t dims[SDF_MAXDIMS], offset, length;
+};
+
+struct index_entry {
+    char *name;
+    int64_t size, mtime;
+    int32_t ok, listed, step, jobid1, jobid2, nblocks;
+    double time;
+    struct index_block *blocks;
+};
+
+struct index_job {
+    const char *dir;
+    struct index_entry **entries;
+    int nentries, use_blocks;
+};
+
+
+static void free_index_entry(struct index_entry *e)
+{
+    int i;
+
+    for (i = 0; e->blocks && i < e->nblocks; i++)
+        free(e->blocks[i].id);
+    free(e->blocks);
+    free(e->name);
+    memset(e, 0, sizeof(*e));
+}
+
+
+static void free_index(struct index_entry *entries, int n)
+{
+    int i;
 
-    Py_DECREF(block);
+    for (i = 0; i < n; i++)
+        free_index_entry(&entries[i]);
+    free(entries);
+}
 
-    return;
 
-free_mem:
-    if (dict2) Py_DECREF(dict2);
-    if (block) Py_DECREF(block);
-    return;
+static int compare_index_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct index_entry*)a)->name,
+                  ((const struct index_entry*)b)->name);
 }
 
 
-static Block *dict_find_mesh_id(PyObject *dict, char *id)
+static int index_get(char **p, const char *end, void *value, size_t len)
 {
-    PyObject *value;
-    Block *block;
+    if (len > (size_t)(end - *p)) return -1;
+    memcpy(value, *p, len);
+    *p += len;
+    return 0;
+}
 
-    value = PyDict_GetItemString(dict, id);
-    if ( !value )
-        return NULL;
 
-    if ( !PyObject_TypeCheck(value, &BlockType) )
-        return NULL;
+static int index_get_string(char **p, const char *end, char **s)
+{
+    int32_t len;
 
-    block = (Block*)value;
+    if (index_get(p, end, &len, sizeof(len)) || len < 0 || len > end - *p)
+        return -1;
+    *s = malloc(len + 1);
+    if (!*s) return -1;
+    memcpy(*s, *p, len);
+    (*s)[len] = '\0';
+    *p += len;
+    return 0;
+}
 
-    switch(block->b->blocktype) {
-        case SDF_BLOCKTYPE_PLAIN_MESH:
-        case SDF_BLOCKTYPE_POINT_MESH:
-        case SDF_BLOCKTYPE_LAGRANGIAN_MESH:
-            return block;
+
+/* Load an index, returning the number of entries or -1 if there isn't one */
+static int load_index(const char *path, struct index_entry **entries)
+{
+    struct index_entry *e, *list = NULL;
+    struct index_block *blk;
+    struct stat st;
+    char *buf = NULL, *p, *end, magic[8];
+    int32_t version, nfiles = -1;
+    int fd, i, n = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    if (fstat(fd, &st) || st.st_size <= 0) goto fail;
+    buf = malloc(st.st_size);
+    if (!buf || read(fd, buf, st.st_size) != st.st_size) goto fail;
+
+    p = buf;
+    end = buf + st.st_size;
+    if (index_get(&p, end, magic, sizeof(magic))
+            || memcmp(magic, SDF_INDEX_MAGIC, sizeof(magic))
+            || index_get(&p, end, &version, sizeof(version))
+            || version != SDF_INDEX_VERSION
+            || index_get(&p, end, &nfiles, sizeof(nfiles))
+            || nfiles < 0 || nfiles > end - p)
+        goto fail;
+
+    list = calloc(nfiles + 1, sizeof(*list));
+    if (!list) goto fail;
+
+    for (n = 0; n < nfiles; n++) {
+        e = &list[n];
+        if (index_get_string(&p, end, &e->name)
+                || index_get(&p, end, &e->size, sizeof(e->size))
+                || index_get(&p, end, &e->mtime, sizeof(e->mtime))
+                || index_get(&p, end, &e->ok, sizeof(e->ok))
+                || index_get(&p, end, &e->listed, sizeof(e->listed))
+                || index_get(&p, end, &e->step, sizeof(e->step))
+                || index_get(&p, end, &e->jobid1, sizeof(e->jobid1))
+                || index_get(&p, end, &e->jobid2, sizeof(e->jobid2))
+                || index_get(&p, end, &e->nblocks, sizeof(e->nblocks))
+                || index_get(&p, end, &e->time, sizeof(e->time))
+                || e->nblocks < 0 || e->nblocks > end - p)
+            goto fail;
+
+        if (!e->listed) continue;
+
+        e->blocks = calloc(e->nblocks + 1, sizeof(*e->blocks));
+        if (!e->blocks) goto fail;
+
+        for (i = 0; i < e->nblocks; i++) {
+            blk = &e->blocks[i];
+            if (index_get_string(&p, end, &blk->id)
+                    || index_get(&p, end, &blk->blocktype,
+                                 sizeof(blk->blocktype))
+                    || index_get(&p, end, &blk->datatype,
+                                 sizeof(blk->datatype))
+                    || index_get(&p, end, &blk->ndims, sizeof(blk->ndims))
+                    || index_get(&p, end, blk->dims, sizeof(blk->dims))
+                    || index_get(&p, end, &blk->offset, sizeof(blk->offset))
+                    || index_get(&p, end, &blk->length, sizeof(blk->length))
+                    || blk->ndims < 0 || blk->ndims > SDF_MAXDIMS)
+                goto fail;
+        }
     }
 
-    return NULL;
+    free(buf);
+    close(fd);
+    *entries = list;
+    return n;
+
+fail:
+    /* Entries are zeroed until read, so all of them can be freed */
+    if (list) free_index(list, nfiles);
+    free(buf);
+    close(fd);
+    return -1;
 }
 
 
-static PyObject *dict_find_id(PyObject *dict, char *id)
+static void index_put(FILE *f, const void *value, size_t len, int *err)
 {
-    PyObject *value;
+    if (!*err && fwrite(value, 1, len, f) != len) *err = 1;
+}
 
-    value = PyDict_GetItemString(dict, id);
-    if ( !value )
-        return NULL;
 
-    if ( !PyObject_TypeCheck(value, &BlockType) )
-        return NULL;
+static void index_put_string(FILE *f, const char *s, int *err)
+{
+    int32_t len = strlen(s);
 
-    return value;
+    index_put(f, &len, sizeof(len), err);
+    index_put(f, s, len, err);
 }
 
 
-static void dict_find_variable_ids(PyObject *dict, Block *station)
+/*
+ * Write the index to a temporary file and move it into place, so that
+ * readers never see a partial index. Failure, for example in a read-only
+ * directory, just leaves the index to be rebuilt next time.
+ */
+static void save_index(const char *path, struct index_entry *entries, int n)
 {
-    PyObject *key, *value;
-    Block *block;
-    char *block_id;
-    Py_ssize_t pos = 0, len, i, *find, nfind, found;
-    sdf_block_t *b;
-
-    b = station->b;
-    if (!station->b)
+    struct index_entry *e;
+    struct index_block *blk;
+    char tmp[PATH_MAX];
+    int32_t version = SDF_INDEX_VERSION, nfiles = n;
+    int i, j, err = 0;
+    FILE *f;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid())
+            >= (int)sizeof(tmp))
         return;
 
-    nfind = b->ndims;
-    find = malloc(nfind * sizeof(Py_ssize_t));
-    for (i=0; i < nfind; i++)
-        find[i] = i;
+    f = fopen(tmp, "wb");
+    if (!f) return;
+
+    index_put(f, SDF_INDEX_MAGIC, 8, &err);
+    index_put(f, &version, sizeof(version), &err);
+    index_put(f, &nfiles, sizeof(nfiles), &err);
+
+    for (i = 0; i < n; i++) {
+        e = &entries[i];
+        index_put_string(f, e->name, &err);
+        index_put(f, &e->size, sizeof(e->size), &err);
+        index_put(f, &e->mtime, sizeof(e->mtime), &err);
+        index_put(f, &e->ok, sizeof(e->ok), &err);
+        index_put(f, &e->listed, sizeof(e->listed), &err);
+        index_put(f, &e->step, sizeof(e->step), &err);
+        index_put(f, &e->jobid1, sizeof(e->jobid1), &err);
+        index_put(f, &e->jobid2, sizeof(e->jobid2), &err);
+        index_put(f, &e->nblocks, sizeof(e->nblocks), &err);
+        index_put(f, &e->time, sizeof(e->time), &err);
+        for (j = 0; e->listed && j < e->nblocks; j++) {
+            blk = &e->blocks[j];
+            index_put_string(f, blk->id, &err);
+            index_put(f, &blk->blocktype, sizeof(blk->blocktype), &err);
+            index_put(f, &blk->datatype, sizeof(blk->datatype), &err);
+            index_put(f, &blk->ndims, sizeof(blk->ndims), &err);
+            index_put(f, blk->dims, sizeof(blk->dims), &err);
+            index_put(f, &blk->offset, sizeof(blk->offset), &err);
+            index_put(f, &blk->length, sizeof(blk->length), &err);
+        }
+    }
 
-    while (PyDict_Next(dict, &pos, &key, &value)) {
-        if (!PyObject_TypeCheck(value, &BlockType))
-            continue;
-        block = (Block*)value;
-        if (!block->b)
-            continue;
-        block_id = PyBytes_As_C(block->id);
-        if (!block_id)
-            continue;
-        len = strlen(block_id) + 1;
+    if (fclose(f) || err || rename(tmp, path))
+        unlink(tmp);
+}
 
-        // Loop over remaining variable_ids and check for a match
-        found = -1;
-        for (i=0; i < nfind; i++) {
-            found = find[i];
-            if (memcmp(block_id, b->variable_ids[found], len) == 0)
-                break;
-            found = -1;
-        }
 
-        if (found < 0) continue;
+/*
+ * Read the header of a new or changed file, and its block list if asked for.
+ * Opening a file reads just the header.
+ */
+static void index_file(const char *dir, struct index_entry *e, int use_blocks)
+{
+    struct index_block *blk;
+    sdf_file_t *h;
+    sdf_block_t *b;
+    char path[PATH_MAX];
+    int i, j;
 
-        if (!station->data) {
-            station->data = PyList_New(b->ndims);
-            if (!station->data) goto free_mem;
-        }
+    if (snprintf(path, sizeof(path), "%s/%s", dir, e->name)
+            >= (int)sizeof(path))
+        return;
 
-        // Found one of our variable_ids. Insert it into the station list and
-        // remove it from the find list.
-        PyList_SET_ITEM(station->data, found, (PyObject*)block);
-        Py_INCREF(block);
+    h = sdf_open(path, 0, SDF_READ, 0);
+    if (!h) return;
 
-        nfind--;
-        // Stop searching if we've found them all
-        if (nfind <= 0) break;
+    e->ok = 1;
+    e->step = h->step;
+    e->time = h->time;
+    e->jobid1 = h->jobid1;
+    e->jobid2 = h->jobid2;
+    e->nblocks = h->nblocks;
 
-        for (i=found; i < nfind; i++)
-            find[i] = find[i+1];
+    if (!use_blocks) {
+        sdf_close(h);
+        return;
     }
 
-free_mem:
-    free(find);
+    sdf_stack_init(h);
+    sdf_read_blocklist(h);
 
-    return;
+    e->blocks = calloc(h->nblocks + 1, sizeof(*e->blocks));
+    if (!e->blocks) {
+        e->ok = 0;
+    } else {
+        e->listed = 1;
+        b = h->blocklist;
+        for (i = 0; b && i < h->nblocks; i++, b = b->next) {
+            blk = &e->blocks[i];
+            blk->id = strdup(b->id);
+            if (!blk->id) break;
+            blk->blocktype = b->blocktype;
+            blk->datatype = b->datatype;
+            blk->ndims = b->ndims;
+            if (blk->ndims < 0 || blk->ndims > SDF_MAXDIMS)
+                blk->ndims = 0;
+            for (j = 0; j < SDF_MAXDIMS; j++)
+                blk->dims[j] = j < blk->ndims ? b->dims[j] : 1;
+            blk->offset = b->data_location;
+            blk->length = b->data_length;
+        }
+        e->nblocks = i;
+    }
+
+    sdf_stack_destroy(h);
+    sdf_close(h);
 }
 
 
-static PyObject* SDF_read(PyObject *self, PyObject *args, PyObject *kw)
+static void index_one(void *arg, int k)
 {
-    SDFObject *sdf;
-    PyTypeObject *type = &SDFType;
-    sdf_file_t *h;
-    sdf_block_t *b;
-    PyObject *dict, *dict_id, *sub, *key, *value;
-    PyObject *items_list;
-    Block *block;
-    Py_ssize_t pos = 0;
-    int i, convert, use_mmap, use_dict, use_derived, mode, len_id;
-    int mangled;
-    comm_t comm;
-    const char *file;
-    char *mesh_id;
-    static char *kwlist[] = {"file", "convert", "mmap", "dict", "derived",
-        "stations", "variables", "t0", "t1", NULL};
-    PyObject *stations = NULL, *variables = NULL;
-    double t0 = -DBL_MAX, t1 = DBL_MAX;
-    BlockList *blocklist;
+    struct index_job *job = arg;
 
-    convert = 0; use_mmap = 0; use_dict = 0; use_derived = 1;
-    mode = SDF_READ; comm = 0;
+    index_file(job->dir, job->entries[k], job->use_blocks);
+}
 
-    if (!PyArg_ParseTupleAndKeywords(args, kw, "s|iiiiO!O!dd", kwlist, &file,
-            &convert, &use_mmap, &use_dict, &use_derived, &PyList_Type,
-            &stations, &PyList_Type, &variables, &t0, &t1))
-        return NULL;
 
-    if (use_mmap)
-        PyErr_WarnEx(PyExc_DeprecationWarning, "mmap flag ignored", 1);
+/*
+ * List the SDF files in a directory, reusing the indexed entries for files
+ * whose size and modification time are unchanged, unless their block lists
+ * are needed but were never read. Returns the number of entries, sorted by
+ * name, and sets *changed if the index needs saving.
+ */
+static int refresh_index(const char *dir, struct index_entry *old, int nold,
+                         int use_blocks, int nthreads,
+                         struct index_entry **entries, int *changed)
+{
+    struct index_entry *list = NULL, *tmp, *match, key;
+    struct index_job job;
+    struct dirent *ent;
+    struct stat st;
+    char path[PATH_MAX];
+    size_t len;
+    int i, n = 0, nalloc = 0, nmatch = 0;
+    DIR *d;
+
+    d = opendir(dir);
+    if (!d) return -1;
+
+    memset(&job, 0, sizeof(job));
+
+    while ((ent = readdir(d))) {
+        len = strlen(ent->d_name);
+        if (len < 5 || strcmp(ent->d_name + len - 4, ".sdf"))
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name)
+                >= (int)sizeof(path) || stat(path, &st)
+                || !S_ISREG(st.st_mode))
+            continue;
 
-    sdf = (SDFObject*)type->tp_alloc(type, 0);
-    if (!sdf) {
-        PyErr_Format(PyExc_MemoryError, "Failed to allocate SDF object");
-        return NULL;
+        if (n == nalloc) {
+            nalloc = nalloc ? 2 * nalloc : 64;
+            tmp = realloc(list, nalloc * sizeof(*list));
+            if (!tmp) goto fail;
+            list = tmp;
+        }
+        memset(&list[n], 0, sizeof(*list));
+        list[n].name = strdup(ent->d_name);
+        if (!list[n].name) goto fail;
+        list[n].size = st.st_size;
+        list[n].mtime = (int64_t)st.st_mtime * 1000000000
+                      + STAT_MTIME_NSEC(st);
+        n++;
     }
-
-    h = sdf_open(file, comm, mode, 0);
-    sdf->h = h;
-    if (!sdf->h) {
-        PyErr_Format(PyExc_IOError, "Failed to open file: '%s'", file);
-        Py_DECREF(sdf);
-        return NULL;
+    closedir(d);
+    d = NULL;
+
+    if (n) qsort(list, n, sizeof(*list), compare_index_entries);
+
+    job.dir = dir;
+    job.use_blocks = use_blocks;
+    job.entries = calloc(n + 1, sizeof(*job.entries));
+    if (!job.entries) goto fail;
+
+    /* Take over the indexed data of files which have not changed */
+    for (i = 0; i < n; i++) {
+        key.name = list[i].name;
+        match = nold ? bsearch(&key, old, nold, sizeof(*old),
+                               compare_index_entries) : NULL;
+        if (match && match->size == list[i].size
+                && match->mtime == list[i].mtime
+                && (match->listed || !match->ok || !use_blocks)) {
+            /* Swap names, as the old list must stay sorted for bsearch */
+            key = list[i];
+            list[i] = *match;
+            match->name = key.name;
+            match->blocks = NULL;
+            match->nblocks = 0;
+            nmatch++;
+        } else
+            job.entries[job.nentries++] = &list[i];
     }
 
-    sdf_stack_init(h);
+    if (job.nentries > 0 || nmatch != nold)
+        *changed = 1;
 
-    if (convert) h->use_float = 1;
+    Py_BEGIN_ALLOW_THREADS
+    run_pool(index_one, &job, job.nentries, nthreads);
+    Py_END_ALLOW_THREADS
 
-    if (use_derived)
-        sdf_read_blocklist_all(h);
-    else
-        sdf_read_blocklist(h);
+    free(job.entries);
 
-    dict = PyDict_New();
-    dict_id = PyDict_New();
-    sdf->blocklist = dict;
+    *entries = list;
+    return n;
 
-    if (!use_dict) {
-        type = &BlockListType;
-        blocklist = (BlockList*)type->tp_alloc(type, 0);
-        if (!blocklist) {
-            Py_DECREF(dict_id);
-            PyErr_Format(PyExc_MemoryError, "Failed to allocate BlockList object");
-            return NULL;
-        }
-        blocklist->dict = dict;
-        sdf->blocklist = (PyObject*)blocklist;
-    }
+fail:
+    if (d) closedir(d);
+    free(job.entries);
+    free_index(list, n);
+    return -1;
+}
 
-    /* Add header */
-    sub = fill_header(h);
-    PyDict_SetItemString(dict, "Header", sub);
-    Py_DECREF(sub);
 
-    b = h->current_block = h->blocklist;
-    for (i = 0; i < h->nblocks; i++) {
-        switch(b->blocktype) {
-            case SDF_BLOCKTYPE_PLAIN_MESH:
-            case SDF_BLOCKTYPE_POINT_MESH:
-            case SDF_BLOCKTYPE_LAGRANGIAN_MESH:
-                setup_mesh(sdf, dict, b, dict_id);
-                break;
-            case SDF_BLOCKTYPE_PLAIN_VARIABLE:
-            case SDF_BLOCKTYPE_PLAIN_DERIVED:
-            case SDF_BLOCKTYPE_POINT_VARIABLE:
-            case SDF_BLOCKTYPE_POINT_DERIVED:
-            case SDF_BLOCKTYPE_ARRAY:
-                setup_array(sdf, dict, b, dict_id);
-                break;
-            case SDF_BLOCKTYPE_CONSTANT:
-                setup_constant(sdf, dict, b, dict_id);
-                break;
-            case SDF_BLOCKTYPE_NAMEVALUE:
-                setup_namevalue(sdf, dict, b, dict_id);
-                break;
-            case SDF_BLOCKTYPE_STATION:
-                sub = PyDict_GetItemString(dict, "StationBlocks");
-                if ( !sub ) {
-                    sub = PyDict_New();
-                    PyDict_SetItemString(dict, "StationBlocks", sub);
-                    Py_DECREF(sub);
-                }
-                append_station_metadata(b, sub);
-                extract_station_time_histories(h, stations, variables, t0, t1,
-                        dict);
-                break;
-            case SDF_BLOCKTYPE_STITCHED_MATERIAL:
-            case SDF_BLOCKTYPE_CONTIGUOUS_MATERIAL:
-                setup_materials(sdf, dict, b, dict_id);
-                break;
-            case SDF_BLOCKTYPE_RUN_INFO:
-                sub = fill_runinfo(b);
-                PyDict_SetItemString(dict, "Run_info", sub);
-                Py_DECREF(sub);
-                break;
-        }
-        b = h->current_block = b->next;
+static PyObject *index_dict(const char *dir, struct index_entry *e,
+                            int use_blocks)
+{
+    PyObject *dict, *blocks, *sub, *dims;
+    struct index_block *blk;
+    char path[PATH_MAX];
+    int i, j;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, e->name);
+
+    dict = Py_BuildValue("{s:s,s:L,s:L,s:i,s:d,s:i,s:i,s:i}",
+                         "filename", path, "size", (long long)e->size,
+                         "mtime_ns", (long long)e->mtime, "step", e->step,
+                         "time", e->time, "jobid1", e->jobid1,
+                         "jobid2", e->jobid2, "nblocks", e->nblocks);
+    if (!dict || !use_blocks) return dict;
+
+    blocks = PyDict_New();
+    for (i = 0; blocks && i < e->nblocks; i++) {
+        blk = &e->blocks[i];
+        dims = PyTuple_New(blk->ndims);
+        for (j = 0; dims && j < blk->ndims; j++)
+            PyTuple_SET_ITEM(dims, j, PyLong_FromLongLong(blk->dims[j]));
+        sub = dims ? Py_BuildValue("{s:i,s:i,s:O,s:L,s:L}",
+                                   "blocktype", blk->blocktype,
+                                   "datatype", blk->datatype, "dims", dims,
+                                   "offset", (long long)blk->offset,
+                                   "length", (long long)blk->length) : NULL;
+        Py_XDECREF(dims);
+        if (!sub || PyDict_SetItemString(blocks, blk->id, sub) < 0)
+            Py_CLEAR(blocks);
+        Py_XDECREF(sub);
     }
 
-    b = h->current_block = h->blocklist;
-    for (i = 0; i < h->nblocks; i++) {
-        switch(b->blocktype) {
-            case SDF_BLOCKTYPE_STITCHED:
-                setup_stitched(sdf, dict, b, dict_id);
-                break;
-        }
-        b = h->current_block = b->next;
-    }
+    if (!blocks || PyDict_SetItemString(dict, "blocks", blocks) < 0)
+        Py_CLEAR(dict);
+    Py_XDECREF(blocks);
 
-    len_id = h->string_length + 5;
-    mesh_id = malloc(len_id);
+    return dict;
+}
 
-    while (PyDict_Next(dict, &pos, &key, &value)) {
-        if (!PyObject_TypeCheck(value, &BlockType))
-            continue;
-        block = (Block*)value;
-        b = block->b;
-        if (!b) continue;
-        if (b->blocktype == SDF_BLOCKTYPE_PLAIN_VARIABLE
-                || b->blocktype == SDF_BLOCKTYPE_PLAIN_DERIVED
-                || b->blocktype == SDF_BLOCKTYPE_STITCHED_MATERIAL
-                || b->blocktype == SDF_BLOCKTYPE_CONTIGUOUS_MATERIAL) {
-            if (!b->mesh_id)
-                continue;
-            block->grid = dict_find_mesh_id(dict_id, b->mesh_id);
-            len_id = strlen(b->mesh_id);
-            memcpy(mesh_id, b->mesh_id, len_id);
-            memcpy(mesh_id+len_id, "_mid", 5);
-            block->grid_mid = dict_find_mesh_id(dict_id, mesh_id);
-            if (b->blocktype == SDF_BLOCKTYPE_STITCHED_MATERIAL
-                    || b->blocktype == SDF_BLOCKTYPE_CONTIGUOUS_MATERIAL)
-                dict_find_variable_ids(dict, block);
-        } else if (b->blocktype == SDF_BLOCKTYPE_POINT_VARIABLE
-                || b->blocktype == SDF_BLOCKTYPE_POINT_DERIVED) {
-            block->grid = dict_find_mesh_id(dict_id, b->mesh_id);
-        }
-    }
 
-    free(mesh_id);
+static PyObject* SDF_index(PyObject *self, PyObject *args, PyObject *kw)
+{
+    static char *kwlist[] = {"directory", "blocks", "threads", NULL};
+    struct index_entry *old = NULL, *entries = NULL;
+    PyObject *result = NULL, *ob;
+    char path[PATH_MAX];
+    const char *dir;
+    int i, n, nold, use_blocks = 0, nthreads = 1, changed = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "s|ii", kwlist, &dir,
+            &use_blocks, &nthreads))
+        return NULL;
 
-    if (use_dict) {
-        Py_DECREF(dict_id);
-        Py_DECREF(sdf);
-        return (PyObject*)dict;
-    }
+    if (nthreads < 1) nthreads = 1;
 
-    /* Mangle dictionary names */
-    items_list = PyDict_Items(dict);
-    for (i = 0; i < PyList_GET_SIZE(items_list); i++) {
-        PyObject *item = PyList_GET_ITEM(items_list, i);
-        PyObject *key = PyTuple_GET_ITEM(item, 0);
-        PyObject *value = PyTuple_GET_ITEM(item, 1);
-        char *ckey, *ptr;
+    if (snprintf(path, sizeof(path), "%s/%s", dir, SDF_INDEX_NAME)
+            >= (int)sizeof(path)) {
+        PyErr_Format(PyExc_IOError, "Path too long: '%s'", dir);
+        return NULL;
+    }
 
-        mangled = 0;
-        ckey = strdup(PyBytes_As_C(key));
+    nold = load_index(path, &old);
+    if (nold < 0) {
+        nold = 0;
+        changed = 1;
+    }
 
-        for (ptr = ckey; *ptr != '\0'; ptr++) {
-            if (*ptr >= '0' && *ptr <= '9')
-                continue;
-            if (*ptr >= 'A' && *ptr <= 'Z')
-                continue;
-            if (*ptr >= 'a' && *ptr <= 'z')
-                continue;
-            *ptr = '_';
-            mangled = 1;
-        }
+    n = refresh_index(dir, old, nold, use_blocks, nthreads, &entries,
+                      &changed);
+    free_index(old, nold);
+    if (n < 0) {
+        PyErr_Format(PyExc_IOError, "Failed to read directory: '%s'", dir);
+        return NULL;
+    }
 
-        if (mangled) {
-            PyDict_DelItem(dict, key);
-            PyDict_SetItemString(dict, ckey, value);
-        }
+    if (changed) {
+        Py_BEGIN_ALLOW_THREADS
+        save_index(path, entries, n);
+        Py_END_ALLOW_THREADS
+    }
 
-        free(ckey);
+    /* Files which could not be read are remembered but not returned */
+    result = PyList_New(0);
+    for (i = 0; result && i < n; i++) {
+        if (!entries[i].ok) continue;
+        ob = index_dict(dir, &entries[i], use_blocks);
+        if (!ob || PyList_Append(result, ob) < 0)
+            Py_CLEAR(result);
+        Py_XDECREF(ob);
     }
-    Py_DECREF(items_list);
 
-    Py_DECREF(dict_id);
-    Py_DECREF(sdf);
-    return (PyObject*)blocklist;
+    free_index(entries, n);
+
+    return result;
 }
 
 
 static PyMethodDef SDF_methods[] = {
     {"read", (PyCFunction)SDF_read, METH_VARARGS | METH_KEYWORDS,
-     "read(file, [convert, dict, derived, stations, variables, t0, t1])\n"
+     "read(file, [convert, mmap, dict, derived, stations, variables, t0, t1,\n"
+     "     cache, dtypes])\n"
      "\nReads the SDF data and returns a dictionary of NumPy arrays.\n\n"
      "Parameters\n"
      "----------\n"
@@ -1819,6 +4951,9 @@ static PyMethodDef SDF_methods[] = {
      "    The name of the SDF file to open.\n"
      "convert : bool, optional\n"
      "    Convert double precision data to single when reading file.\n"
+     "mmap : bool, optional\n"
+     "    Memory-map the file. Blocks that need no conversion are returned\n"
+     "    as read-only views of the mapping and are only read when accessed.\n"
      "dict : bool, optional\n"
      "    Return file contents as a dictionary rather than member names.\n"
      "derived : bool, optional\n"
@@ -1831,6 +4966,94 @@ static PyMethodDef SDF_methods[] = {
      "    Starting time for station data.\n"
      "t1 : double, optional\n"
      "    Ending time for station data.\n"
+     "cache : int, optional\n"
+     "    Budget in bytes for block data kept in memory. Once exceeded, the\n"
+     "    least recently used data that is not referenced elsewhere is\n"
+     "    released and read again when next accessed. The default of 0\n"
+     "    keeps all data.\n"
+     "dtypes : dict, optional\n"
+     "    Types to read blocks as, keyed by block id, for example\n"
+     "    {'ex': np.float32}. Double precision data is converted to single\n"
+     "    as it is read. Median meshes follow their mesh.\n"
+    },
+    {"read_many", (PyCFunction)SDF_read_many, METH_VARARGS | METH_KEYWORDS,
+     "read_many(file, ids, [threads])\n"
+     "\nReads the data for several blocks at once and returns a dictionary\n"
+     "of NumPy arrays keyed by the requested ids.\n\n"
+     "The blocks are read in the order in which they are stored, with\n"
+     "neighbouring blocks read one after another by the same thread. The\n"
+     "data is also stored on the blocks, as if block.data had been\n"
+     "accessed.\n\n"
+     "Parameters\n"
+     "----------\n"
+     "file : string or BlockList\n"
+     "    The name of the SDF file to read, or a list of blocks returned\n"
+     "    by sdf.read.\n"
+     "ids : string list\n"
+     "    The ids of the blocks to read. Attribute names, such as\n"
+     "    'Electric_Field_Ex', are also accepted.\n"
+     "threads : int, optional\n"
+     "    Number of threads used to read the data. The default is 1.\n"
+    },
+    {"read_series", (PyCFunction)SDF_read_series,
+     METH_VARARGS | METH_KEYWORDS,
+     "read_series(files, ids, [section, threads])\n"
+     "\nReads the same blocks from each of a list of files.\n\n"
+     "Only the header and block list of each file are read before the\n"
+     "requested data is copied straight into an array with one row per\n"
+     "file. Returns a tuple (data, times, steps), where data is an array\n"
+     "if ids is a single id and a dictionary of arrays keyed by id\n"
+     "otherwise.\n\n"
+     "Parameters\n"
+     "----------\n"
+     "files : string list\n"
+     "    The names of the SDF files to read, in the order of the rows.\n"
+     "ids : string or string list\n"
+     "    The ids of the variables, arrays or constants to read. The\n"
+     "    blocks must have the same type and dimensions in every file.\n"
+     "section : index, optional\n"
+     "    Read only this section of each block, as for block[section].\n"
+     "    Constants are always read whole.\n"
+     "threads : int, optional\n"
+     "    Number of threads used to read the files. The default is 1.\n"
+    },
+    {"scan", (PyCFunction)SDF_scan, METH_VARARGS | METH_KEYWORDS,
+     "scan(file, [threads])\n"
+     "\nReads only the header of an SDF file and returns a dictionary with\n"
+     "the entries 'filename', 'step', 'time', 'jobid1', 'jobid2' and\n"
+     "'nblocks'.\n\n"
+     "The block list is not read, so this is much faster than sdf.read\n"
+     "when searching a directory for the files belonging to a run.\n\n"
+     "Parameters\n"
+     "----------\n"
+     "file : string or string list\n"
+     "    The name of the SDF file to scan. If a list of names is given\n"
+     "    then a list of dictionaries is returned, with None in place of\n"
+     "    any file that could not be opened.\n"
+     "threads : int, optional\n"
+     "    Number of threads used to scan a list of files. The default is 1.\n"
+    },
+    {"index", (PyCFunction)SDF_index, METH_VARARGS | METH_KEYWORDS,
+     "index(directory, [blocks, threads])\n"
+     "\nReturns the headers of all SDF files in a directory, sorted by file\n"
+     "name, as a list of dictionaries with the same entries as sdf.scan\n"
+     "plus 'size' and 'mtime_ns', the modification time in nanoseconds.\n\n"
+     "The headers are kept in an index file, '" SDF_INDEX_NAME "', in the\n"
+     "directory. Only files which are new or whose size or modification\n"
+     "time have changed are opened, and the index is updated if the\n"
+     "directory is writable. Block tables are read the first time they are\n"
+     "asked for and kept in the index from then on. Files which cannot be\n"
+     "read are left out.\n\n"
+     "Parameters\n"
+     "----------\n"
+     "directory : string\n"
+     "    The directory to index.\n"
+     "blocks : bool, optional\n"
+     "    If True then each dictionary has a 'blocks' entry mapping block id\n"
+     "    to its 'blocktype', 'datatype', 'dims', and the 'offset' and\n"
+     "    'length' of its data in the file. The default is False.\n"
+     "threads : int, optional\n"
+     "    Number of threads used to read changed files. The default is 1.\n"
     },
     {NULL}
 };
@@ -1884,7 +5107,9 @@ MOD_INIT(sdf)
     BlockListType.tp_dealloc = BlockList_dealloc;
     BlockListType.tp_flags = Py_TPFLAGS_DEFAULT;
     BlockListType.tp_dictoffset = offsetof(BlockList, dict);
-    BlockListType.tp_members = BlockList_members;
+    BlockListType.tp_getattro = BlockList_getattro;
+    BlockListType.tp_getset = BlockList_getset;
+    BlockListType.tp_methods = BlockList_methods;
     if (PyType_Ready(&BlockListType) < 0)
         return MOD_ERROR_VAL;
     if (PyModule_AddObject(m, "BlockList", (PyObject *)&BlockListType) < 0)
@@ -1913,9 +5138,13 @@ MOD_INIT(sdf)
     ADD_TYPE(BlockStitchedPath, BlockBase);
 
     BlockBase.tp_getset = Block_getset;
+    BlockBase.tp_methods = Block_methods;
+    BlockBase.tp_as_mapping = &Block_as_mapping;
     ADD_TYPE(BlockArray, BlockBase);
 
     BlockBase.tp_getset = 0;
+    BlockBase.tp_methods = 0;
+    BlockBase.tp_as_mapping = 0;
     BlockBase.tp_dictoffset = offsetof(Block, dict);
     ADD_TYPE(BlockNameValue, BlockBase);
 
@@ -1928,6 +5157,8 @@ MOD_INIT(sdf)
 
     BlockBase.tp_base = &BlockArrayType;
     BlockBase.tp_getset = Block_getset;
+    BlockBase.tp_methods = Block_methods;
+    BlockBase.tp_as_mapping = &Block_as_mapping;
     BlockBase.tp_members = BlockMeshVariable_members;
 
     ADD_TYPE(BlockPlainVariable, BlockBase);
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "sdf.h"
 #include "sdf_helper.h"
 
@@ -16,12 +17,19 @@ struct block_list {
 };
 
 
-int sdf_write_vtk_grid(sdf_file_t *h, sdf_block_t *grid, char *filename)
+/*
+ * Write the grid and the given variables to a VTK file. The variables do not
+ * need to be in the blocklist of the file. Any variable which already has its
+ * data in memory is written as it is and left alone, otherwise the data is
+ * read in from the file and freed again afterwards.
+ */
+int sdf_write_vtk_grid_blocks(sdf_file_t *h, sdf_block_t *grid, char *filename,
+                              sdf_block_t **blocks, int nblocks)
 {
-    sdf_block_t *b, *next;
+    sdf_block_t *b;
     FILE *fd = fopen(filename, "w");
     int array_offset = 0;
-    int nx, ny, nz, sz, v_size, c_size, i, len;
+    int nx, ny, nz, sz, v_size, c_size, i, done_data;
     double *xptr, *yptr, *zptr;
     double zero = 0.0;
     sdf_block_t **cell_blocks, **vertex_blocks;
@@ -30,6 +38,11 @@ int sdf_write_vtk_grid(sdf_file_t *h, sdf_block_t *grid, char *filename)
                                  "UnstructuredGrid"};
     int vtk_type;
 
+    if (!fd) {
+        fprintf(stderr, "Error opening file %s\n", filename);
+        return 1;
+    }
+
     switch (grid->blocktype) {
     case SDF_BLOCKTYPE_PLAIN_MESH:
         vtk_type = 0;
@@ -44,23 +57,11 @@ int sdf_write_vtk_grid(sdf_file_t *h, sdf_block_t *grid, char *filename)
         break;
     }
 
-    cell_blocks = malloc(h->nblocks * sizeof(*cell_blocks));
-    vertex_blocks = malloc(h->nblocks * sizeof(*vertex_blocks));
-
-    len = strlen(grid->id);
-
-    /* Find arrays associated with the grid */
-    next = h->blocklist;
-    while (next) {
-        h->current_block = b = next;
-        next = b->next;
-        if (b->blocktype != SDF_BLOCKTYPE_PLAIN_VARIABLE
-                && b->blocktype != SDF_BLOCKTYPE_POINT_VARIABLE)
-            continue;
-
-        if (strlen(b->mesh_id) != len || memcmp(b->mesh_id, grid->id, len+1))
-            continue;
+    cell_blocks = malloc((nblocks + 1) * sizeof(*cell_blocks));
+    vertex_blocks = malloc((nblocks + 1) * sizeof(*vertex_blocks));
 
+    for (i = 0; i < nblocks; i++) {
+        b = blocks[i];
         if (b->datatype != SDF_DATATYPE_REAL8) {
             printf("Datatype not yet supported. %s ignored.\n", b->id);
             continue;
@@ -194,21 +195,23 @@ int sdf_write_vtk_grid(sdf_file_t *h, sdf_block_t *grid, char *filename)
     /* PointData */
     for (i = 0; i < nvertex_blocks; i++) {
         b = vertex_blocks[i];
-        sdf_helper_read_data(h, b);
+        done_data = b->done_data;
+        if (!done_data) sdf_helper_read_data(h, b);
         sz = v_size;
         fwrite(&sz, sizeof(sz), 1, fd);
         fwrite(b->data, 1, sz, fd);
-        sdf_free_block_data(h, b);
+        if (!done_data) sdf_free_block_data(h, b);
     }
 
     /* CellData */
     for (i = 0; i < ncell_blocks; i++) {
         b = cell_blocks[i];
-        sdf_helper_read_data(h, b);
+        done_data = b->done_data;
+        if (!done_data) sdf_helper_read_data(h, b);
         sz = c_size;
         fwrite(&sz, sizeof(sz), 1, fd);
         fwrite(b->data, 1, sz, fd);
-        sdf_free_block_data(h, b);
+        if (!done_data) sdf_free_block_data(h, b);
     }
 
     /* Grid */
@@ -264,7 +267,7 @@ int sdf_write_vtk_grid(sdf_file_t *h, sdf_block_t *grid, char *filename)
         }
     }
 
-    sdf_free_block_data(h, b);
+    sdf_free_block_data(h, grid);
 
     fprintf(fd, "\n  </AppendedData>\n");
 
@@ -280,6 +283,38 @@ int sdf_write_vtk_grid(sdf_file_t *h, sdf_block_t *grid, char *filename)
 }
 
 
+int sdf_write_vtk_grid(sdf_file_t *h, sdf_block_t *grid, char *filename)
+{
+    sdf_block_t *b, *next, **blocks;
+    int nblocks = 0, len, result;
+
+    blocks = malloc((h->nblocks + 1) * sizeof(*blocks));
+
+    len = strlen(grid->id);
+
+    /* Find arrays associated with the grid */
+    next = h->blocklist;
+    while (next) {
+        h->current_block = b = next;
+        next = b->next;
+        if (b->blocktype != SDF_BLOCKTYPE_PLAIN_VARIABLE
+                && b->blocktype != SDF_BLOCKTYPE_POINT_VARIABLE)
+            continue;
+
+        if (strlen(b->mesh_id) != len || memcmp(b->mesh_id, grid->id, len+1))
+            continue;
+
+        blocks[nblocks++] = b;
+    }
+
+    result = sdf_write_vtk_grid_blocks(h, grid, filename, blocks, nblocks);
+
+    free(blocks);
+
+    return result;
+}
+
+
 void sdf_write_vtm_header(FILE *fd)
 {
     /* Header */
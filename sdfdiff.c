@@ -25,6 +25,10 @@
 #include <time.h>
 #include <float.h>
 #include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include "sdf.h"
 #include "sdf_list_type.h"
 #include "sdf_helper.h"
@@ -43,9 +47,18 @@
 int metadata, debug, ignore_summary;
 int exclude_variables, index_offset;
 int just_id, verbose_metadata, special_format, scale_factor;
-int purge_duplicate, ignore_nblocks, quiet, show_errors;
+int purge_duplicate, ignore_nblocks, quiet, show_errors, use_mmap;
+int error_summary;
+int nfiles, nthreads, dir_mode;
+int first_diff, max_reports;
+int64_t memory_limit;
+char *particle_id;
+char *output_file;
+char *write_signature, *signature_file;
+int nsketch;
+char *array_section;
+int64_t array_ndims, *array_starts, *array_ends, *array_strides;
 int array_blocktypes, mesh_blocktypes;
-int done_header = 0;
 int *blocktype_mask;
 char *format_float, *format_int, *format_space;
 double relerr = 1.0e-15;
@@ -55,9 +68,20 @@ static char *default_float = "%27.18e";
 static char *default_int   = "%" PRIi64;
 static char *default_space = "    ";
 static char *default_indent = "  ";
-static char indent[64];
 #define HEADER_LEN 512
-static char header_string[HEADER_LEN];
+
+/*
+ * State for the comparison of one pair of files. Pairs of files may be
+ * compared concurrently in directory mode, so each thread has its own copy
+ * and its own output stream.
+ */
+static __thread FILE *out;
+static __thread char indent[64];
+static __thread char header_string[HEADER_LEN];
+static __thread int done_header = 0, done_summary_header = 0;
+static __thread int stop_diff = 0;
+static __thread int64_t nreports = 0;
+static __thread int defer_header = 0, header_pending, summary_header_pending;
 
 struct id_list {
     char *id;
@@ -71,7 +95,11 @@ struct range_type {
 int nrange, nrange_max;
 int nblist, nblist_max;
 
-static char width_fmt[16];
+enum output_types {
+    vtk, raw
+} output_type;
+
+static __thread char width_fmt[16];
 #define SET_WIDTH_LEN(len) do { \
         snprintf(width_fmt, 16, "%%-%is", (len)); \
     } while(0)
@@ -82,11 +110,11 @@ static char width_fmt[16];
     } while(0)
 
 #define PRINTC(name,variable,fmt) do { \
-        printf(indent, 1); \
-        printf(width_fmt, (name)); \
-        printf(" "); \
-        printf(fmt, (variable)); \
-        printf("\n"); \
+        fprintf(out, indent, 1); \
+        fprintf(out, width_fmt, (name)); \
+        fprintf(out, " "); \
+        fprintf(out, fmt, (variable)); \
+        fprintf(out, "\n"); \
     } while(0)
 
 #define PRINT(name,variable,fmt) do { \
@@ -96,40 +124,57 @@ static char width_fmt[16];
 #define PRINTAR(name,array,fmt,len) do { \
         int _i; \
         if (!(array)) break; \
-        printf(indent, 1); \
-        printf(width_fmt, (name)); \
-        printf(" ("); \
-        printf(fmt, (array)[0]); \
+        fprintf(out, indent, 1); \
+        fprintf(out, width_fmt, (name)); \
+        fprintf(out, " ("); \
+        fprintf(out, fmt, (array)[0]); \
         for (_i = 1; _i < (len); _i++) { \
-            printf(","); \
-            printf(fmt, (array)[_i]); \
+            fprintf(out, ","); \
+            fprintf(out, fmt, (array)[_i]); \
         } \
-        printf(")\n"); \
+        fprintf(out, ")\n"); \
     } while(0)
 
 #define PRINTDAR(name,array,fmt,len) do { \
         int _i; \
         if (!(array)) break; \
-        printf(indent, 1); \
-        printf(width_fmt, (name)); \
-        printf(" ("); \
-        printf(fmt, sdf_datatype_c[(array)[0]]); \
+        fprintf(out, indent, 1); \
+        fprintf(out, width_fmt, (name)); \
+        fprintf(out, " ("); \
+        fprintf(out, fmt, sdf_datatype_c[(array)[0]]); \
         for (_i = 1; _i < (len); _i++) { \
-            printf(","); \
-            printf(fmt, sdf_datatype_c[(array)[_i]]); \
+            fprintf(out, ","); \
+            fprintf(out, fmt, sdf_datatype_c[(array)[_i]]); \
         } \
-        printf(")\n"); \
+        fprintf(out, ")\n"); \
     } while(0)
 
 
 int close_files(sdf_file_t **handles);
 static inline void print_header(void);
+int sdf_free_block_data(sdf_file_t *h, sdf_block_t *b);
+void sdf_write_vtm_header(FILE *fd);
+int sdf_write_vtk_grid_blocks(sdf_file_t *h, sdf_block_t *grid, char *filename,
+                              sdf_block_t **blocks, int nblocks);
 
 
 void usage(int err)
 {
     fprintf(stderr, "usage: sdfdiff [options] <sdf_filename1> "
-                    "<sdf_filename2>\n");
+                    "<sdf_filename2> [<sdf_filename3> ...]\n");
+    fprintf(stderr, "       sdfdiff [options] -w <signature_file> "
+                    "<sdf_filename>\n");
+    fprintf(stderr, "       sdfdiff [options] -g <signature_file> "
+                    "<sdf_filename>\n");
+    fprintf(stderr, "\nIf more than two files are given then the first file "
+                    "is used as a reference\nand each of the others is "
+                    "compared against it. The exit status is the number\n"
+                    "of files that differ from the reference.\n");
+    fprintf(stderr, "\nIf two directories are given then the SDF files in "
+                    "them are paired up by the\nstep number in their header "
+                    "and each pair is compared. The exit status is\nthe "
+                    "number of pairs that differ, including files with no "
+                    "partner.\n");
     fprintf(stderr, "\noptions:\n\
   -h --help            Show this usage message\n\
   -q --quiet           Do not print output. Exit with zero status if files\n\
@@ -144,19 +189,55 @@ void usage(int err)
   -i --no-summary      Ignore the metadata summary\n\
   -b --no-nblocks      Ignore the header value for nblocks\n\
   -E --show-errors     Print error values\n\
+  -f --first-diff      Stop at the first element which differs\n\
+  -n --max-reports=n   Stop listing differing elements after the first n.\n\
+                       The remaining elements are still compared.\n\
+  -e --error-summary   Print a table of error norms and a histogram of the\n\
+                       relative error for each block instead of listing the\n\
+                       differing elements\n\
   -I --c-indexing      Array indexing starts from 1 by default. If this flag\n\
                        is used then the indexing starts from 0.\n\
+  -s --array-section=s Only read in and compare the specified array section.\n\
+                       The array section 's' mimics Python's slicing\n\
+                       notation, including strides. The same section is\n\
+                       applied to meshes.\n\
   -F --format-float=f  Use specified format for printing floating-point array\n\
                        contents.\n\
   -N --format-int=f    Use specified format for printing integer array\n\
                        contents.\n\
   -S --format-space=f  Use specified spacing between array elements.\n\
+  -u --mmap            Use mmap'ed file I/O. Data that needs no conversion\n\
+                       is compared directly from the mapped files.\n\
+  -t --threads=n       Number of threads used when comparing against more\n\
+                       than one file, comparing directories or matching\n\
+                       particle IDs (default: number of processors)\n\
+  -L --memory-limit=m  Limit on the memory in MB used by the files being\n\
+                       compared at the same time in directory mode\n\
+                       (default: half of the physical memory)\n\
+  -k --particle-id=id  Compare point data by matching particle IDs instead\n\
+                       of by position in the array. Point variables with\n\
+                       IDs of the form \"id/<species>\" hold the particle\n\
+                       IDs for the mesh they are defined on.\n\
   -p --purge-duplicate Delete duplicated block IDs\n\
   -B --block-types     List of SDF block types to consider\n\
   -A --array-blocks    Only consider array block types (%i,%i,%i,%i,%i)\n\
   -M --mesh-blocks     Only consider mesh block types (%i,%i,%i,%i)\n\
   -P --print-types     Print the list of SDF blocktypes\n\
   -V --version         Print version information and exit\n\
+  -o --output=stem     Write the absolute and relative error of each\n\
+                       differing plain variable to files starting with\n\
+                       'stem' instead of listing the differing elements\n\
+  -T --output-type=t   Output file format, either vtk (default) or raw\n\
+  -w --write-signature=file\n\
+                       Write a signature for each block of the file instead\n\
+                       of comparing it. The signature holds the block\n\
+                       dimensions, a hash of the data and its minimum,\n\
+                       maximum, sum and L2 norm.\n\
+  -K --sketch=n        Also store the mean of n equal sized chunks of each\n\
+                       block in the signature\n\
+  -g --signature=file  Compare the file against a signature written with -w.\n\
+                       The statistics are compared using the -a/-r\n\
+                       tolerances.\n\
 ", SDF_BLOCKTYPE_PLAIN_VARIABLE, SDF_BLOCKTYPE_POINT_VARIABLE,
    SDF_BLOCKTYPE_ARRAY,
    SDF_BLOCKTYPE_PLAIN_DERIVED, SDF_BLOCKTYPE_POINT_DERIVED,
@@ -350,44 +431,160 @@ void setup_blocklist_mask(void)
 }
 
 
+/*
+ * Return the path of the file in directory "dir" which has the same name as
+ * "file".
+ */
+static char *dir_file_path(char *dir, char *file)
+{
+    char *ptr, *path;
+    int i, len;
+
+    len = strlen(file);
+    ptr = file + len;
+    for (i = 0; i < len; ++i, --ptr) {
+        if (*ptr == '/') {
+            ptr++;
+            break;
+        }
+    }
+    len = strlen(dir);
+    for (; len > 0; --len) {
+        if (dir[len] != '/')
+            break;
+    }
+
+    path = malloc(len + strlen(ptr) + 2);
+    memcpy(path, dir, len);
+    if (*(path+len-1) != '/') {
+        *(path+len) = '/';
+        len++;
+    }
+    memcpy(path+len, ptr, strlen(ptr));
+    path[len + strlen(ptr)] = '\0';
+
+    return path;
+}
+
+
+void parse_array_section(char *array_section)
+{
+    int ndim, i, len = strlen(array_section), done_start, done_end;
+    char *ptr, *old;
+
+    if (array_starts) free(array_starts);
+    if (array_ends) free(array_ends);
+    if (array_strides) free(array_strides);
+
+    array_ndims = 1;
+    for (i = 0, ptr = array_section; i < len; i++, ptr++)
+        if (*ptr == ',') array_ndims++;
+
+    array_starts  = calloc(array_ndims, sizeof(*array_starts));
+    array_ends    = malloc(array_ndims * sizeof(*array_ends));
+    array_strides = malloc(array_ndims * sizeof(*array_strides));
+
+    for (i = 0; i < array_ndims; i++)
+        array_strides[i] = 1;
+
+    done_start = done_end = ndim = 0;
+    for (i = 0, old = ptr = array_section; i < len+1; i++, ptr++) {
+        if (*ptr == ':' || *ptr == ',' || *ptr == '\0') {
+            if (done_end) {
+                array_strides[ndim] = strtol(old, NULL, 10);
+                if (array_strides[ndim] == 0) array_strides[ndim] = 1;
+                if (array_strides[ndim] < 0) {
+                    fprintf(stderr, "ERROR: negative stride values not"
+                                    " supported.\n");
+                    exit(1);
+                }
+            } else if (done_start) {
+                if (ptr - old > 0) {
+                    array_ends[ndim] = strtol(old, NULL, 10);
+                    if (array_ends[ndim] > 0) array_ends[ndim] -= index_offset;
+                } else
+                    array_ends[ndim] = INT64_MAX;
+                done_end = 1;
+            } else {
+                array_starts[ndim] = strtol(old, NULL, 10);
+                if (array_starts[ndim] > 0) array_starts[ndim] -= index_offset;
+                array_ends[ndim] = array_starts[ndim] + 1;
+                done_start = 1;
+            }
+            old = ptr + 1;
+            if (*ptr == ',') {
+                done_start = done_end = 0;
+                ndim++;
+            }
+        }
+    }
+}
+
+
 char **parse_args(int *argc, char ***argv)
 {
-    char *ptr, *tmp_optarg, **files = NULL;
+    char *tmp_optarg, **files = NULL;
     char **pargv = *argv;
-    int c, i, err, got_include, got_exclude, len;
+    int c, i, err, got_include, got_exclude;
     struct stat statbuf;
     static struct option longopts[] = {
         { "abserr",          optional_argument, NULL, 'a' },
         { "array-blocks",    no_argument,       NULL, 'A' },
         { "no-nblocks",      no_argument,       NULL, 'b' },
         { "block-types",     required_argument, NULL, 'B' },
+        { "error-summary",   no_argument,       NULL, 'e' },
         { "show-errors",     no_argument,       NULL, 'E' },
+        { "first-diff",      no_argument,       NULL, 'f' },
         { "format-float",    required_argument, NULL, 'F' },
+        { "signature",       required_argument, NULL, 'g' },
         { "help",            no_argument,       NULL, 'h' },
         { "no-summary",      no_argument,       NULL, 'i' },
         { "c-indexing",      no_argument,       NULL, 'I' },
         { "just-id",         no_argument,       NULL, 'j' },
+        { "particle-id",     required_argument, NULL, 'k' },
+        { "sketch",          required_argument, NULL, 'K' },
         { "less-verbose",    no_argument,       NULL, 'l' },
+        { "memory-limit",    required_argument, NULL, 'L' },
         { "metadata",        no_argument,       NULL, 'm' },
         { "mesh-blocks",     no_argument,       NULL, 'M' },
+        { "max-reports",     required_argument, NULL, 'n' },
         { "format-int",      required_argument, NULL, 'N' },
+        { "output",          required_argument, NULL, 'o' },
         { "quiet",           no_argument,       NULL, 'q' },
         { "relerr",          optional_argument, NULL, 'r' },
+        { "array-section",   required_argument, NULL, 's' },
         { "format-space",    required_argument, NULL, 'S' },
+        { "threads",         required_argument, NULL, 't' },
+        { "output-type",     required_argument, NULL, 'T' },
+        { "mmap",            no_argument,       NULL, 'u' },
         { "variable",        required_argument, NULL, 'v' },
+        { "write-signature", required_argument, NULL, 'w' },
         { "exclude",         required_argument, NULL, 'x' },
         { "purge-duplicate", no_argument,       NULL, 'p' },
         { "print-types",     no_argument,       NULL, 'P' },
         { "version",         no_argument,       NULL, 'V' },
         { NULL,              0,                 NULL,  0  }
         //{ "debug",           no_argument,       NULL, 'D' },
-        //{ "output",          required_argument, NULL, 'o' },
     };
 
     debug = index_offset = verbose_metadata = 1;
     metadata = ignore_summary = exclude_variables = 0;
     just_id = 0;
-    purge_duplicate = ignore_nblocks = quiet = show_errors = 0;
+    purge_duplicate = ignore_nblocks = quiet = show_errors = use_mmap = 0;
+    error_summary = 0;
+    nthreads = 0;
+    dir_mode = 0;
+    memory_limit = 0;
+    first_diff = 0;
+    max_reports = -1;
+    particle_id = NULL;
+    output_file = NULL;
+    output_type = vtk;
+    write_signature = signature_file = NULL;
+    nsketch = 0;
+    array_section = NULL;
+    array_ndims = 0;
+    array_starts = array_ends = array_strides = NULL;
     array_blocktypes = mesh_blocktypes = 0;
     variable_ids = NULL;
     variable_last_id = NULL;
@@ -406,7 +603,8 @@ char **parse_args(int *argc, char ***argv)
     got_include = got_exclude = 0;
 
     while ((c = getopt_long(*argc, *argv,
-            "a::AbB:EF:hiIjJlmMN:qr::S:v:x:pPV", longopts, NULL)) != -1) {
+            "a::AbB:eEfF:g:hiIjJk:K:lL:mMn:N:o:qr::s:S:t:T:uv:w:x:pPV",
+            longopts, NULL)) != -1) {
         switch (c) {
         case 'a':
             tmp_optarg = optarg;
@@ -430,14 +628,23 @@ char **parse_args(int *argc, char ***argv)
         case 'B':
             parse_range(optarg, &blocktype_list, &nblist, &nblist_max);
             break;
+        case 'e':
+            error_summary = 1;
+            break;
         case 'E':
             show_errors = 1;
             break;
+        case 'f':
+            first_diff = 1;
+            break;
         case 'F':
             free(format_float);
             format_float = malloc(strlen(optarg)+1);
             memcpy(format_float, optarg, strlen(optarg)+1);
             break;
+        case 'g':
+            signature_file = optarg;
+            break;
         case 'h':
             usage(0);
             break;
@@ -450,20 +657,48 @@ char **parse_args(int *argc, char ***argv)
         case 'j':
             just_id = 1;
             break;
+        case 'k':
+            particle_id = optarg;
+            break;
+        case 'K':
+            nsketch = strtol(optarg, NULL, 10);
+            if (nsketch < 0) {
+                fprintf(stderr, "ERROR: invalid sketch size.\n");
+                exit(1);
+            }
+            break;
         case 'l':
             verbose_metadata = 0;
             break;
+        case 'L':
+            memory_limit = strtol(optarg, NULL, 10);
+            if (memory_limit < 1) {
+                fprintf(stderr, "ERROR: invalid memory limit.\n");
+                exit(1);
+            }
+            memory_limit *= 1024 * 1024;
+            break;
         case 'm':
             metadata = 1;
             break;
         case 'M':
             mesh_blocktypes = 1;
             break;
+        case 'n':
+            max_reports = strtol(optarg, NULL, 10);
+            if (max_reports < 0) {
+                fprintf(stderr, "ERROR: invalid number of reports.\n");
+                exit(1);
+            }
+            break;
         case 'N':
             free(format_int);
             format_int = malloc(strlen(optarg)+1);
             memcpy(format_int, optarg, strlen(optarg)+1);
             break;
+        case 'o':
+            output_file = optarg;
+            break;
         case 'p':
             purge_duplicate = 1;
             break;
@@ -486,11 +721,34 @@ char **parse_args(int *argc, char ***argv)
                 exit(0);
             }
             break;
+        case 's':
+            array_section = optarg;
+            break;
         case 'S':
             free(format_space);
             format_space = malloc(strlen(optarg)+1);
             memcpy(format_space, optarg, strlen(optarg)+1);
             break;
+        case 't':
+            nthreads = strtol(optarg, NULL, 10);
+            if (nthreads < 1) {
+                fprintf(stderr, "ERROR: invalid number of threads.\n");
+                exit(1);
+            }
+            break;
+        case 'T':
+            if (!strncmp("vtk", optarg, 4)) {
+                output_type = vtk;
+            } else if (!strncmp("raw", optarg, 4)) {
+                output_type = raw;
+            } else {
+                fprintf(stderr, "ERROR: output type not supported\n");
+                exit(1);
+            }
+            break;
+        case 'u':
+            use_mmap = 1;
+            break;
         case 'V':
             printf("sdfdiff version %s\n", VERSION);
             printf("commit info: %s, %s\n", SDF_COMMIT_ID, SDF_COMMIT_DATE);
@@ -498,6 +756,9 @@ char **parse_args(int *argc, char ***argv)
                    sdf_get_library_commit_id(), sdf_get_library_commit_date());
             exit(0);
             break;
+        case 'w':
+            write_signature = optarg;
+            break;
         case 'v':
         case 'x':
             err = 0;
@@ -533,46 +794,64 @@ char **parse_args(int *argc, char ***argv)
         }
     }
 
-    if ((optind+2) == *argc) {
-        files = calloc(2, sizeof(*files));
-        for (i=0; i<2; i++) {
+    nfiles = *argc - optind;
+    if (write_signature || signature_file) {
+        if (nfiles != 1 || (write_signature && signature_file)) {
+            fprintf(stderr, "Must specify one file and either -w or -g\n");
+            usage(1);
+        }
+        files = calloc(1, sizeof(*files));
+        files[0] = (*argv)[optind];
+        if (stat(files[0], &statbuf)) {
+            fprintf(stderr, "Error opening file %s\n", files[0]);
+            exit(1);
+        }
+    } else if (nfiles >= 2) {
+        files = calloc(nfiles, sizeof(*files));
+        for (i=0; i<nfiles; i++) {
             files[i] = (*argv)[optind+i];
             err = stat(files[i], &statbuf);
             if (err) {
                 fprintf(stderr, "Error opening file %s\n", files[i]);
                 exit(1);
             }
-        }
-        if (S_ISDIR(statbuf.st_mode)) {
-            len = strlen(files[0]);
-            ptr = files[0] + len;
-            for (i = 0; i < len; ++i, --ptr) {
-                if (*ptr == '/') {
-                    ptr++;
-                    break;
+            if (i == 0) {
+                dir_mode = S_ISDIR(statbuf.st_mode);
+            } else if (dir_mode) {
+                if (nfiles != 2 || !S_ISDIR(statbuf.st_mode)) {
+                    fprintf(stderr, "Can only compare a directory with "
+                            "one other directory\n");
+                    exit(1);
                 }
-            }
-            len = strlen(files[1]);
-            for (; len > 0; --len) {
-                if (files[1][len] != '/')
-                    break;
-            }
-
-            files[1] = malloc(len + strlen(ptr) + 2);
-            memcpy(files[1], (*argv)[optind+1], len);
-            if (*(files[1]+len-1) != '/') {
-                *(files[1]+len) = '/';
-                len++;
-            }
-            memcpy(files[1]+len, ptr, strlen(ptr));
-            files[1][len + strlen(ptr)] = '\0';
+            } else if (S_ISDIR(statbuf.st_mode))
+                files[i] = dir_file_path(files[i], files[0]);
         }
     } else {
         files = NULL;
-        fprintf(stderr, "Must specify two files\n");
+        fprintf(stderr, "Must specify at least two files\n");
         usage(1);
     }
 
+    if (output_file && (nfiles != 2 || dir_mode)) {
+        fprintf(stderr, "ERROR: error field output requires two files.\n");
+        exit(1);
+    }
+
+    if (particle_id && nfiles != 2) {
+        fprintf(stderr, "ERROR: particle ID matching requires two files.\n");
+        exit(1);
+    }
+
+    if (array_section) {
+        if (particle_id || output_file) {
+            fprintf(stderr, "ERROR: array sections cannot be used with "
+                    "particle ID matching or error field output.\n");
+            exit(1);
+        }
+        /* Parsed here since the indexing depends on the -I flag */
+        parse_array_section(array_section);
+    }
+
     sort_range(&range_list, &nrange);
     sort_range(&blocktype_list, &nblist);
     setup_blocklist_mask();
@@ -588,12 +867,17 @@ char **parse_args(int *argc, char ***argv)
 
 void free_memory(sdf_file_t **handles)
 {
+    int i;
 
     if (format_int) free(format_int);
     if (format_float) free(format_float);
     if (format_space) free(format_space);
-    sdf_stack_destroy(handles[0]);
-    sdf_stack_destroy(handles[1]);
+    if (array_starts) free(array_starts);
+    if (array_ends) free(array_ends);
+    if (array_strides) free(array_strides);
+    if (!handles) return;
+    for (i = 0; i < nfiles; i++)
+        sdf_stack_destroy(handles[i]);
 }
 
 
@@ -606,10 +890,10 @@ static void print_value(void *data, int datatype)
     switch (datatype) {
     case SDF_DATATYPE_INTEGER4:
         i64 = *((int32_t*)data);
-        printf(format_int, i64);
+        fprintf(out, format_int, i64);
         break;
     case SDF_DATATYPE_INTEGER8:
-        printf(format_int, *((int64_t*)data));
+        fprintf(out, format_int, *((int64_t*)data));
         break;
     case SDF_DATATYPE_REAL4:
         if (special_format) {
@@ -622,11 +906,11 @@ static void print_value(void *data, int datatype)
                 r8 *= pow(10, -1.0 * exponent);
             }
             if (r8 == INFINITY)
-                printf("Infinity");
+                fprintf(out, "Infinity");
             else
-                printf(format_float, r8, exponent);
+                fprintf(out, format_float, r8, exponent);
         } else
-            printf(format_float, *((float*)data));
+            fprintf(out, format_float, *((float*)data));
         break;
     case SDF_DATATYPE_REAL8:
         if (special_format) {
@@ -639,23 +923,23 @@ static void print_value(void *data, int datatype)
                 r8 *= pow(10, -1.0 * exponent);
             }
             if (r8 == INFINITY)
-                printf("Infinity");
+                fprintf(out, "Infinity");
             else
-                printf(format_float, r8, exponent);
+                fprintf(out, format_float, r8, exponent);
         } else
-            printf(format_float, *((double*)data));
+            fprintf(out, format_float, *((double*)data));
         break;
     //case SDF_DATATYPE_REAL16:
-    //    printf(format_float, (double)b->const_value);
+    //    fprintf(out, format_float, (double)b->const_value);
     //    break;
     case SDF_DATATYPE_CHARACTER:
-        printf("%c", *((char*)data));
+        fprintf(out, "%c", *((char*)data));
         break;
     case SDF_DATATYPE_LOGICAL:
         if (*((char*)data))
-            printf("T");
+            fprintf(out, "T");
         else
-            printf("F");
+            fprintf(out, "F");
         break;
     }
 }
@@ -754,9 +1038,9 @@ static void print_metadata_constant(sdf_block_t *b)
     // Metadata is
     // - value     TYPE_SIZE
 
-    printf("%svalue: ", indent);
+    fprintf(out, "%svalue: ", indent);
     print_value(b->const_value, b->datatype);
-    printf("\n");
+    fprintf(out, "\n");
 }
 
 
@@ -1022,13 +1306,13 @@ static void print_metadata_namevalue(sdf_block_t *b)
     case(SDF_DATATYPE_LOGICAL):
         logical = b->data;
         for (i = 0; i < b->ndims; i++) {
-            printf(indent, 1);
-            printf(width_fmt, b->material_names[i]);
+            fprintf(out, indent, 1);
+            fprintf(out, width_fmt, b->material_names[i]);
             if (logical[i])
-                printf("True");
+                fprintf(out, "True");
             else
-                printf("False");
-            printf("\n");
+                fprintf(out, "False");
+            fprintf(out, "\n");
         }
         break;
     case(SDF_DATATYPE_CHARACTER):
@@ -1053,8 +1337,8 @@ static void print_metadata_id(sdf_block_t *b, int inum, int nblocks)
     }
 
     snprintf(fmt, fmtlen, "\nBlock %%%ii", digit);
-    printf(fmt, inum);
-    printf(", ID: %s", b->id);
+    fprintf(out, fmt, inum);
+    fprintf(out, ", ID: %s", b->id);
 }
 
 
@@ -1062,7 +1346,7 @@ static void print_metadata(sdf_block_t *b, int inum, int nblocks)
 {
     print_header();
     print_metadata_id(b, inum, nblocks);
-    printf(" - not in second file\n");
+    fprintf(out, " - not in second file\n");
     if (just_id) return;
 
     sprintf(indent, default_indent, 1);
@@ -1148,7 +1432,7 @@ static void print_metadata(sdf_block_t *b, int inum, int nblocks)
         break;
     }
 
-    printf("\n");
+    fprintf(out, "\n");
 }
 
 
@@ -1157,7 +1441,25 @@ static void print_data(sdf_block_t *b)
     if (!b->done_data)
         fprintf(stderr, "Data not read.\n");
     else
-        fwrite(b->data, 1, b->data_length, stdout);
+        fwrite(b->data, 1, b->data_length, out);
+}
+
+
+static void set_array_section(sdf_block_t *b)
+{
+    if (array_starts)
+        sdf_block_set_array_section(b, array_ndims, array_starts,
+                                    array_ends, array_strides);
+}
+
+
+/* Index in the full array of element n along dimension i of a section */
+static inline int64_t section_index(sdf_block_t *b, int i, int64_t n)
+{
+    if (!array_starts || !b->array_starts)
+        return n;
+
+    return b->array_starts[i] + n * b->array_strides[i];
 }
 
 
@@ -1183,7 +1485,7 @@ void get_index_str(sdf_block_t *b, int64_t n, int *idx, int *fac, char **fmt,
     case SDF_BLOCKTYPE_POINT_MESH:
         i = idx[0];
         str[0] = '(';
-        sprintf(str+1, fmt[i], n + index_offset);
+        sprintf(str+1, fmt[i], section_index(b, i, n) + index_offset);
         len = strlen(str);
         str[len] = ')';
         str[len+1] = '\0';
@@ -1202,7 +1504,7 @@ void get_index_str(sdf_block_t *b, int64_t n, int *idx, int *fac, char **fmt,
     str[1] = '\0';
     for (i = 0; i < b->ndims; i++) {
         len = strlen(str);
-        sprintf(str+len, fmt[i], idx[i] + index_offset);
+        sprintf(str+len, fmt[i], section_index(b, i, idx[i]) + index_offset);
     }
     len = strlen(str);
     str[len] = ')';
@@ -1210,29 +1512,29 @@ void get_index_str(sdf_block_t *b, int64_t n, int *idx, int *fac, char **fmt,
 }
 
 
-void set_header_string(sdf_file_t **handles)
+void set_header_string(char *name1, char *name2)
 {
     int len;
     char *name;
     struct stat st;
-    struct tm *tm;
+    struct tm tm;
     static const int idxlen = 64;
     char prestr[idxlen];
 
     if (done_header)
         return;
 
-    name = handles[0]->filename;
+    name = name1;
     stat(name, &st);
-    tm = localtime(&st.st_mtime);
+    localtime_r(&st.st_mtime, &tm);
     //strftime(prestr, idxlen, "%Y-%m-%d %H:%M:%S.%N %z", tm);
-    strftime(prestr, idxlen, "%Y-%m-%d %H:%M:%S.000000000 %z", tm);
+    strftime(prestr, idxlen, "%Y-%m-%d %H:%M:%S.000000000 %z", &tm);
     snprintf(header_string, HEADER_LEN, "--- %s\t%s\n", name, prestr);
 
-    name = handles[1]->filename;
+    name = name2;
     stat(name, &st);
-    tm = localtime(&st.st_mtime);
-    strftime(prestr, idxlen, "%Y-%m-%d %H:%M:%S.000000000 %z", tm);
+    localtime_r(&st.st_mtime, &tm);
+    strftime(prestr, idxlen, "%Y-%m-%d %H:%M:%S.000000000 %z", &tm);
     len = strlen(header_string);
     snprintf(header_string+len, HEADER_LEN-len, "+++ %s\t%s\n", name, prestr);
 }
@@ -1243,22 +1545,27 @@ static inline void print_header(void)
     if (done_header)
         return;
 
-    printf("%s", header_string);
+    if (defer_header) {
+        header_pending = 1;
+        return;
+    }
+
+    fprintf(out, "%s", header_string);
     done_header = 1;
 }
 
 
 #define PRINT_DIFF(v1, v2, format) do { \
     get_index_str(b, n, idx, fac, fmt, idxstr); \
-    printf("-%s%s: ", prestr, idxstr); \
-    printf(format, (v1)); \
-    printf("\n"); \
-    printf("+%s%s: ", prestr, idxstr); \
-    printf(format, (v2)); \
-    printf("\n"); \
+    fprintf(out, "-%s%s: ", prestr, idxstr); \
+    fprintf(out, format, (v1)); \
+    fprintf(out, "\n"); \
+    fprintf(out, "+%s%s: ", prestr, idxstr); \
+    fprintf(out, format, (v2)); \
+    fprintf(out, "\n"); \
     if (show_errors) \
-        printf(" Error absolute %25.17e, relative %25.17e\n", \
-               abserr_val, relerr_val); \
+        fprintf(out, " Error absolute %25.17e, relative %25.17e\n", \
+                abserr_val, relerr_val); \
 } while(0)
 
 
@@ -1278,16 +1585,18 @@ static inline void print_header(void)
         /* If we got here then the numbers differ */ \
         print_header(); \
         gotdiff = 1; \
+        stop_diff = first_diff; \
         if (!quiet) { \
             if (!gotblock) { \
                 gotblock = 1; \
                 print_metadata_id(b, inum, handles[0]->nblocks); \
-                printf("\n"); \
+                fprintf(out, "\n"); \
             } \
-            if (!just_id) { \
+            if (!just_id && (max_reports < 0 || nreports < max_reports)) { \
                 PRINT_DIFF(pv1, pv2, format); \
             } \
         } \
+        nreports++; \
         if (relerr_val > relerr_max) relerr_max = relerr_val; \
         if (abserr_val > abserr_max) abserr_max = abserr_val; \
     } \
@@ -1302,16 +1611,18 @@ static inline void print_header(void)
         abserr_val = abserr_max = relerr_val = relerr_max = 1.0; \
         print_header(); \
         gotdiff = 1; \
+        stop_diff = first_diff; \
         if (!quiet) { \
             if (!gotblock) { \
                 gotblock = 1; \
                 print_metadata_id(b, inum, handles[0]->nblocks); \
-                printf("\n"); \
+                fprintf(out, "\n"); \
             } \
-            if (!just_id) { \
+            if (!just_id && (max_reports < 0 || nreports < max_reports)) { \
                 PRINT_DIFF(pv1, pv2, format); \
             } \
         } \
+        nreports++; \
     } \
 } while(0)
 
@@ -1327,29 +1638,181 @@ static inline void print_header(void)
     default: \
         return gotdiff; \
     } \
-\
-    sdf_helper_read_data(handles[0], b1); \
-    sdf_helper_read_data(handles[1], b2); \
 \
     gotblock = 0; \
     abserr_max = relerr_max = 0.0; \
 } while(0)
 
 
+#define DIFF_READ() do { \
+    sdf_helper_read_data(handles[0], b1); \
+    sdf_helper_read_data(handles[1], b2); \
+} while(0)
+
+
 #define DIFF_PRINT_MAX_ERROR() do { \
     if (!quiet && gotblock) { \
         print_header(); \
         if (!gotblock) { \
             print_metadata_id(b, inum, handles[0]->nblocks); \
-            printf("\n"); \
+            fprintf(out, "\n"); \
         } \
-        printf("Max error absolute %25.17e, relative %25.17e\n", \
-               abserr_max, relerr_max); \
+        fprintf(out, "Max error absolute %25.17e, relative %25.17e\n", \
+                abserr_max, relerr_max); \
     } \
 } while(0)
 
 
-int diff_plain(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
+/*
+ * When the file has been mmap'ed and the data on disk is already in the form
+ * that we want to compare, the comparison can read directly from the
+ * mapping. Otherwise the data must be read in by the library.
+ */
+static int can_map_block(sdf_file_t *h, sdf_block_t *b, int64_t nelements)
+{
+    if (!use_mmap || !h->mmap || h->swap || array_starts)
+        return 0;
+
+    if (b->datatype_out != b->datatype)
+        return 0;
+
+    if (b->data_length != nelements * SDF_TYPE_SIZES[b->datatype])
+        return 0;
+
+    return 1;
+}
+
+
+static void *get_block_data(sdf_file_t *h, sdf_block_t *b)
+{
+    int64_t nelements = 1;
+    int i;
+
+    for (i = 0; i < b->ndims; i++)
+        nelements *= b->dims[i];
+
+    if (can_map_block(h, b, nelements)) {
+        /* This is what a serial read would have set up */
+        for (i = 0; i < b->ndims; i++)
+            b->local_dims[i] = b->dims[i];
+        b->nelements_local = nelements;
+        return h->mmap + b->data_location;
+    }
+
+    set_array_section(b);
+    sdf_helper_read_data(h, b);
+    return b->data;
+}
+
+
+static void *get_grid_data(sdf_file_t *h, sdf_block_t *b, int idim)
+{
+    int64_t nelements = 1, total = 0, offset = 0;
+    int i;
+
+    for (i = 0; i < b->ndims; i++)
+        nelements *= b->dims[i];
+
+    switch (b->blocktype) {
+    case SDF_BLOCKTYPE_PLAIN_MESH:
+        for (i = 0; i < b->ndims; i++) {
+            if (i == idim) offset = total;
+            total += b->dims[i];
+        }
+        break;
+    case SDF_BLOCKTYPE_POINT_MESH:
+        total = b->ndims * b->dims[0];
+        offset = idim * b->dims[0];
+        break;
+    case SDF_BLOCKTYPE_LAGRANGIAN_MESH:
+        total = b->ndims * nelements;
+        offset = idim * nelements;
+        break;
+    }
+
+    if (total && can_map_block(h, b, total)) {
+        for (i = 0; i < b->ndims; i++)
+            b->local_dims[i] = b->dims[i];
+        return h->mmap + b->data_location
+                + offset * SDF_TYPE_SIZES[b->datatype];
+    }
+
+    if (!b->done_data) {
+        set_array_section(b);
+        sdf_helper_read_data(h, b);
+    }
+
+    return b->grids[idim];
+}
+
+
+/*
+ * Get the data for a block as a list of contiguous arrays. Meshes have one
+ * array per dimension, everything else has a single array. Returns the
+ * number of arrays, or zero if the block has no data that can be compared.
+ */
+static int get_block_arrays(sdf_file_t *h, sdf_block_t *b, void **data,
+                            int64_t *nelements)
+{
+    int64_t total, *dims;
+    int i;
+
+    switch (b->datatype) {
+    case(SDF_DATATYPE_INTEGER4):
+    case(SDF_DATATYPE_INTEGER8):
+    case(SDF_DATATYPE_REAL4):
+    case(SDF_DATATYPE_REAL8):
+    case(SDF_DATATYPE_LOGICAL):
+        break;
+    default:
+        return 0;
+    }
+
+    switch (b->blocktype) {
+    case SDF_BLOCKTYPE_PLAIN_DERIVED:
+    case SDF_BLOCKTYPE_PLAIN_VARIABLE:
+    case SDF_BLOCKTYPE_POINT_DERIVED:
+    case SDF_BLOCKTYPE_POINT_VARIABLE:
+    case SDF_BLOCKTYPE_ARRAY:
+        data[0] = get_block_data(h, b);
+        nelements[0] = b->nelements_local;
+        return 1;
+    case SDF_BLOCKTYPE_PLAIN_MESH:
+    case SDF_BLOCKTYPE_POINT_MESH:
+    case SDF_BLOCKTYPE_LAGRANGIAN_MESH:
+        for (i = 0; i < b->ndims; i++)
+            data[i] = get_grid_data(h, b, i);
+        /* A section changes the size of the arrays that were read */
+        dims = array_starts ? b->local_dims : b->dims;
+        total = 1;
+        for (i = 0; i < b->ndims; i++)
+            total *= dims[i];
+        for (i = 0; i < b->ndims; i++) {
+            if (b->blocktype == SDF_BLOCKTYPE_POINT_MESH)
+                nelements[i] = dims[0];
+            else if (b->blocktype == SDF_BLOCKTYPE_LAGRANGIAN_MESH)
+                nelements[i] = total;
+            else
+                nelements[i] = dims[i];
+        }
+        return b->ndims;
+    case SDF_BLOCKTYPE_CONSTANT:
+        data[0] = b->const_value;
+        nelements[0] = 1;
+        return 1;
+    case SDF_BLOCKTYPE_NAMEVALUE:
+        sdf_helper_read_data(h, b);
+        data[0] = b->data;
+        nelements[0] = b->ndims;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+
+static int diff_plain_data(sdf_file_t **handles, sdf_block_t *b1,
+                           sdf_block_t *b2, int inum, void *data1, void *data2)
 {
     int32_t *i4_1, *i4_2;
     int64_t *i8_1, *i8_2;
@@ -1388,6 +1851,7 @@ int diff_plain(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
         left = b->local_dims[i];
         fac[i] = rem;
         rem *= left;
+        if (array_starts) left = b->dims[i];
         digit = 0;
         while (left) {
             left /= 10;
@@ -1407,41 +1871,41 @@ int diff_plain(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
 
     switch (b->datatype) {
     case(SDF_DATATYPE_INTEGER4):
-        i4_1 = b1->data;
-        i4_2 = b2->data;
-        for (n = 0; n < b->nelements_local; n++) {
+        i4_1 = data1;
+        i4_2 = data2;
+        for (n = 0; n < b->nelements_local && !stop_diff; n++) {
             ival1 = i4_1[n];
             ival2 = i4_2[n];
             DIFF(ival1, ival2, ival1, ival2, format_int);
         }
         break;
     case(SDF_DATATYPE_INTEGER8):
-        i8_1 = b1->data;
-        i8_2 = b2->data;
-        for (n = 0; n < b->nelements_local; n++) {
+        i8_1 = data1;
+        i8_2 = data2;
+        for (n = 0; n < b->nelements_local && !stop_diff; n++) {
             ival1 = i8_1[n];
             ival2 = i8_2[n];
             DIFF(ival1, ival2, ival1, ival2, format_int);
         }
         break;
     case(SDF_DATATYPE_REAL4):
-        r4_1 = b1->data;
-        r4_2 = b2->data;
-        for (n = 0; n < b->nelements_local; n++) {
+        r4_1 = data1;
+        r4_2 = data2;
+        for (n = 0; n < b->nelements_local && !stop_diff; n++) {
             DIFF(r4_1[n], r4_2[n], val1, val2, format_float);
         }
         break;
     case(SDF_DATATYPE_REAL8):
-        r8_1 = b1->data;
-        r8_2 = b2->data;
-        for (n = 0; n < b->nelements_local; n++) {
+        r8_1 = data1;
+        r8_2 = data2;
+        for (n = 0; n < b->nelements_local && !stop_diff; n++) {
             DIFF(r8_1[n], r8_2[n], val1, val2, format_float);
         }
         break;
     case(SDF_DATATYPE_LOGICAL):
-        l_1 = b1->data;
-        l_2 = b2->data;
-        for (n = 0; n < b->nelements_local; n++) {
+        l_1 = data1;
+        l_2 = data2;
+        for (n = 0; n < b->nelements_local && !stop_diff; n++) {
             LDIFF(l_1[n], l_2[n], clogical[i1], clogical[i2], "%c");
         }
         break;
@@ -1458,7 +1922,22 @@ int diff_plain(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
 }
 
 
-int diff_mesh(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
+int diff_plain(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
+{
+    void *data1[SDF_MAXDIMS], *data2[SDF_MAXDIMS];
+    int64_t nelements[SDF_MAXDIMS];
+
+    if (!get_block_arrays(handles[0], b1, data1, nelements))
+        return 0;
+    get_block_arrays(handles[1], b2, data2, nelements);
+
+    return diff_plain_data(handles, b1, b2, inum, data1[0], data2[0]);
+}
+
+
+static int diff_mesh_data(sdf_file_t **handles, sdf_block_t *b1,
+                          sdf_block_t *b2, int inum, void **grids1,
+                          void **grids2, int64_t *nelements)
 {
     int32_t *i4_1, *i4_2;
     int64_t *i8_1, *i8_2;
@@ -1467,7 +1946,7 @@ int diff_mesh(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
     double val1, val2;
     int64_t ival1, ival2;
     int gotblock;
-    static int gotdiff = 0;
+    int gotdiff = 0;
     static const int fmtlen = 32;
     static const int idxlen = 64;
     char idxstr[idxlen];
@@ -1491,7 +1970,8 @@ int diff_mesh(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
 
     for (i = 0; i < b->ndims; i++) {
         fac[i] = 1;
-        left = b->local_dims[i] + index_offset - 1;
+        left = (array_starts ? b->dims[i] : b->local_dims[i])
+                + index_offset - 1;
         digit = 0;
         while (left) {
             left /= 10;
@@ -1517,9 +1997,9 @@ int diff_mesh(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
         for (i = 0; i < b->ndims; i++) {
             prestr = prestr_dim[i];
             idx[0] = i;
-            i4_1 = ((int32_t**)b1->grids)[i];
-            i4_2 = ((int32_t**)b2->grids)[i];
-            for (n = 0; n < b->dims[i]; n++) {
+            i4_1 = grids1[i];
+            i4_2 = grids2[i];
+            for (n = 0; n < nelements[i] && !stop_diff; n++) {
                 ival1 = i4_1[n];
                 ival2 = i4_2[n];
                 DIFF(ival1, ival2, ival1, ival2, format_int);
@@ -1530,9 +2010,9 @@ int diff_mesh(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
         for (i = 0; i < b->ndims; i++) {
             prestr = prestr_dim[i];
             idx[0] = i;
-            i8_1 = ((int64_t**)b1->grids)[i];
-            i8_2 = ((int64_t**)b2->grids)[i];
-            for (n = 0; n < b->dims[i]; n++) {
+            i8_1 = grids1[i];
+            i8_2 = grids2[i];
+            for (n = 0; n < nelements[i] && !stop_diff; n++) {
                 ival1 = i8_1[n];
                 ival2 = i8_2[n];
                 DIFF(ival1, ival2, ival1, ival2, format_int);
@@ -1543,9 +2023,9 @@ int diff_mesh(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
         for (i = 0; i < b->ndims; i++) {
             prestr = prestr_dim[i];
             idx[0] = i;
-            r4_1 = ((float**)b1->grids)[i];
-            r4_2 = ((float**)b2->grids)[i];
-            for (n = 0; n < b->dims[i]; n++) {
+            r4_1 = grids1[i];
+            r4_2 = grids2[i];
+            for (n = 0; n < nelements[i] && !stop_diff; n++) {
                 DIFF(r4_1[n], r4_2[n], val1, val2, format_float);
             }
         }
@@ -1554,9 +2034,9 @@ int diff_mesh(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
         for (i = 0; i < b->ndims; i++) {
             prestr = prestr_dim[i];
             idx[0] = i;
-            r8_1 = ((double**)b1->grids)[i];
-            r8_2 = ((double**)b2->grids)[i];
-            for (n = 0; n < b->dims[i]; n++) {
+            r8_1 = grids1[i];
+            r8_2 = grids2[i];
+            for (n = 0; n < nelements[i] && !stop_diff; n++) {
                 DIFF(r8_1[n], r8_2[n], val1, val2, format_float);
             }
         }
@@ -1574,6 +2054,19 @@ int diff_mesh(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
 }
 
 
+int diff_mesh(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
+{
+    void *grids1[SDF_MAXDIMS], *grids2[SDF_MAXDIMS];
+    int64_t nelements[SDF_MAXDIMS];
+
+    if (!get_block_arrays(handles[0], b1, grids1, nelements))
+        return 0;
+    get_block_arrays(handles[1], b2, grids2, nelements);
+
+    return diff_mesh_data(handles, b1, b2, inum, grids1, grids2, nelements);
+}
+
+
 int diff_constant(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2,
                   int inum)
 {
@@ -1586,7 +2079,7 @@ int diff_constant(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2,
     int i1, i2;
     char clogical[2] = {'F', 'T'};
     int gotblock;
-    static int gotdiff = 0;
+    int gotdiff = 0;
     char idxstr[1] = {'\0'};
     char *prestr;
     sdf_block_t *b = b1;
@@ -1596,6 +2089,7 @@ int diff_constant(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2,
     char **fmt = NULL;
 
     DIFF_PREAMBLE();
+    DIFF_READ();
 
     prestr = b->id;
 
@@ -1649,7 +2143,7 @@ int diff_namevalue(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2,
     char clogical[2] = {'F', 'T'};
     char *l_1, *l_2;
     int gotblock;
-    static int gotdiff = 0;
+    int gotdiff = 0;
     char idxstr[1] = {'\0'};
     char *prestr;
     sdf_block_t *b = b1;
@@ -1659,12 +2153,13 @@ int diff_namevalue(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2,
     char **fmt = NULL;
 
     DIFF_PREAMBLE();
+    DIFF_READ();
 
     switch (b->datatype) {
     case(SDF_DATATYPE_INTEGER4):
         i4_1 = b1->data;
         i4_2 = b2->data;
-        for (n = 0; n < b->ndims; n++) {
+        for (n = 0; n < b->ndims && !stop_diff; n++) {
             prestr = b->material_names[n];
             ival1 = i4_1[n];
             ival2 = i4_2[n];
@@ -1674,7 +2169,7 @@ int diff_namevalue(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2,
     case(SDF_DATATYPE_INTEGER8):
         i8_1 = b1->data;
         i8_2 = b2->data;
-        for (n = 0; n < b->ndims; n++) {
+        for (n = 0; n < b->ndims && !stop_diff; n++) {
             prestr = b->material_names[n];
             ival1 = i8_1[n];
             ival2 = i8_2[n];
@@ -1684,7 +2179,7 @@ int diff_namevalue(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2,
     case(SDF_DATATYPE_REAL4):
         r4_1 = b1->data;
         r4_2 = b2->data;
-        for (n = 0; n < b->ndims; n++) {
+        for (n = 0; n < b->ndims && !stop_diff; n++) {
             prestr = b->material_names[n];
             DIFF(r4_1[n], r4_2[n], val1, val2, format_float);
         }
@@ -1692,7 +2187,7 @@ int diff_namevalue(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2,
     case(SDF_DATATYPE_REAL8):
         r8_1 = b1->data;
         r8_2 = b2->data;
-        for (n = 0; n < b->ndims; n++) {
+        for (n = 0; n < b->ndims && !stop_diff; n++) {
             prestr = b->material_names[n];
             DIFF(r8_1[n], r8_2[n], val1, val2, format_float);
         }
@@ -1700,7 +2195,7 @@ int diff_namevalue(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2,
     case(SDF_DATATYPE_LOGICAL):
         l_1 = b1->data;
         l_2 = b2->data;
-        for (n = 0; n < b->ndims; n++) {
+        for (n = 0; n < b->ndims && !stop_diff; n++) {
             prestr = b->material_names[n];
             LDIFF(l_1[n], l_2[n], clogical[i1], clogical[i2], "%c");
         }
@@ -1713,54 +2208,1004 @@ int diff_namevalue(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2,
 }
 
 
-int diff_block(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
+/*
+ * Error statistics for the summary report.
+ *
+ * Relative errors are binned by decade. Bin 0 holds exact matches, bin 1
+ * holds errors below 10^DIFF_HIST_MIN and the last bin holds errors of 1 or
+ * more.
+ */
+
+#define DIFF_HIST_MIN (-16)
+#define DIFF_HIST_LEN (3 - DIFF_HIST_MIN)
+
+struct diff_stats {
+    int64_t nelements, nviolations;
+    double l1, l2, linf, relerr_max, ulp_sum;
+    uint64_t ulp_max;
+    int64_t hist[DIFF_HIST_LEN];
+};
+
+static double decades[DIFF_HIST_LEN];
+
+
+/* Fill in the histogram bin edges. Must be called before any threads are
+ * started since the table is shared by all of them */
+static void diff_stats_setup(void)
 {
-    int i, gotdiff = 0;
+    int i;
 
-    /* Sanity check */
-    if (b1->blocktype != b2->blocktype) gotdiff = 1;
-    if (b1->datatype != b2->datatype) gotdiff = 1;
-    if (b1->ndims != b2->ndims) gotdiff = 1;
+    for (i = 0; i < DIFF_HIST_LEN; i++)
+        decades[i] = pow(10.0, DIFF_HIST_MIN + i - 2);
+}
 
-    switch (b1->blocktype) {
-    case SDF_BLOCKTYPE_PLAIN_DERIVED:
-    case SDF_BLOCKTYPE_PLAIN_VARIABLE:
-    case SDF_BLOCKTYPE_POINT_DERIVED:
-    case SDF_BLOCKTYPE_POINT_VARIABLE:
-    case SDF_BLOCKTYPE_ARRAY:
-    case SDF_BLOCKTYPE_LAGRANGIAN_MESH:
-    case SDF_BLOCKTYPE_PLAIN_MESH:
-    case SDF_BLOCKTYPE_POINT_MESH:
-        for (i = 0; i < b1->ndims; i++) {
-            if (b1->dims[i] == b2->dims[i])
-                continue;
-            gotdiff = 1;
-        }
-        break;
-    default:
-        break;
-    }
 
-    if (gotdiff && !quiet) {
-        print_header();
-        print_metadata_id(b1, inum, handles[0]->nblocks);
-        printf(" - mismatched\n");
-        return gotdiff;
-    }
+static void diff_stats_init(struct diff_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+}
 
-    switch (b1->blocktype) {
-    case SDF_BLOCKTYPE_PLAIN_DERIVED:
-    case SDF_BLOCKTYPE_PLAIN_VARIABLE:
-    case SDF_BLOCKTYPE_POINT_DERIVED:
-    case SDF_BLOCKTYPE_POINT_VARIABLE:
-    case SDF_BLOCKTYPE_ARRAY:
-        return diff_plain(handles, b1, b2, inum);
-        break;
-    case SDF_BLOCKTYPE_CONSTANT:
-        return diff_constant(handles, b1, b2, inum);
-        break;
-    case SDF_BLOCKTYPE_NAMEVALUE:
-        return diff_namevalue(handles, b1, b2, inum);
+
+static inline int diff_hist_bin(double relerr_val)
+{
+    int e, bin;
+
+    if (relerr_val <= 0.0)
+        return 0;
+    if (relerr_val >= 1.0)
+        return DIFF_HIST_LEN - 1;
+
+    /* Estimate the decade from the binary exponent, then correct it */
+    frexp(relerr_val, &e);
+    bin = (int)floor((e - 1) * 0.30102999566398120) - DIFF_HIST_MIN + 2;
+    if (bin < 2) bin = 2;
+    if (bin > DIFF_HIST_LEN - 2) bin = DIFF_HIST_LEN - 2;
+    if (relerr_val < decades[bin]) bin--;
+    else if (bin < DIFF_HIST_LEN - 2 && relerr_val >= decades[bin+1]) bin++;
+
+    return bin;
+}
+
+
+/*
+ * Map the bit pattern of a floating point value onto an unsigned integer
+ * with the same ordering, so that the distance in ULPs is a subtraction.
+ */
+static inline uint64_t ordered_r4(float v)
+{
+    uint32_t u;
+    memcpy(&u, &v, sizeof(u));
+    if (u & UINT32_C(0x80000000))
+        return UINT64_C(0x80000000) - (u & UINT32_C(0x7fffffff));
+    return UINT64_C(0x80000000) + u;
+}
+
+
+static inline uint64_t ordered_r8(double v)
+{
+    uint64_t u;
+    memcpy(&u, &v, sizeof(u));
+    if (u >> 63)
+        return (UINT64_C(1) << 63) - (u & ~(UINT64_C(1) << 63));
+    return (UINT64_C(1) << 63) + u;
+}
+
+
+#define ULP_DIST(u1, u2) ((u1) > (u2) ? (u1) - (u2) : (u2) - (u1))
+
+
+#define DIFF_STATS_LOOP(type, ulp) do { \
+    const type *_p1 = data1, *_p2 = data2; \
+    for (n = 0; n < nelements; n++) { \
+        val1 = _p1[n]; \
+        val2 = _p2[n]; \
+        denom = MIN(ABS(val1), ABS(val2)); \
+        abserr_val = ABS(val1 - val2); \
+        if (denom < DBL_MIN) \
+            relerr_val = (abserr_val < DBL_MIN) ? 0 : 1; \
+        else \
+            relerr_val = abserr_val / denom; \
+        ulp_val = (ulp); \
+        l1 += abserr_val; \
+        l2 += abserr_val * abserr_val; \
+        if (abserr_val > linf) linf = abserr_val; \
+        if (relerr_val > relerr_max) relerr_max = relerr_val; \
+        if (ulp_val > ulp_max) ulp_max = ulp_val; \
+        ulp_sum += ulp_val; \
+        if (relerr_val >= relerr || abserr_val >= abserr) nviolations++; \
+        st->hist[diff_hist_bin(relerr_val)]++; \
+    } \
+} while(0)
+
+
+/*
+ * Accumulate the error statistics for 'nelements' values in a single pass.
+ * The running sums are kept in locals so that the compiler can keep them in
+ * registers.
+ */
+static void diff_stats_add(struct diff_stats *st, int datatype, void *data1,
+                           void *data2, int64_t nelements)
+{
+    double val1, val2, denom, abserr_val, relerr_val;
+    double l1 = 0, l2 = 0, linf = st->linf, relerr_max = st->relerr_max;
+    double ulp_sum = 0;
+    uint64_t ulp_val, ulp_max = st->ulp_max;
+    int64_t n, nviolations = 0, d;
+
+    switch (datatype) {
+    case SDF_DATATYPE_INTEGER4:
+        DIFF_STATS_LOOP(int32_t, (uint64_t)ABS(_p1[n] - (int64_t)_p2[n]));
+        break;
+    case SDF_DATATYPE_INTEGER8:
+        DIFF_STATS_LOOP(int64_t,
+            (d = _p1[n] - _p2[n], (uint64_t)(d < 0 ? -d : d)));
+        break;
+    case SDF_DATATYPE_REAL4:
+        DIFF_STATS_LOOP(float,
+            ULP_DIST(ordered_r4(_p1[n]), ordered_r4(_p2[n])));
+        break;
+    case SDF_DATATYPE_REAL8:
+        DIFF_STATS_LOOP(double,
+            ULP_DIST(ordered_r8(_p1[n]), ordered_r8(_p2[n])));
+        break;
+    case SDF_DATATYPE_LOGICAL:
+        DIFF_STATS_LOOP(char, (uint64_t)(!_p1[n] != !_p2[n]));
+        break;
+    default:
+        return;
+    }
+
+    st->nelements += nelements;
+    st->nviolations += nviolations;
+    st->l1 += l1;
+    st->l2 += l2;
+    st->linf = linf;
+    st->relerr_max = relerr_max;
+    st->ulp_sum += ulp_sum;
+    st->ulp_max = ulp_max;
+}
+
+
+static void print_summary_header(void)
+{
+    if (done_summary_header)
+        return;
+
+    if (defer_header) {
+        summary_header_pending = 1;
+        return;
+    }
+
+    print_header();
+    fprintf(out, "%6s %12s %12s %11s %11s %11s %11s %11s %11s %11s  %s\n",
+            "Block", "Elements", "Violations", "L1", "L2", "Linf", "RMS",
+            "Max_rel", "Max_ulp", "Mean_ulp", "ID");
+    done_summary_header = 1;
+}
+
+
+static void print_summary(sdf_block_t *b, int inum, struct diff_stats *st)
+{
+    int i;
+    double rms = 0, ulp_mean = 0;
+
+    if (quiet)
+        return;
+
+    print_summary_header();
+
+    if (st->nelements > 0) {
+        rms = sqrt(st->l2 / st->nelements);
+        ulp_mean = st->ulp_sum / st->nelements;
+    }
+
+    fprintf(out, "%6i %12" PRIi64 " %12" PRIi64
+            " %11.4e %11.4e %11.4e %11.4e %11.4e %11.4e %11.4e  %s\n",
+            inum, st->nelements, st->nviolations, st->l1, sqrt(st->l2),
+            st->linf, rms, st->relerr_max, (double)st->ulp_max, ulp_mean,
+            b->id);
+
+    if (st->hist[0] == st->nelements)
+        return;
+
+    fprintf(out, "%6s hist(rel):", "");
+    if (st->hist[0]) fprintf(out, " 0:%" PRIi64, st->hist[0]);
+    if (st->hist[1])
+        fprintf(out, " <1e%i:%" PRIi64, DIFF_HIST_MIN, st->hist[1]);
+    for (i = 2; i < DIFF_HIST_LEN - 1; i++) {
+        if (st->hist[i])
+            fprintf(out, " 1e%i:%" PRIi64, DIFF_HIST_MIN + i - 2, st->hist[i]);
+    }
+    if (st->hist[i]) fprintf(out, " >=1:%" PRIi64, st->hist[i]);
+    fprintf(out, "\n");
+}
+
+
+static int diff_summary_data(sdf_block_t *b, int inum, int narrays,
+                             void **data1, void **data2, int64_t *nelements)
+{
+    struct diff_stats st;
+    int i;
+
+    diff_stats_init(&st);
+    for (i = 0; i < narrays; i++)
+        diff_stats_add(&st, b->datatype, data1[i], data2[i], nelements[i]);
+
+    print_summary(b, inum, &st);
+
+    return (st.nviolations > 0);
+}
+
+
+int diff_summary(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2,
+                 int inum)
+{
+    void *data1[SDF_MAXDIMS], *data2[SDF_MAXDIMS];
+    int64_t nelements[SDF_MAXDIMS];
+    int narrays;
+
+    narrays = get_block_arrays(handles[0], b1, data1, nelements);
+    if (!narrays)
+        return 0;
+    get_block_arrays(handles[1], b2, data2, nelements);
+
+    return diff_summary_data(b1, inum, narrays, data1, data2, nelements);
+}
+
+
+static int blocks_mismatched(sdf_block_t *b1, sdf_block_t *b2)
+{
+    int i;
+
+    if (b1->blocktype != b2->blocktype) return 1;
+    if (b1->datatype != b2->datatype) return 1;
+    if (b1->ndims != b2->ndims) return 1;
+
+    switch (b1->blocktype) {
+    case SDF_BLOCKTYPE_PLAIN_DERIVED:
+    case SDF_BLOCKTYPE_PLAIN_VARIABLE:
+    case SDF_BLOCKTYPE_POINT_DERIVED:
+    case SDF_BLOCKTYPE_POINT_VARIABLE:
+    case SDF_BLOCKTYPE_ARRAY:
+    case SDF_BLOCKTYPE_LAGRANGIAN_MESH:
+    case SDF_BLOCKTYPE_PLAIN_MESH:
+    case SDF_BLOCKTYPE_POINT_MESH:
+        for (i = 0; i < b1->ndims; i++) {
+            if (b1->dims[i] != b2->dims[i])
+                return 1;
+        }
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Particle ID matching.
+ *
+ * For each species, the particle IDs of the second file are inserted into an
+ * open addressing hash table which is then probed with the IDs of the first
+ * file. This gives, for each particle in the first file, the index of the
+ * same particle in the second file. Both stages are split across threads.
+ * The table holds indices rather than IDs, so the memory needed is of the
+ * same order as the ID arrays. Point data is then compared after gathering
+ * the values from the second file into the order of the first.
+ */
+
+struct id_join {
+    char *mesh_id;
+    sdf_block_t *b1, *b2;
+    int64_t n1, n2, nunmatched1, nunmatched2;
+    int64_t *match;
+    int done;
+    struct id_join *next;
+};
+
+static __thread struct id_join *id_joins;
+
+struct join_thread {
+    struct id_join *j;
+    void *id1, *id2;
+    int64_t *table;
+    uint64_t mask;
+    int64_t start, end, nmatched;
+};
+
+
+static inline int64_t id_value(void *ids, int datatype, int64_t i)
+{
+    if (datatype == SDF_DATATYPE_INTEGER4)
+        return ((int32_t *)ids)[i];
+    return ((int64_t *)ids)[i];
+}
+
+
+static inline uint64_t id_hash(int64_t id)
+{
+    uint64_t x = id;
+
+    x ^= x >> 33;
+    x *= UINT64_C(0xff51afd7ed558ccd);
+    x ^= x >> 33;
+    x *= UINT64_C(0xc4ceb9fe1a85ec53);
+    x ^= x >> 33;
+
+    return x;
+}
+
+
+/* Table slots hold the index into the second ID array plus one */
+static void *join_insert(void *arg)
+{
+    struct join_thread *t = arg;
+    int datatype = t->j->b2->datatype;
+    int64_t i, id, cur;
+    uint64_t slot;
+
+    for (i = t->start; i < t->end; i++) {
+        id = id_value(t->id2, datatype, i);
+        slot = id_hash(id) & t->mask;
+        while (1) {
+            cur = __atomic_load_n(&t->table[slot], __ATOMIC_ACQUIRE);
+            if (!cur) {
+                if (__sync_bool_compare_and_swap(&t->table[slot], 0, i + 1))
+                    break;
+                cur = __atomic_load_n(&t->table[slot], __ATOMIC_ACQUIRE);
+            }
+            /* Duplicated IDs keep whichever entry got there first */
+            if (id_value(t->id2, datatype, cur - 1) == id)
+                break;
+            slot = (slot + 1) & t->mask;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void *join_probe(void *arg)
+{
+    struct join_thread *t = arg;
+    int datatype1 = t->j->b1->datatype, datatype2 = t->j->b2->datatype;
+    int64_t i, id, cur;
+    uint64_t slot;
+
+    for (i = t->start; i < t->end; i++) {
+        id = id_value(t->id1, datatype1, i);
+        t->j->match[i] = -1;
+        slot = id_hash(id) & t->mask;
+        while ((cur = t->table[slot])) {
+            if (id_value(t->id2, datatype2, cur - 1) == id) {
+                t->j->match[i] = cur - 1;
+                t->nmatched++;
+                break;
+            }
+            slot = (slot + 1) & t->mask;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void run_join_threads(struct join_thread *t, int nthr, int64_t n,
+                             void *(*fn)(void *))
+{
+    pthread_t *threads;
+    int i;
+
+    threads = malloc(nthr * sizeof(*threads));
+    for (i = 0; i < nthr; i++) {
+        t[i].start = n * i / nthr;
+        t[i].end = n * (i + 1) / nthr;
+        pthread_create(&threads[i], NULL, fn, &t[i]);
+    }
+    for (i = 0; i < nthr; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+
+static void build_id_join(sdf_file_t **handles, struct id_join *j)
+{
+    struct join_thread *t;
+    void *id1, *id2;
+    int64_t *table, nmatched = 0;
+    uint64_t size = 2;
+    int i, nthr;
+
+    j->done = 1;
+    id1 = get_block_data(handles[0], j->b1);
+    id2 = get_block_data(handles[1], j->b2);
+    j->n1 = j->b1->nelements_local;
+    j->n2 = j->b2->nelements_local;
+
+    while (size < 2 * (uint64_t)j->n2)
+        size <<= 1;
+    table = calloc(size, sizeof(*table));
+    j->match = malloc((j->n1 ? j->n1 : 1) * sizeof(*j->match));
+
+    nthr = nthreads;
+    if (nthr < 1) nthr = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthr < 1) nthr = 1;
+
+    t = calloc(nthr, sizeof(*t));
+    for (i = 0; i < nthr; i++) {
+        t[i].j = j;
+        t[i].id1 = id1;
+        t[i].id2 = id2;
+        t[i].table = table;
+        t[i].mask = size - 1;
+    }
+
+    run_join_threads(t, nthr, j->n2, join_insert);
+    run_join_threads(t, nthr, j->n1, join_probe);
+
+    for (i = 0; i < nthr; i++)
+        nmatched += t[i].nmatched;
+    j->nunmatched1 = j->n1 - nmatched;
+    j->nunmatched2 = j->n2 - nmatched;
+
+    free(t);
+    free(table);
+
+    if (j->b1->done_data) sdf_free_block_data(handles[0], j->b1);
+    if (j->b2->done_data) sdf_free_block_data(handles[1], j->b2);
+
+    if (!quiet && (j->nunmatched1 || j->nunmatched2)) {
+        print_header();
+        fprintf(out, "\nParticle IDs for %s: %" PRIi64 " only in first file, %"
+                PRIi64 " only in second file\n", j->mesh_id, j->nunmatched1,
+                j->nunmatched2);
+    }
+}
+
+
+static void setup_id_joins(sdf_file_t **handles)
+{
+    struct id_join *j;
+    sdf_block_t *b, *b2;
+    int len = strlen(particle_id);
+
+    for (b = handles[0]->blocklist; b; b = b->next) {
+        if (b->blocktype != SDF_BLOCKTYPE_POINT_VARIABLE)
+            continue;
+        if (b->datatype != SDF_DATATYPE_INTEGER4
+                && b->datatype != SDF_DATATYPE_INTEGER8)
+            continue;
+        if (strncmp(b->id, particle_id, len) || b->id[len] != '/')
+            continue;
+        b2 = sdf_find_block_by_id(handles[1], b->id);
+        if (!b2 || b2->blocktype != b->blocktype || !b->mesh_id)
+            continue;
+        if (b2->datatype != SDF_DATATYPE_INTEGER4
+                && b2->datatype != SDF_DATATYPE_INTEGER8)
+            continue;
+
+        j = calloc(1, sizeof(*j));
+        j->mesh_id = b->mesh_id;
+        j->b1 = b;
+        j->b2 = b2;
+        j->next = id_joins;
+        id_joins = j;
+    }
+}
+
+
+static void free_id_joins(void)
+{
+    struct id_join *j;
+
+    while (id_joins) {
+        j = id_joins;
+        id_joins = j->next;
+        if (j->match) free(j->match);
+        free(j);
+    }
+}
+
+
+static struct id_join *find_id_join(sdf_block_t *b)
+{
+    struct id_join *j;
+    char *mesh_id;
+
+    switch (b->blocktype) {
+    case SDF_BLOCKTYPE_POINT_VARIABLE:
+    case SDF_BLOCKTYPE_POINT_DERIVED:
+        mesh_id = b->mesh_id;
+        break;
+    case SDF_BLOCKTYPE_POINT_MESH:
+        mesh_id = b->id;
+        break;
+    default:
+        return NULL;
+    }
+
+    if (!mesh_id)
+        return NULL;
+
+    for (j = id_joins; j; j = j->next) {
+        if (!strcmp(j->mesh_id, mesh_id))
+            return j;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Put the values of the second array into the order of the first. Particles
+ * which are only in the first file take their own value so that they do not
+ * show up as differences.
+ */
+static void *gather_matched(struct id_join *j, int datatype, void *data1,
+                            void *data2)
+{
+    int64_t n;
+    char *c1 = data1, *c2 = data2, *out;
+    int size = SDF_TYPE_SIZES[datatype];
+
+    out = malloc((j->n1 ? j->n1 : 1) * size);
+    if (!out)
+        return NULL;
+
+    for (n = 0; n < j->n1; n++) {
+        if (j->match[n] < 0)
+            memcpy(out + n * size, c1 + n * size, size);
+        else
+            memcpy(out + n * size, c2 + j->match[n] * size, size);
+    }
+
+    return out;
+}
+
+
+static int diff_matched(sdf_file_t **handles, sdf_block_t *b1,
+                        sdf_block_t *b2, int inum, struct id_join *j)
+{
+    void *data1[SDF_MAXDIMS], *data2[SDF_MAXDIMS], *gathered[SDF_MAXDIMS];
+    int64_t nelements[SDF_MAXDIMS], nelements2[SDF_MAXDIMS];
+    int i, narrays, gotdiff;
+
+    if (!j->done)
+        build_id_join(handles, j);
+
+    narrays = get_block_arrays(handles[0], b1, data1, nelements);
+    if (!narrays)
+        return 0;
+    get_block_arrays(handles[1], b2, data2, nelements2);
+
+    for (i = 0; i < narrays; i++) {
+        if (nelements[i] != j->n1 || nelements2[i] != j->n2) {
+            if (!quiet) {
+                print_header();
+                print_metadata_id(b1, inum, handles[0]->nblocks);
+                fprintf(out, " - does not match particle IDs\n");
+            }
+            break;
+        }
+        gathered[i] = gather_matched(j, b1->datatype, data1[i], data2[i]);
+        if (!gathered[i]) {
+            fprintf(stderr, "Unable to allocate memory for block %s\n",
+                    b1->id);
+            break;
+        }
+    }
+
+    if (i < narrays) {
+        while (i-- > 0)
+            free(gathered[i]);
+        if (b1->done_data) sdf_free_block_data(handles[0], b1);
+        if (b2->done_data) sdf_free_block_data(handles[1], b2);
+        return 1;
+    }
+
+    if (b2->done_data)
+        sdf_free_block_data(handles[1], b2);
+
+    if (error_summary)
+        gotdiff = diff_summary_data(b1, inum, narrays, data1, gathered,
+                                    nelements);
+    else if (b1->blocktype == SDF_BLOCKTYPE_POINT_MESH)
+        gotdiff = diff_mesh_data(handles, b1, b2, inum, data1, gathered,
+                                 nelements);
+    else
+        gotdiff = diff_plain_data(handles, b1, b2, inum, data1[0],
+                                  gathered[0]);
+
+    for (i = 0; i < narrays; i++)
+        free(gathered[i]);
+
+    if (b1->done_data)
+        sdf_free_block_data(handles[0], b1);
+
+    if (j->nunmatched1 || j->nunmatched2)
+        gotdiff = 1;
+
+    return gotdiff;
+}
+
+
+/*
+ * Error field output.
+ *
+ * Instead of listing the differing elements of a plain variable, the absolute
+ * and relative error of every element is stored as a new variable on the
+ * same mesh. Only fields which differ are kept. Raw fields are written as
+ * soon as they are produced. VTK fields are collected while consecutive
+ * blocks share a mesh and each group is written out, and freed, as soon as
+ * a block on another mesh turns up.
+ */
+
+static sdf_block_t *error_fields, *error_fields_tail;
+static FILE *error_vtm_fd;
+static int error_file_index;
+
+
+static void free_error_field(sdf_block_t *f)
+{
+    if (!f) return;
+    free(f->id);
+    free(f->data);
+    free(f);
+}
+
+
+static sdf_block_t *new_error_field(sdf_block_t *b, const char *suffix)
+{
+    sdf_block_t *f = calloc(1, sizeof(*f));
+    int i, len;
+
+    if (!f) return NULL;
+
+    len = strlen(b->id) + strlen(suffix) + 2;
+    f->id = malloc(len);
+    f->data = malloc((b->nelements_local ? b->nelements_local : 1)
+                     * sizeof(double));
+    if (!f->id || !f->data) {
+        free_error_field(f);
+        return NULL;
+    }
+
+    snprintf(f->id, len, "%s/%s", b->id, suffix);
+    f->name = f->id;
+    f->mesh_id = b->mesh_id;
+    f->blocktype = SDF_BLOCKTYPE_PLAIN_VARIABLE;
+    f->datatype = f->datatype_out = SDF_DATATYPE_REAL8;
+    f->stagger = b->stagger;
+    f->ndims = b->ndims;
+    for (i = 0; i < b->ndims; i++)
+        f->dims[i] = f->local_dims[i] = b->local_dims[i];
+    f->nelements_local = b->nelements_local;
+    f->done_data = 1;
+
+    return f;
+}
+
+
+static void free_error_fields(void)
+{
+    sdf_block_t *f;
+
+    while (error_fields) {
+        f = error_fields;
+        error_fields = f->next;
+        free_error_field(f);
+    }
+    error_fields_tail = NULL;
+}
+
+
+#define ERROR_FIELD_LOOP(type) do { \
+    const type *_p1 = data1, *_p2 = data2; \
+    for (n = 0; n < nelements; n++) { \
+        val1 = _p1[n]; \
+        val2 = _p2[n]; \
+        denom = MIN(ABS(val1), ABS(val2)); \
+        abserr_val = ABS(val1 - val2); \
+        if (denom < DBL_MIN) { \
+            if (abserr_val < DBL_MIN) \
+                relerr_val = 0; \
+            else \
+                relerr_val = 1; \
+        } else \
+            relerr_val = abserr_val / denom; \
+        abs_data[n] = abserr_val; \
+        rel_data[n] = relerr_val; \
+        if (relerr_val >= relerr || abserr_val >= abserr) { \
+            nviolations++; \
+            if (relerr_val > relerr_max) relerr_max = relerr_val; \
+            if (abserr_val > abserr_max) abserr_max = abserr_val; \
+        } \
+    } \
+} while(0)
+
+
+static void write_error_fields_raw(void)
+{
+    sdf_block_t *f;
+    FILE *fd;
+    char *filename, *ptr;
+    int i, len;
+
+    for (f = error_fields; f; f = f->next) {
+        len = strlen(output_file) + strlen(f->id) + 6;
+        filename = malloc(len);
+        snprintf(filename, len, "%s_%s.raw", output_file, f->id);
+        for (ptr = filename + strlen(output_file); *ptr; ptr++)
+            if (*ptr == '/') *ptr = '_';
+
+        fd = fopen(filename, "wb");
+        if (!fd) {
+            fprintf(stderr, "Error opening file %s\n", filename);
+            free(filename);
+            continue;
+        }
+        fwrite(f->data, sizeof(double), f->nelements_local, fd);
+        fclose(fd);
+
+        if (!quiet) {
+            fprintf(out, "Wrote %s: %s float64 (", filename, f->id);
+            for (i = 0; i < f->ndims; i++)
+                fprintf(out, i ? ",%" PRIi64 : "%" PRIi64, f->dims[i]);
+            fprintf(out, ")\n");
+        }
+        free(filename);
+    }
+}
+
+
+static void write_error_fields_vtk(sdf_file_t *h)
+{
+    sdf_block_t *f, *grid, **blocks;
+    char *filename;
+    char *vtk_suffixes[2] = {"vtr", "vts"};
+    int i, len, nblocks = 0, vtk_type;
+
+    /* All pending fields are on the same mesh */
+    grid = sdf_find_block_by_id(h, error_fields->mesh_id);
+    if (!grid) return;
+
+    switch (grid->blocktype) {
+    case SDF_BLOCKTYPE_PLAIN_MESH:
+        vtk_type = 0;
+        break;
+    case SDF_BLOCKTYPE_LAGRANGIAN_MESH:
+        vtk_type = 1;
+        break;
+    default:
+        fprintf(out, "Grid type not yet supported. %s ignored.\n", grid->id);
+        return;
+    }
+
+    if (grid->datatype != SDF_DATATYPE_REAL8) {
+        fprintf(out, "Datatype not yet supported. %s ignored.\n", grid->id);
+        return;
+    }
+
+    for (f = error_fields; f; f = f->next)
+        nblocks++;
+
+    blocks = malloc(nblocks * sizeof(*blocks));
+    len = strlen(output_file) + 512;
+    filename = malloc(len);
+    if (!blocks || !filename) {
+        fprintf(stderr, "Unable to allocate memory for error fields\n");
+        free(blocks);
+        free(filename);
+        return;
+    }
+
+    for (f = error_fields, i = 0; f; f = f->next)
+        blocks[i++] = f;
+
+    /* One multiblock index file listing the VTK file for each mesh group */
+    if (error_file_index == 0 && !error_vtm_fd) {
+        snprintf(filename, len, "%s.vtm", output_file);
+        error_vtm_fd = fopen(filename, "w");
+        if (error_vtm_fd)
+            sdf_write_vtm_header(error_vtm_fd);
+        else
+            fprintf(stderr, "Error opening file %s\n", filename);
+    }
+
+    snprintf(filename, len, "%s_%i.%s", output_file, error_file_index,
+             vtk_suffixes[vtk_type]);
+    if (sdf_write_vtk_grid_blocks(h, grid, filename, blocks, nblocks)) {
+        free(filename);
+        free(blocks);
+        return;
+    }
+    if (error_vtm_fd)
+        fprintf(error_vtm_fd, "    <DataSet index=\"%i\" file=\"%s\"/>\n",
+                error_file_index, filename);
+    error_file_index++;
+
+    if (!quiet) {
+        fprintf(out, "Wrote %s:", filename);
+        for (i = 0; i < nblocks; i++)
+            fprintf(out, " %s", blocks[i]->id);
+        fprintf(out, "\n");
+    }
+
+    free(filename);
+    free(blocks);
+}
+
+
+/* Write out and free the pending error fields */
+static void flush_error_fields(sdf_file_t *h)
+{
+    if (!error_fields)
+        return;
+
+    if (!quiet) fprintf(out, "\n");
+
+    if (output_type == raw)
+        write_error_fields_raw();
+    else
+        write_error_fields_vtk(h);
+
+    free_error_fields();
+}
+
+
+static void write_error_fields(sdf_file_t **handles)
+{
+    flush_error_fields(handles[0]);
+
+    if (error_vtm_fd) {
+        fprintf(error_vtm_fd, "  </vtkMultiBlockDataSet>\n</VTKFile>\n");
+        fclose(error_vtm_fd);
+        error_vtm_fd = NULL;
+    }
+}
+
+
+static int diff_field(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2,
+                      int inum)
+{
+    void *data1, *data2;
+    sdf_block_t *fabs, *frel;
+    double *abs_data, *rel_data;
+    double val1, val2, denom, abserr_val, relerr_val;
+    double abserr_max = 0, relerr_max = 0;
+    int64_t n, nelements, nviolations = 0;
+
+    switch (b1->datatype) {
+    case(SDF_DATATYPE_INTEGER4):
+    case(SDF_DATATYPE_INTEGER8):
+    case(SDF_DATATYPE_REAL4):
+    case(SDF_DATATYPE_REAL8):
+    case(SDF_DATATYPE_LOGICAL):
+        break;
+    default:
+        return 0;
+    }
+
+    data1 = get_block_data(handles[0], b1);
+    data2 = get_block_data(handles[1], b2);
+    nelements = b1->nelements_local;
+
+    fabs = new_error_field(b1, "abserr");
+    frel = new_error_field(b1, "relerr");
+    if (!fabs || !frel) {
+        fprintf(stderr, "Unable to allocate error fields for block %s\n",
+                b1->id);
+        free_error_field(fabs);
+        free_error_field(frel);
+        if (b1->done_data) sdf_free_block_data(handles[0], b1);
+        if (b2->done_data) sdf_free_block_data(handles[1], b2);
+        return 1;
+    }
+    abs_data = fabs->data;
+    rel_data = frel->data;
+
+    switch (b1->datatype) {
+    case(SDF_DATATYPE_INTEGER4):
+        ERROR_FIELD_LOOP(int32_t);
+        break;
+    case(SDF_DATATYPE_INTEGER8):
+        ERROR_FIELD_LOOP(int64_t);
+        break;
+    case(SDF_DATATYPE_REAL4):
+        ERROR_FIELD_LOOP(float);
+        break;
+    case(SDF_DATATYPE_REAL8):
+        ERROR_FIELD_LOOP(double);
+        break;
+    case(SDF_DATATYPE_LOGICAL):
+        ERROR_FIELD_LOOP(char);
+        break;
+    }
+
+    if (error_summary)
+        diff_summary_data(b1, inum, 1, &data1, &data2, &nelements);
+
+    if (b1->done_data) sdf_free_block_data(handles[0], b1);
+    if (b2->done_data) sdf_free_block_data(handles[1], b2);
+
+    if (!nviolations) {
+        free_error_field(fabs);
+        free_error_field(frel);
+        return 0;
+    }
+
+    /* A VTK file holds the fields of one mesh, so write out the previous
+     * group once a field on another mesh turns up */
+    if (error_fields && strcmp(error_fields->mesh_id, fabs->mesh_id))
+        flush_error_fields(handles[0]);
+
+    if (error_fields_tail)
+        error_fields_tail->next = fabs;
+    else
+        error_fields = fabs;
+    fabs->next = frel;
+    error_fields_tail = frel;
+
+    stop_diff = first_diff;
+
+    if (!quiet && !error_summary) {
+        print_header();
+        print_metadata_id(b1, inum, handles[0]->nblocks);
+        fprintf(out, "\n%" PRIi64 " of %" PRIi64 " elements differ, "
+                "max error absolute %25.17e, relative %25.17e\n",
+                nviolations, nelements, abserr_max, relerr_max);
+    }
+
+    if (output_type == raw)
+        flush_error_fields(handles[0]);
+
+    return 1;
+}
+
+
+int diff_block(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
+{
+    struct id_join *j;
+    int gotdiff;
+
+    /* Point data is matched by particle ID so the sizes may differ */
+    if (id_joins && (j = find_id_join(b1))) {
+        if (b1->blocktype == b2->blocktype && b1->datatype == b2->datatype
+                && b1->ndims == b2->ndims)
+            return diff_matched(handles, b1, b2, inum, j);
+    }
+
+    /* Sanity check */
+    gotdiff = blocks_mismatched(b1, b2);
+
+    if (gotdiff && !quiet) {
+        print_header();
+        print_metadata_id(b1, inum, handles[0]->nblocks);
+        fprintf(out, " - mismatched\n");
+        return gotdiff;
+    }
+
+    if (output_file && (b1->blocktype == SDF_BLOCKTYPE_PLAIN_VARIABLE
+            || b1->blocktype == SDF_BLOCKTYPE_PLAIN_DERIVED))
+        return diff_field(handles, b1, b2, inum);
+
+    if (error_summary)
+        return diff_summary(handles, b1, b2, inum);
+
+    switch (b1->blocktype) {
+    case SDF_BLOCKTYPE_PLAIN_DERIVED:
+    case SDF_BLOCKTYPE_PLAIN_VARIABLE:
+    case SDF_BLOCKTYPE_POINT_DERIVED:
+    case SDF_BLOCKTYPE_POINT_VARIABLE:
+    case SDF_BLOCKTYPE_ARRAY:
+        return diff_plain(handles, b1, b2, inum);
+        break;
+    case SDF_BLOCKTYPE_CONSTANT:
+        return diff_constant(handles, b1, b2, inum);
+        break;
+    case SDF_BLOCKTYPE_NAMEVALUE:
+        return diff_namevalue(handles, b1, b2, inum);
         break;
     case SDF_BLOCKTYPE_PLAIN_MESH:
     case SDF_BLOCKTYPE_POINT_MESH:
@@ -1773,120 +3218,1338 @@ int diff_block(sdf_file_t **handles, sdf_block_t *b1, sdf_block_t *b2, int inum)
 }
 
 
-int main(int argc, char **argv)
+/*
+ * Comparison of a reference file against many candidate files.
+ *
+ * Each block of the reference file is read once and then compared against
+ * the matching block of every candidate. A single pool of worker threads is
+ * started before the first block and fed one block at a time. Candidates
+ * for the current block are handed out to the workers, each of which reads
+ * and compares the data for one candidate at a time. The main thread takes
+ * part in the comparison too, so the block still gets done if no worker
+ * could be started. Since every candidate has its own file handle, no two
+ * threads ever use the same handle. Nothing is printed by the workers.
+ */
+
+#define CAND_SAME     0
+#define CAND_DIFFER   1
+#define CAND_MISSING  2
+#define CAND_MISMATCH 3
+
+struct candidate {
+    sdf_file_t *h;
+    sdf_block_t *b;
+    int status;
+    struct diff_stats st;
+    int nblocks, ndiffer, nmissing, nmismatch;
+    int64_t nviolations;
+    double linf, relerr_max;
+};
+
+struct multi_job {
+    sdf_block_t *b;
+    int narrays;
+    void *data[SDF_MAXDIMS];
+    int64_t nelements[SDF_MAXDIMS];
+    struct candidate *cand;
+    int ncand, next, pending, generation, quit;
+    pthread_t *threads;
+    int nthr;
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+};
+
+
+/* Compare candidates for the current block until none are left.
+ * Called with job->lock held and returns with it held. */
+static void diff_multi_candidates(struct multi_job *job)
+{
+    struct candidate *c;
+    void *data[SDF_MAXDIMS];
+    int64_t nelements[SDF_MAXDIMS];
+    int i, k;
+
+    while (job->next < job->ncand) {
+        k = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        c = job->cand + k;
+        if (c->status == CAND_SAME) {
+            get_block_arrays(c->h, c->b, data, nelements);
+            for (i = 0; i < job->narrays; i++)
+                diff_stats_add(&c->st, job->b->datatype, job->data[i],
+                               data[i], job->nelements[i]);
+
+            if (c->b->done_data)
+                sdf_free_block_data(c->h, c->b);
+
+            if (c->st.nviolations > 0)
+                c->status = CAND_DIFFER;
+        }
+
+        pthread_mutex_lock(&job->lock);
+        if (--job->pending == 0)
+            pthread_cond_signal(&job->done);
+    }
+}
+
+
+static void *diff_multi_worker(void *arg)
+{
+    struct multi_job *job = arg;
+    int generation = 0;
+
+    pthread_mutex_lock(&job->lock);
+    while (1) {
+        while (!job->quit && job->generation == generation)
+            pthread_cond_wait(&job->start, &job->lock);
+        if (job->quit)
+            break;
+        generation = job->generation;
+        diff_multi_candidates(job);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+
+static int diff_multi_start(struct multi_job *job, struct candidate *cand,
+                            int ncand)
+{
+    int i, nthr;
+
+    memset(job, 0, sizeof(*job));
+    job->cand = cand;
+    job->ncand = ncand;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->start, NULL);
+    pthread_cond_init(&job->done, NULL);
+
+    /* The main thread is one of the workers */
+    nthr = MIN(nthreads, ncand) - 1;
+    if (nthr < 1)
+        return 0;
+
+    job->threads = malloc(nthr * sizeof(*job->threads));
+    if (!job->threads) {
+        fprintf(stderr, "Unable to allocate worker threads\n");
+        return 1;
+    }
+
+    for (i = 0; i < nthr; i++) {
+        if (pthread_create(&job->threads[i], NULL, diff_multi_worker, job)) {
+            fprintf(stderr, "Unable to start worker thread\n");
+            break;
+        }
+    }
+    job->nthr = i;
+
+    return 0;
+}
+
+
+static void diff_multi_stop(struct multi_job *job)
+{
+    int i;
+
+    pthread_mutex_lock(&job->lock);
+    job->quit = 1;
+    pthread_cond_broadcast(&job->start);
+    pthread_mutex_unlock(&job->lock);
+
+    for (i = 0; i < job->nthr; i++)
+        pthread_join(job->threads[i], NULL);
+    free(job->threads);
+
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->start);
+    pthread_cond_destroy(&job->done);
+}
+
+
+static int diff_multi(sdf_file_t **handles, struct multi_job *job,
+                      sdf_block_t *b, int inum)
+{
+    struct candidate *c;
+    int i, gotdiff = 0, printed = 0;
+
+    job->b = b;
+
+    for (i = 0; i < job->ncand; i++) {
+        c = job->cand + i;
+        diff_stats_init(&c->st);
+        c->b = sdf_find_block_by_id(c->h, b->id);
+        if (!c->b)
+            c->status = CAND_MISSING;
+        else if (blocks_mismatched(b, c->b))
+            c->status = CAND_MISMATCH;
+        else
+            c->status = CAND_SAME;
+    }
+
+    job->narrays = get_block_arrays(handles[0], b, job->data, job->nelements);
+
+    if (job->narrays) {
+        pthread_mutex_lock(&job->lock);
+        job->next = 0;
+        job->pending = job->ncand;
+        job->generation++;
+        pthread_cond_broadcast(&job->start);
+        diff_multi_candidates(job);
+        while (job->pending > 0)
+            pthread_cond_wait(&job->done, &job->lock);
+        pthread_mutex_unlock(&job->lock);
+
+        if (b->done_data)
+            sdf_free_block_data(handles[0], b);
+    }
+
+    for (i = 0; i < job->ncand; i++) {
+        c = job->cand + i;
+        c->nblocks++;
+        switch (c->status) {
+        case CAND_SAME:
+            continue;
+        case CAND_DIFFER:
+            c->ndiffer++;
+            break;
+        case CAND_MISSING:
+            c->nmissing++;
+            break;
+        case CAND_MISMATCH:
+            c->nmismatch++;
+            break;
+        }
+
+        c->nviolations += c->st.nviolations;
+        if (c->st.linf > c->linf) c->linf = c->st.linf;
+        if (c->st.relerr_max > c->relerr_max)
+            c->relerr_max = c->st.relerr_max;
+
+        gotdiff = 1;
+        if (quiet)
+            continue;
+
+        if (!printed) {
+            print_metadata_id(b, inum, handles[0]->nblocks);
+            fprintf(out, "\n");
+        }
+        printed = 1;
+
+        fprintf(out, "%s%4i %s: ", default_indent, i + 1, c->h->filename);
+        if (c->status == CAND_MISSING)
+            fprintf(out, "not in file\n");
+        else if (c->status == CAND_MISMATCH)
+            fprintf(out, "mismatched\n");
+        else
+            fprintf(out, "%" PRIi64 " of %" PRIi64 " elements differ, "
+                    "max error absolute %11.4e, relative %11.4e\n",
+                    c->st.nviolations, c->st.nelements, c->st.linf,
+                    c->st.relerr_max);
+    }
+
+    return gotdiff;
+}
+
+
+static int print_multi_summary(sdf_file_t **handles, struct candidate *cand)
+{
+    struct candidate *c;
+    int i, ndiffer = 0;
+
+    for (i = 0; i < nfiles - 1; i++) {
+        c = cand + i;
+        if (c->ndiffer || c->nmissing || c->nmismatch)
+            ndiffer++;
+    }
+
+    if (quiet)
+        return ndiffer;
+
+    fprintf(out, "\n%4s %7s %7s %7s %10s %12s %11s %11s  %s\n",
+            "File", "Status", "Differ", "Missing", "Mismatched",
+            "Violations", "Max_abs", "Max_rel", "Filename");
+    for (i = 0; i < nfiles - 1; i++) {
+        c = cand + i;
+        fprintf(out, "%4i %7s %7i %7i %10i %12" PRIi64 " %11.4e %11.4e  %s\n",
+                i + 1,
+                (c->ndiffer || c->nmissing || c->nmismatch) ? "DIFFER" : "SAME",
+                c->ndiffer, c->nmissing, c->nmismatch, c->nviolations,
+                c->linf, c->relerr_max, c->h->filename);
+    }
+    fprintf(out, "\n%i of %i files differ from %s\n", ndiffer, nfiles - 1,
+            handles[0]->filename);
+
+    return ndiffer;
+}
+
+
+/*
+ * Block signatures.
+ *
+ * A signature file holds a compact description of each block of a file so
+ * that later runs can be checked without keeping the full data around. For
+ * each block it stores the dimensions, a hash of the raw bytes and the
+ * minimum, maximum, sum and L2 norm of the data. Optionally, the mean of
+ * each of a fixed number of chunks of the data is stored as a sketch.
+ * The file is plain text with the block ID on one line and the values on
+ * the next.
+ */
+
+#define SIGNATURE_MAGIC "SDF_signature"
+#define SIGNATURE_VERSION 1
+
+struct signature {
+    char *id;
+    int blocktype, datatype, ndims, nsketch, found;
+    int64_t dims[SDF_MAXDIMS], nelements;
+    uint64_t hash;
+    double min, max, sum, l2;
+    double *sketch;
+    struct signature *next;
+} *signatures, *signatures_tail;
+
+
+/* FNV-1a over 64-bit words, with the tail done a byte at a time */
+static uint64_t hash_bytes(uint64_t hash, const void *data, int64_t len)
+{
+    const unsigned char *c = data;
+    uint64_t word;
+    int64_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&word, c + i, 8);
+        hash ^= word;
+        hash *= UINT64_C(0x100000001b3);
+    }
+    for (; i < len; i++) {
+        hash ^= c[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+
+    return hash;
+}
+
+
+#define SIGNATURE_LOOP(type) do { \
+    const type *_p = data[i]; \
+    for (n = 0; n < nelements[i]; n++, k++) { \
+        val = _p[n]; \
+        if (val < sig->min) sig->min = val; \
+        if (val > sig->max) sig->max = val; \
+        sig->sum += val; \
+        sig->l2 += val * val; \
+        if (sig->nsketch) sig->sketch[k * sig->nsketch / total] += val; \
+    } \
+} while(0)
+
+
+/*
+ * Fill in the signature for a block. Returns zero if the block has no data
+ * that can be compared.
+ */
+static int block_signature(sdf_file_t *h, sdf_block_t *b,
+                           struct signature *sig, int sketch_len)
+{
+    void *data[SDF_MAXDIMS];
+    int64_t nelements[SDF_MAXDIMS], n, k, total = 0;
+    int64_t *count;
+    double val;
+    int i, narrays;
+
+    narrays = get_block_arrays(h, b, data, nelements);
+    if (!narrays)
+        return 0;
+
+    for (i = 0; i < narrays; i++)
+        total += nelements[i];
+
+    sig->id = b->id;
+    sig->blocktype = b->blocktype;
+    sig->datatype = b->datatype;
+    sig->ndims = b->ndims;
+    for (i = 0; i < b->ndims; i++)
+        sig->dims[i] = b->dims[i];
+    sig->nelements = total;
+    sig->hash = UINT64_C(0xcbf29ce484222325);
+    sig->min = DBL_MAX;
+    sig->max = -DBL_MAX;
+    sig->sum = sig->l2 = 0;
+    sig->nsketch = MIN(sketch_len, total);
+    sig->sketch = NULL;
+    if (sig->nsketch)
+        sig->sketch = calloc(sig->nsketch, sizeof(*sig->sketch));
+
+    for (i = 0, k = 0; i < narrays; i++) {
+        sig->hash = hash_bytes(sig->hash, data[i],
+                               nelements[i] * SDF_TYPE_SIZES[b->datatype]);
+        switch (b->datatype) {
+        case(SDF_DATATYPE_INTEGER4):
+            SIGNATURE_LOOP(int32_t);
+            break;
+        case(SDF_DATATYPE_INTEGER8):
+            SIGNATURE_LOOP(int64_t);
+            break;
+        case(SDF_DATATYPE_REAL4):
+            SIGNATURE_LOOP(float);
+            break;
+        case(SDF_DATATYPE_REAL8):
+            SIGNATURE_LOOP(double);
+            break;
+        case(SDF_DATATYPE_LOGICAL):
+            SIGNATURE_LOOP(char);
+            break;
+        }
+    }
+
+    if (sig->nsketch) {
+        /* Turn the chunk sums into means */
+        count = calloc(sig->nsketch, sizeof(*count));
+        for (k = 0; k < sig->nsketch; k++) {
+            n = (k * total + sig->nsketch - 1) / sig->nsketch;
+            count[k] = (((k + 1) * total + sig->nsketch - 1) / sig->nsketch)
+                    - n;
+            if (count[k]) sig->sketch[k] /= count[k];
+        }
+        free(count);
+    }
+
+    if (b->done_data && b->blocktype != SDF_BLOCKTYPE_CONSTANT)
+        sdf_free_block_data(h, b);
+
+    return 1;
+}
+
+
+static void write_block_signature(FILE *fd, sdf_file_t *h, sdf_block_t *b)
+{
+    struct signature sig;
+    int i;
+
+    if (!block_signature(h, b, &sig, nsketch))
+        return;
+
+    fprintf(fd, "%s\n%i %i %i", sig.id, sig.blocktype, sig.datatype,
+            sig.ndims);
+    for (i = 0; i < sig.ndims; i++)
+        fprintf(fd, " %" PRIi64, sig.dims[i]);
+    fprintf(fd, " %" PRIi64 " %016" PRIx64 " %.17g %.17g %.17g %.17g %i",
+            sig.nelements, sig.hash, sig.min, sig.max, sig.sum, sig.l2,
+            sig.nsketch);
+    for (i = 0; i < sig.nsketch; i++)
+        fprintf(fd, " %.17g", sig.sketch[i]);
+    fprintf(fd, "\n");
+
+    if (sig.sketch) free(sig.sketch);
+}
+
+
+static void signature_error(int line)
+{
+    fprintf(stderr, "Error reading signature file %s at line %i\n",
+            signature_file, line);
+    exit(1);
+}
+
+
+static void read_signatures(void)
+{
+    struct signature *sig;
+    FILE *fd;
+    char buf[1024], *ptr;
+    int i, version, line = 1;
+
+    fd = fopen(signature_file, "r");
+    if (!fd) {
+        fprintf(stderr, "Error opening file %s\n", signature_file);
+        exit(1);
+    }
+
+    if (fscanf(fd, "%1023s %i ", buf, &version) != 2
+            || strcmp(buf, SIGNATURE_MAGIC) || version != SIGNATURE_VERSION)
+        signature_error(line);
+
+    while (fgets(buf, sizeof(buf), fd)) {
+        line++;
+        ptr = strchr(buf, '\n');
+        if (ptr) *ptr = '\0';
+
+        sig = calloc(1, sizeof(*sig));
+        sig->id = malloc(strlen(buf) + 1);
+        memcpy(sig->id, buf, strlen(buf) + 1);
+
+        line++;
+        if (fscanf(fd, "%i %i %i", &sig->blocktype, &sig->datatype,
+                   &sig->ndims) != 3 || sig->ndims < 0
+                || sig->ndims > SDF_MAXDIMS)
+            signature_error(line);
+        for (i = 0; i < sig->ndims; i++)
+            if (fscanf(fd, "%" SCNi64, &sig->dims[i]) != 1)
+                signature_error(line);
+        if (fscanf(fd, "%" SCNi64 " %" SCNx64 " %lg %lg %lg %lg %i",
+                   &sig->nelements, &sig->hash, &sig->min, &sig->max,
+                   &sig->sum, &sig->l2, &sig->nsketch) != 7
+                || sig->nsketch < 0)
+            signature_error(line);
+        if (sig->nsketch)
+            sig->sketch = malloc(sig->nsketch * sizeof(*sig->sketch));
+        for (i = 0; i < sig->nsketch; i++)
+            if (fscanf(fd, "%lg", &sig->sketch[i]) != 1)
+                signature_error(line);
+        /* Skip to the start of the next ID */
+        fscanf(fd, " ");
+
+        if (signatures_tail)
+            signatures_tail->next = sig;
+        else
+            signatures = sig;
+        signatures_tail = sig;
+    }
+
+    fclose(fd);
+}
+
+
+static struct signature *find_signature(const char *id)
+{
+    static struct signature *last;
+    struct signature *sig;
+
+    /* Blocks are usually looked up in the order they were written */
+    if (last && last->next && !strcmp(last->next->id, id))
+        return (last = last->next);
+
+    for (sig = signatures; sig; sig = sig->next)
+        if (!strcmp(sig->id, id))
+            return (last = sig);
+
+    return NULL;
+}
+
+
+#define SIGNATURE_DIFF(name, v1, v2) do { \
+    val1 = (v1); \
+    val2 = (v2); \
+    denom = MIN(ABS(val1), ABS(val2)); \
+    abserr_val = ABS(val1 - val2); \
+    if (denom < DBL_MIN) { \
+        if (abserr_val < DBL_MIN) \
+            relerr_val = 0; \
+        else \
+            relerr_val = 1; \
+    } else \
+        relerr_val = abserr_val / denom; \
+    if (relerr_val >= relerr || abserr_val >= abserr) { \
+        print_header(); \
+        gotdiff = 1; \
+        if (!quiet) { \
+            if (!gotblock) { \
+                gotblock = 1; \
+                print_metadata_id(b, inum, h->nblocks); \
+                fprintf(out, "\n"); \
+            } \
+            if (!just_id) { \
+                fprintf(out, "-%s: ", (name)); \
+                fprintf(out, format_float, val1); \
+                fprintf(out, "\n+%s: ", (name)); \
+                fprintf(out, format_float, val2); \
+                fprintf(out, "\n"); \
+                if (show_errors) \
+                    fprintf(out, " Error absolute %25.17e, " \
+                            "relative %25.17e\n", \
+                            abserr_val, relerr_val); \
+            } \
+        } \
+    } \
+} while(0)
+
+
+static int diff_signature(sdf_file_t *h, sdf_block_t *b, int inum)
+{
+    struct signature *ref, sig;
+    double val1, val2, denom, abserr_val, relerr_val;
+    char name[32];
+    int i, gotdiff = 0, gotblock = 0, mismatched = 0;
+
+    ref = find_signature(b->id);
+    if (!ref) {
+        if (!quiet) {
+            print_header();
+            print_metadata_id(b, inum, h->nblocks);
+            fprintf(out, " - not in signature file\n");
+        }
+        return 0;
+    }
+    ref->found = 1;
+
+    if (!block_signature(h, b, &sig, ref->nsketch))
+        return 0;
+
+    if (sig.blocktype != ref->blocktype || sig.datatype != ref->datatype
+            || sig.ndims != ref->ndims || sig.nelements != ref->nelements
+            || sig.nsketch != ref->nsketch)
+        mismatched = 1;
+    for (i = 0; i < sig.ndims && !mismatched; i++)
+        if (sig.dims[i] != ref->dims[i]) mismatched = 1;
+
+    if (mismatched) {
+        if (!quiet) {
+            print_header();
+            print_metadata_id(b, inum, h->nblocks);
+            fprintf(out, " - mismatched\n");
+        }
+        gotdiff = 1;
+    } else if (sig.hash != ref->hash) {
+        /* The data has changed, check whether it is within tolerance */
+        SIGNATURE_DIFF("min", ref->min, sig.min);
+        SIGNATURE_DIFF("max", ref->max, sig.max);
+        SIGNATURE_DIFF("sum", ref->sum, sig.sum);
+        SIGNATURE_DIFF("l2", ref->l2, sig.l2);
+        for (i = 0; i < sig.nsketch; i++) {
+            snprintf(name, sizeof(name), "sketch[%i]", i + index_offset);
+            SIGNATURE_DIFF(name, ref->sketch[i], sig.sketch[i]);
+        }
+    }
+
+    if (sig.sketch) free(sig.sketch);
+
+    return gotdiff;
+}
+
+
+/* Report blocks in the signature file which were not in the SDF file */
+static void free_signatures(void)
+{
+    struct signature *sig;
+
+    while (signatures) {
+        sig = signatures;
+        signatures = sig->next;
+        if (!sig->found && nrange == 0 && !variable_ids && !blocktype_mask) {
+            if (!quiet) {
+                print_header();
+                fprintf(out, "\nID: %s - not in file\n", sig->id);
+            }
+        }
+        free(sig->id);
+        if (sig->sketch) free(sig->sketch);
+        free(sig);
+    }
+}
+
+
+static sdf_file_t *open_file(char *filename, comm_t comm)
+{
+    sdf_file_t *h;
+    int block, err;
+
+    h = sdf_open(filename, comm, SDF_READ, use_mmap);
+    if (!h) {
+        fprintf(stderr, "Error opening file %s\n", filename);
+        return NULL;
+    }
+
+    h->print = debug;
+    if (ignore_summary) h->use_summary = 0;
+    if (ignore_nblocks) h->ignore_nblocks = 1;
+    sdf_stack_init(h);
+
+    sdf_read_header(h);
+    h->current_block = NULL;
+
+    // If nblocks is negative then the file is corrupt
+    if (h->nblocks < 0) {
+        block = (-h->nblocks) / 64;
+        err = -h->nblocks - 64 * block;
+        fprintf(stderr, "Error code %s found at block %i\n",
+                sdf_error_codes_c[err], block);
+    }
+
+    h->purge_duplicated_ids = purge_duplicate;
+
+    sdf_read_blocklist(h);
+
+    return h;
+}
+
+
+/* Check whether a block is selected by the range, ID and blocktype options */
+static int block_selected(sdf_block_t *b, int idx, int *range_start)
+{
+    struct id_list *var;
+    int n, found = 1;
+
+    if (nrange > 0 || variable_ids) found = 0;
+
+    for (n = *range_start; n < nrange; n++) {
+        if (idx < range_list[n].start)
+            break;
+        if (idx <= range_list[n].end) {
+            found = 1;
+            break;
+        }
+        (*range_start)++;
+    }
+
+    if (found == 0 && variable_ids) {
+        for (var = variable_ids; var; var = var->next) {
+            if (!memcmp(b->id, var->id, strlen(var->id)+1)) {
+                found = 1;
+                break;
+            }
+        }
+    }
+
+    if (exclude_variables) {
+        if (found) return 0;
+    } else {
+        if (!found) return 0;
+    }
+
+    /* Only consider blocks in the blocktype mask */
+    if (blocktype_mask && blocktype_mask[b->blocktype] == 0)
+        return 0;
+
+    return 1;
+}
+
+
+static int diff_block_pair(sdf_file_t **handles, sdf_block_t *b,
+                           sdf_block_t *b2, int idx)
+{
+    if (!b2) {
+        if (metadata && !quiet)
+            print_metadata(b, idx, handles[0]->nblocks);
+        else if (!quiet) {
+            print_header();
+            print_metadata_id(b, idx, handles[0]->nblocks);
+            fprintf(out, " - not in second file\n");
+        }
+        return 0;
+    }
+
+    return diff_block(handles, b, b2, idx);
+}
+
+
+static void print_report_count(void)
+{
+    if (!quiet && !just_id && max_reports >= 0 && nreports > max_reports)
+        fprintf(out, "\n%" PRIi64 " differing elements found, first %i "
+                "listed\n", nreports, max_reports);
+}
+
+
+/*
+ * Read scheduling for the comparison of two files.
+ *
+ * The selected blocks are compared in the order of their data in one of the
+ * two files, whichever gives the least seeking across both files, and the
+ * kernel is told to start reading the next block while the current one is
+ * being compared. The output of each block goes to a temporary file and is
+ * copied out in the original block order afterwards. Printing of the
+ * headers is deferred and recorded per block so that they still appear
+ * before the first block that needs them.
+ */
+
+#define PLAN_READAHEAD (64 * 1024 * 1024)
+
+struct plan_entry {
+    sdf_block_t *b, *b2;
+    int idx, ndiff, header, summary_header;
+    int64_t key;
+    long start, len;
+};
+
+
+static int plan_sort(const void *v1, const void *v2)
+{
+    const struct plan_entry *e1 = v1, *e2 = v2;
+
+    if (e1->key != e2->key)
+        return (e1->key < e2->key) ? -1 : 1;
+
+    return e1->idx - e2->idx;
+}
+
+
+static inline int64_t plan_location(sdf_block_t *b)
+{
+    if (!b || b->data_length < 1)
+        return -1;
+
+    return b->data_location;
+}
+
+
+static void plan_order(struct plan_entry *plan, int nplan, int which)
+{
+    int i;
+
+    for (i = 0; i < nplan; i++) {
+        if (which == 0)
+            plan[i].key = plan[i].idx;
+        else if (which == 1)
+            plan[i].key = plan_location(plan[i].b);
+        else
+            plan[i].key = plan_location(plan[i].b2);
+    }
+
+    qsort(plan, nplan, sizeof(*plan), plan_sort);
+}
+
+
+/* Total distance skipped over when reading the blocks in plan order */
+static int64_t plan_seek_cost(struct plan_entry *plan, int nplan)
 {
-    char **files = NULL;
-    int i, n, block, err, found, idx, range_start;
-    //int nelements_max;
-    sdf_file_t *h, *h2, **handles;
-    sdf_block_t *b, *b2, *next;
-    //sdf_block_t *mesh, *mesh0;
-    //list_t *station_blocks;
-    comm_t comm;
-    int gotdiff = 0;
+    sdf_block_t *b;
+    int64_t loc, pos[2] = { 0, 0 }, cost = 0;
+    int i, n;
+
+    for (i = 0; i < nplan; i++) {
+        for (n = 0; n < 2; n++) {
+            b = n ? plan[i].b2 : plan[i].b;
+            loc = plan_location(b);
+            if (loc < 0) continue;
+            cost += (loc > pos[n]) ? loc - pos[n] : pos[n] - loc;
+            pos[n] = loc + b->data_length;
+        }
+    }
 
-    files = parse_args(&argc, &argv);
+    return cost;
+}
 
-#ifdef PARALLEL
-    MPI_Init(&argc, &argv);
-    MPI_Comm_dup(MPI_COMM_WORLD, &comm);
-#else
-    comm = 0;
+
+static void plan_readahead(int *fd, struct plan_entry *e)
+{
+#ifdef POSIX_FADV_WILLNEED
+    sdf_block_t *b;
+    int n;
+
+    for (n = 0; n < 2; n++) {
+        b = n ? e->b2 : e->b;
+        if (fd[n] < 0 || plan_location(b) < 0) continue;
+        posix_fadvise(fd[n], b->data_location,
+                      MIN(b->data_length, PLAN_READAHEAD), POSIX_FADV_WILLNEED);
+    }
 #endif
+}
 
-    handles = calloc(2, sizeof(*handles));
-    for (i=0; i<2; i++) {
-        h = handles[i] = sdf_open(files[i], comm, SDF_READ, 0);
-        if (!h) {
-            fprintf(stderr, "Error opening file %s\n", files[i]);
-            return 1;
+
+static int diff_plan_entry(sdf_file_t **handles, struct plan_entry *e)
+{
+    handles[0]->current_block = e->b;
+    e->ndiff = diff_block_pair(handles, e->b, e->b2, e->idx);
+    if (e->ndiff) stop_diff = first_diff;
+
+    /*
+     * Only one pair of blocks is held at a time. Anything needed again later,
+     * such as a mesh, is read again when it is used.
+     */
+    if (e->b->done_data) sdf_free_block_data(handles[0], e->b);
+    if (e->b2 && e->b2->done_data) sdf_free_block_data(handles[1], e->b2);
+
+    return e->ndiff;
+}
+
+
+/* Compare all of the selected blocks of two open files */
+static int diff_files(sdf_file_t **handles)
+{
+    struct plan_entry *plan = NULL;
+    sdf_block_t *b;
+    FILE *tmp = NULL, *saved_out;
+    char buf[4096];
+    size_t len;
+    long remaining;
+    int64_t cost, best_cost;
+    int fd[2], i, n, nplan = 0, nmax = 0, idx, range_start = 0, best;
+    int gotdiff = 0;
+
+    b = handles[0]->blocklist;
+    for (idx = 1; b; idx++, b = b->next) {
+        if (!block_selected(b, idx, &range_start))
+            continue;
+
+        if (nplan == nmax) {
+            nmax = 2 * nmax + 16;
+            plan = realloc(plan, nmax * sizeof(*plan));
         }
+        memset(plan + nplan, 0, sizeof(*plan));
+        plan[nplan].b = b;
+        plan[nplan].b2 = sdf_find_block_by_id(handles[1], b->id);
+        plan[nplan].idx = idx;
+        nplan++;
+    }
 
-        h->print = debug;
-        if (ignore_summary) h->use_summary = 0;
-        if (ignore_nblocks) h->ignore_nblocks = 1;
-        sdf_stack_init(h);
+    /*
+     * Stopping at the first difference and limiting the number of reports
+     * both depend on the blocks being compared in their original order.
+     */
+    if (nplan > 1 && !first_diff && max_reports < 0)
+        tmp = tmpfile();
+
+    if (!tmp) {
+        for (i = 0; i < nplan && !stop_diff; i++)
+            gotdiff += diff_plan_entry(handles, plan + i);
+        free(plan);
+        return gotdiff;
+    }
 
-        sdf_read_header(h);
-        h->current_block = NULL;
+    best = 0;
+    best_cost = plan_seek_cost(plan, nplan);
+    for (n = 1; n < 3; n++) {
+        plan_order(plan, nplan, n);
+        cost = plan_seek_cost(plan, nplan);
+        if (cost < best_cost) {
+            best = n;
+            best_cost = cost;
+        }
+    }
+    if (best != 2) plan_order(plan, nplan, best);
+
+    for (n = 0; n < 2; n++)
+        fd[n] = open(handles[n]->filename, O_RDONLY);
+
+    saved_out = out;
+    out = tmp;
+    defer_header = 1;
+
+    plan_readahead(fd, plan);
+    for (i = 0; i < nplan; i++) {
+        if (i + 1 < nplan) plan_readahead(fd, plan + i + 1);
+        header_pending = summary_header_pending = 0;
+        plan[i].start = ftell(tmp);
+        gotdiff += diff_plan_entry(handles, plan + i);
+        plan[i].len = ftell(tmp) - plan[i].start;
+        plan[i].header = header_pending;
+        plan[i].summary_header = summary_header_pending;
+    }
+
+    defer_header = 0;
+    out = saved_out;
+
+    for (n = 0; n < 2; n++)
+        if (fd[n] >= 0) close(fd[n]);
+
+    /* Report the results in the original block order */
+    plan_order(plan, nplan, 0);
+    for (i = 0; i < nplan; i++) {
+        if (plan[i].header) print_header();
+        if (plan[i].summary_header) print_summary_header();
+        fseek(tmp, plan[i].start, SEEK_SET);
+        for (remaining = plan[i].len; remaining > 0; remaining -= len) {
+            len = fread(buf, 1, MIN(remaining, (long)sizeof(buf)), tmp);
+            if (len == 0) break;
+            fwrite(buf, 1, len, out);
+        }
+    }
+
+    fclose(tmp);
+    free(plan);
+
+    return gotdiff;
+}
+
+
+/*
+ * Comparison of two run directories.
+ *
+ * The SDF files in each directory are paired up by the step number in their
+ * header. If several files in a directory have the same step number then
+ * they are paired up by name. Pairs are handed out to a pool of threads and
+ * each is compared with the same code as a pair of files given on the
+ * command line. A thread only starts comparing its pair once the other
+ * pairs in progress leave enough room under the memory limit for the
+ * largest blocks of both files. The output of each pair goes to a
+ * temporary file which is copied to stdout in the order of the pairs.
+ */
+
+#define PAIR_SAME    0
+#define PAIR_DIFFER  1
+#define PAIR_MISSING 2
+#define PAIR_ERROR   3
+#define PAIR_SKIPPED 4
+
+struct dir_file {
+    char *name;
+    int step;
+};
+
+struct dir_pair {
+    char *file1, *file2;
+    int step, status, ndiffer, done;
+    FILE *output;
+};
+
+struct dir_job {
+    struct dir_pair *pairs;
+    int npairs, next, nrunning, stop;
+    int64_t memory_used;
+    comm_t comm;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+
+static int dir_file_sort(const void *v1, const void *v2)
+{
+    const struct dir_file *f1 = v1, *f2 = v2;
+
+    if (f1->step != f2->step)
+        return (f1->step < f2->step) ? -1 : 1;
+
+    return strcmp(f1->name, f2->name);
+}
 
-        // If nblocks is negative then the file is corrupt
-        if (h->nblocks < 0) {
-            block = (-h->nblocks) / 64;
-            err = -h->nblocks - 64 * block;
-            fprintf(stderr, "Error code %s found at block %i\n",
-                    sdf_error_codes_c[err], block);
+
+static struct dir_file *scan_dir(char *dir, int *nfiles_p, comm_t comm)
+{
+    struct dir_file *list = NULL;
+    struct dirent *entry;
+    sdf_file_t *h;
+    DIR *d;
+    char *name;
+    int n = 0, nmax = 0, len;
+
+    d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Error opening directory %s\n", dir);
+        exit(1);
+    }
+
+    while ((entry = readdir(d))) {
+        len = strlen(entry->d_name);
+        if (len < 5 || strcmp(entry->d_name + len - 4, ".sdf"))
+            continue;
+
+        len += strlen(dir) + 2;
+        name = malloc(len);
+        snprintf(name, len, "%s/%s", dir, entry->d_name);
+
+        h = sdf_open(name, comm, SDF_READ, 0);
+        if (!h) {
+            fprintf(stderr, "Error opening file %s\n", name);
+            free(name);
+            continue;
         }
+        sdf_read_header(h);
 
-        h->purge_duplicated_ids = purge_duplicate;
+        if (n == nmax) {
+            nmax = 2 * nmax + 16;
+            list = realloc(list, nmax * sizeof(*list));
+        }
+        list[n].name = name;
+        list[n].step = h->step;
+        n++;
 
-        sdf_read_blocklist(h);
+        sdf_close(h);
     }
-    free(files);
+    closedir(d);
 
-    h  = handles[0];
-    h2 = handles[1];
+    qsort(list, n, sizeof(*list), dir_file_sort);
 
-    //list_init(&station_blocks);
+    *nfiles_p = n;
+    return list;
+}
 
-    set_header_string(handles);
 
-    range_start = 0;
-    //nelements_max = 0;
-    //mesh0 = NULL;
-    found = 1;
-    next = h->blocklist;
-    for (i = 0, idx = 1; next; i++, idx++) {
-        h->current_block = b = next;
-        next = b->next;
+/* Number of files in the list starting at i with the same step */
+static int step_count(struct dir_file *list, int n, int i)
+{
+    int j;
 
-        if (nrange > 0 || variable_ids) found = 0;
+    for (j = i + 1; j < n && list[j].step == list[i].step; j++);
 
-        for (n = range_start; n < nrange; n++) {
-            if (idx < range_list[n].start)
-                break;
-            if (idx <= range_list[n].end) {
-                found = 1;
-                break;
-            }
-            range_start++;
+    return j - i;
+}
+
+
+static const char *base_name(const char *name)
+{
+    const char *ptr = strrchr(name, '/');
+
+    return ptr ? ptr + 1 : name;
+}
+
+
+static struct dir_pair *pair_files(struct dir_file *l1, int n1,
+                                   struct dir_file *l2, int n2, int *npairs)
+{
+    struct dir_pair *pairs;
+    int i1 = 0, i2 = 0, n = 0, cmp;
+
+    pairs = calloc(n1 + n2 + 1, sizeof(*pairs));
+
+    while (i1 < n1 || i2 < n2) {
+        if (i1 == n1)
+            cmp = 1;
+        else if (i2 == n2)
+            cmp = -1;
+        else if (l1[i1].step != l2[i2].step)
+            cmp = (l1[i1].step < l2[i2].step) ? -1 : 1;
+        else if (step_count(l1, n1, i1) == 1 && step_count(l2, n2, i2) == 1)
+            cmp = 0;
+        else
+            cmp = strcmp(base_name(l1[i1].name), base_name(l2[i2].name));
+
+        if (cmp <= 0) {
+            pairs[n].file1 = l1[i1].name;
+            pairs[n].step = l1[i1].step;
+            i1++;
+        }
+        if (cmp >= 0) {
+            pairs[n].file2 = l2[i2].name;
+            pairs[n].step = l2[i2].step;
+            i2++;
         }
+        n++;
+    }
 
-        if (found == 0 && variable_ids) {
-            variable_last_id = variable_ids;
-            while (variable_last_id) {
-                if (!memcmp(b->id, variable_last_id->id,
-                        strlen(variable_last_id->id)+1)) {
-                    found = 1;
-                    break;
-                }
-                variable_last_id = variable_last_id->next;
-            }
+    *npairs = n;
+    return pairs;
+}
+
+
+/* Memory needed to hold the largest block of each file */
+static int64_t pair_memory(sdf_file_t **handles)
+{
+    sdf_block_t *b;
+    int64_t len, total = 0;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        len = 0;
+        for (b = handles[i]->blocklist; b; b = b->next)
+            if (b->data_length > len) len = b->data_length;
+        total += len;
+    }
+
+    return total;
+}
+
+
+static void diff_pair(struct dir_job *job, struct dir_pair *p)
+{
+    sdf_file_t *handles[2];
+    int64_t memory;
+
+    if (!p->file1 || !p->file2) {
+        p->status = PAIR_MISSING;
+        return;
+    }
+
+    handles[0] = open_file(p->file1, job->comm);
+    handles[1] = handles[0] ? open_file(p->file2, job->comm) : NULL;
+    if (!handles[1]) {
+        if (handles[0]) {
+            sdf_stack_destroy(handles[0]);
+            sdf_close(handles[0]);
         }
+        p->status = PAIR_ERROR;
+        return;
+    }
 
-        if (exclude_variables) {
-            if (found) continue;
-        } else {
-            if (!found) continue;
+    memory = pair_memory(handles);
+
+    pthread_mutex_lock(&job->lock);
+    while (job->nrunning > 0 && job->memory_used + memory > memory_limit)
+        pthread_cond_wait(&job->cond, &job->lock);
+    job->memory_used += memory;
+    job->nrunning++;
+    pthread_mutex_unlock(&job->lock);
+
+    done_header = quiet;
+    done_summary_header = 0;
+    stop_diff = 0;
+    nreports = 0;
+    set_header_string(p->file1, p->file2);
+
+    if (particle_id)
+        setup_id_joins(handles);
+
+    p->ndiffer = diff_files(handles);
+    print_report_count();
+    p->status = p->ndiffer ? PAIR_DIFFER : PAIR_SAME;
+
+    free_id_joins();
+
+    sdf_stack_destroy(handles[0]);
+    sdf_stack_destroy(handles[1]);
+    sdf_close(handles[0]);
+    sdf_close(handles[1]);
+
+    pthread_mutex_lock(&job->lock);
+    job->memory_used -= memory;
+    job->nrunning--;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+
+static void *diff_dirs_worker(void *arg)
+{
+    struct dir_job *job = arg;
+    struct dir_pair *p;
+    int k, stop;
+
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        k = job->next++;
+        stop = job->stop;
+        pthread_mutex_unlock(&job->lock);
+        if (k >= job->npairs)
+            break;
+
+        p = job->pairs + k;
+        out = p->output = tmpfile();
+        if (!out) out = p->output = stdout;
+
+        if (stop)
+            p->status = PAIR_SKIPPED;
+        else
+            diff_pair(job, p);
+
+        pthread_mutex_lock(&job->lock);
+        if (first_diff && p->status != PAIR_SAME
+                && p->status != PAIR_SKIPPED)
+            job->stop = 1;
+        p->done = 1;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    return NULL;
+}
+
+
+static void copy_output(FILE *fd)
+{
+    char buf[4096];
+    size_t len;
+
+    rewind(fd);
+    while ((len = fread(buf, 1, sizeof(buf), fd)) > 0)
+        fwrite(buf, 1, len, stdout);
+    fclose(fd);
+}
+
+
+static int diff_dirs(char **dirs, comm_t comm)
+{
+    struct dir_job job;
+    struct dir_file *list1, *list2;
+    struct dir_pair *p;
+    pthread_t *threads;
+    int i, n1, n2, nthr, ndiffer = 0;
+    static const char *status_c[] = { "SAME", "DIFFER", "MISSING", "ERROR",
+                                      "SKIPPED" };
+
+    list1 = scan_dir(dirs[0], &n1, comm);
+    list2 = scan_dir(dirs[1], &n2, comm);
+
+    memset(&job, 0, sizeof(job));
+    job.pairs = pair_files(list1, n1, list2, n2, &job.npairs);
+    job.comm = comm;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    if (memory_limit < 1)
+        memory_limit = (int64_t)sysconf(_SC_PHYS_PAGES)
+                * sysconf(_SC_PAGESIZE) / 2;
+
+    nthr = nthreads;
+    if (nthr < 1) nthr = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthr < 1) nthr = 1;
+    nthr = MIN(nthr, job.npairs);
+
+    threads = malloc((nthr + 1) * sizeof(*threads));
+    for (i = 0; i < nthr; i++)
+        pthread_create(&threads[i], NULL, diff_dirs_worker, &job);
+
+    /* Print the output of each pair in turn as soon as it is ready */
+    for (i = 0; i < job.npairs; i++) {
+        p = job.pairs + i;
+        pthread_mutex_lock(&job.lock);
+        while (!p->done)
+            pthread_cond_wait(&job.cond, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+
+        if (p->output && p->output != stdout)
+            copy_output(p->output);
+    }
+
+    for (i = 0; i < nthr; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (i = 0; i < job.npairs; i++) {
+        p = job.pairs + i;
+        if (p->status != PAIR_SAME && p->status != PAIR_SKIPPED) ndiffer++;
+    }
+
+    if (!quiet) {
+        printf("\n%8s %8s %7s  %s\n", "Step", "Status", "Blocks", "Files");
+        for (i = 0; i < job.npairs; i++) {
+            p = job.pairs + i;
+            if (p->status == PAIR_SKIPPED) continue;
+            printf("%8i %8s %7i  %s %s\n", p->step, status_c[p->status],
+                   p->ndiffer, p->file1 ? p->file1 : "-",
+                   p->file2 ? p->file2 : "-");
         }
+        printf("\n%i of %i pairs differ\n", ndiffer, job.npairs);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+
+    for (i = 0; i < n1; i++) free(list1[i].name);
+    for (i = 0; i < n2; i++) free(list2[i].name);
+    free(list1);
+    free(list2);
+    free(job.pairs);
+
+    return ndiffer;
+}
+
+
+/*
+ * Handle the modes which go through the blocks of the first file one at a
+ * time: comparing against many candidate files, writing a signature file or
+ * comparing against one.
+ */
+static int diff_each_block(sdf_file_t **handles, struct multi_job *job,
+                           FILE *sig_fd)
+{
+    sdf_file_t *h = handles[0];
+    sdf_block_t *b, *next;
+    int n, idx, range_start = 0, gotdiff = 0;
+
+    next = h->blocklist;
+    for (idx = 1; next && !stop_diff; idx++) {
+        h->current_block = b = next;
+        next = b->next;
 
-        /* Only consider blocks in the blocktype mask */
-        if (blocktype_mask && blocktype_mask[b->blocktype] == 0)
+        if (!block_selected(b, idx, &range_start))
             continue;
 
-        b2 = sdf_find_block_by_id(h2, b->id);
-        if (!b2) {
-            if (metadata && !quiet)
-                print_metadata(b, idx, h->nblocks);
-            else if (!quiet) {
-                print_header();
-                print_metadata_id(b, idx, handles[0]->nblocks);
-                printf(" - not in second file\n");
-            }
+        if (job) {
+            if (diff_multi(handles, job, b, idx))
+                stop_diff = first_diff;
             continue;
         }
 
-        gotdiff += diff_block(handles, b, b2, idx);
+        if (sig_fd) {
+            write_block_signature(sig_fd, h, b);
+            continue;
+        }
+
+        if (signature_file) {
+            n = diff_signature(h, b, idx);
+            if (n) stop_diff = first_diff;
+            gotdiff += n;
+        }
 /*
         switch (b->blocktype) {
         case SDF_BLOCKTYPE_PLAIN_DERIVED:
@@ -1918,12 +4581,102 @@ int main(int argc, char **argv)
             print_data(b);
             break;
         default:
-            printf("Unsupported blocktype %s\n",
-                   sdf_blocktype_c[b->blocktype]);
+            fprintf(out, "Unsupported blocktype %s\n",
+                    sdf_blocktype_c[b->blocktype]);
         }
 */
     }
 
+    return gotdiff;
+}
+
+
+int main(int argc, char **argv)
+{
+    char **files = NULL;
+    int i;
+    //int nelements_max;
+    sdf_file_t *h, **handles;
+    struct candidate *cand = NULL;
+    struct multi_job job;
+    FILE *sig_fd = NULL;
+    //sdf_block_t *mesh, *mesh0;
+    //list_t *station_blocks;
+    comm_t comm;
+    int gotdiff = 0;
+
+    files = parse_args(&argc, &argv);
+    diff_stats_setup();
+
+#ifdef PARALLEL
+    MPI_Init(&argc, &argv);
+    MPI_Comm_dup(MPI_COMM_WORLD, &comm);
+#else
+    comm = 0;
+#endif
+
+    out = stdout;
+
+    if (dir_mode) {
+        gotdiff = diff_dirs(files, comm);
+        free(files);
+        free_memory(NULL);
+#ifdef PARALLEL
+        MPI_Finalize();
+#endif
+        return gotdiff;
+    }
+
+    handles = calloc(nfiles, sizeof(*handles));
+    for (i=0; i<nfiles; i++) {
+        h = handles[i] = open_file(files[i], comm);
+        if (!h)
+            return 1;
+    }
+    free(files);
+
+    h = handles[0];
+
+    if (particle_id)
+        setup_id_joins(handles);
+
+    if (nfiles > 2) {
+        if (nthreads < 1) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads < 1) nthreads = 1;
+        cand = calloc(nfiles - 1, sizeof(*cand));
+        if (!cand) {
+            fprintf(stderr, "Unable to allocate candidate list\n");
+            return 1;
+        }
+        for (i = 0; i < nfiles - 1; i++)
+            cand[i].h = handles[i+1];
+        if (diff_multi_start(&job, cand, nfiles - 1))
+            return 1;
+        done_header = 1;
+    }
+
+    //list_init(&station_blocks);
+
+    if (signature_file) {
+        read_signatures();
+        set_header_string(signature_file, h->filename);
+    } else if (write_signature) {
+        sig_fd = fopen(write_signature, "w");
+        if (!sig_fd) {
+            fprintf(stderr, "Error opening file %s\n", write_signature);
+            return 1;
+        }
+        fprintf(sig_fd, "%s %i\n", SIGNATURE_MAGIC, SIGNATURE_VERSION);
+    } else
+        set_header_string(handles[0]->filename, handles[1]->filename);
+
+    //nelements_max = 0;
+    //mesh0 = NULL;
+    if (cand || sig_fd || signature_file)
+        gotdiff = diff_each_block(handles, cand ? &job : NULL, sig_fd);
+    else
+        gotdiff = diff_files(handles);
+
 /*
     if (mesh0 && (variable_ids || nrange > 0)) {
         nelements_max = 0;
@@ -1941,7 +4694,7 @@ int main(int argc, char **argv)
             b = list_start(station_blocks);
             for (i = 0; i < station_blocks->count; i++) {
                 idx = n + mesh0->offset - b->offset;
-                printf(format_space,1);
+                fprintf(out, format_space,1);
                 if (idx >= 0 && idx < b->nelements_local)
                     print_value_element(b->data, b->datatype_out, n);
                 else
@@ -1949,12 +4702,30 @@ int main(int argc, char **argv)
                 b = list_next(station_blocks);
             }
 
-            printf("\n");
+            fprintf(out, "\n");
         }
     }
 
     list_destroy(&station_blocks);
 */
+    if (cand) {
+        diff_multi_stop(&job);
+        gotdiff = print_multi_summary(handles, cand);
+        free(cand);
+    }
+
+    print_report_count();
+
+    if (output_file)
+        write_error_fields(handles);
+
+    if (sig_fd)
+        fclose(sig_fd);
+
+    if (signature_file)
+        free_signatures();
+
+    free_id_joins();
     if (range_list) free(range_list);
     if (blocktype_mask) free(blocktype_mask);
 
@@ -1966,9 +4737,11 @@ int main(int argc, char **argv)
 
 int close_files(sdf_file_t **handles)
 {
+    int i;
+
     free_memory(handles);
-    sdf_close(handles[0]);
-    sdf_close(handles[1]);
+    for (i = 0; i < nfiles; i++)
+        sdf_close(handles[i]);
     free(handles);
 #ifdef PARALLEL
     MPI_Finalize();